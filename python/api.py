@@ -0,0 +1,144 @@
+"""Scripting interface for Vision ML models.
+
+Functions accept any object which supports the buffer protocol (bytes, bytearray, memoryview, numpy arrays, ...).
+Inputs are passed to the native library without copying, results are written into `out` if it is provided,
+otherwise a new bytearray is returned. Images are 8-bit with 4 channels, BGRA by default which matches
+`Node.pixelData()` for RGBA/U8 documents. Masks are 8-bit, one channel.
+
+Example::
+
+    from vision_tools import api
+
+    node = doc.activeNode()
+    w, h = doc.width(), doc.height()
+    mask = api.remove_background(node.pixelData(0, 0, w, h), w, h)
+"""
+
+from __future__ import annotations  # PEP 604 annotations on Python < 3.10
+
+import ctypes
+
+RGBA = 0
+BGRA = 1
+
+_lib = None
+_segmentation_extent = None
+
+
+def _bind(lib: ctypes.CDLL):
+    """Called by the extension after the native library is loaded."""
+    global _lib
+    i, p = ctypes.c_int, ctypes.c_void_p
+    lib.vision_ml_last_error.restype = ctypes.c_char_p
+    lib.vision_ml_encode_segmentation_image.argtypes = [p, i, i, i, i]
+    lib.vision_ml_predict_segmentation_point.argtypes = [i, i, p, i, i, i]
+    lib.vision_ml_predict_segmentation_box.argtypes = [i, i, i, i, p, i, i, i]
+    lib.vision_ml_remove_background.argtypes = [p, i, i, i, i, p, i]
+    lib.vision_ml_inpaint.argtypes = [p, i, i, i, i, p, i, p, i]
+    _lib = lib
+
+
+class _Py_buffer(ctypes.Structure):
+    _fields_ = [
+        ("buf", ctypes.c_void_p),
+        ("obj", ctypes.c_void_p),
+        ("len", ctypes.c_ssize_t),
+        ("itemsize", ctypes.c_ssize_t),
+        ("readonly", ctypes.c_int),
+        ("ndim", ctypes.c_int),
+        ("format", ctypes.c_char_p),
+        ("shape", ctypes.POINTER(ctypes.c_ssize_t)),
+        ("strides", ctypes.POINTER(ctypes.c_ssize_t)),
+        ("suboffsets", ctypes.POINTER(ctypes.c_ssize_t)),
+        ("internal", ctypes.c_void_p),
+    ]
+
+
+_PyBUF_WRITABLE = 0x0001
+_PyBUF_STRIDES = 0x0010 | 0x0008  # includes PyBUF_ND
+_PyBUF_C_CONTIGUOUS = 0x0020 | _PyBUF_STRIDES
+
+_get_buffer = ctypes.pythonapi.PyObject_GetBuffer
+_get_buffer.argtypes = [ctypes.py_object, ctypes.POINTER(_Py_buffer), ctypes.c_int]
+_release_buffer = ctypes.pythonapi.PyBuffer_Release
+_release_buffer.argtypes = [ctypes.POINTER(_Py_buffer)]
+_release_buffer.restype = None
+
+
+class _Buffer:
+    """Exposes the memory of a Python object to native code for the duration of a `with` block."""
+
+    def __init__(self, obj, size: int, writable=False):
+        self._view = _Py_buffer()
+        flags = _PyBUF_C_CONTIGUOUS | (_PyBUF_WRITABLE if writable else 0)
+        _get_buffer(obj, ctypes.byref(self._view), flags)  # raises on failure
+        if self._view.len < size:
+            _release_buffer(ctypes.byref(self._view))
+            raise ValueError(f"Buffer is too small: {self._view.len} bytes, expected {size}")
+
+    def __enter__(self):
+        return self._view.buf
+
+    def __exit__(self, *args):
+        _release_buffer(ctypes.byref(self._view))
+
+
+def _check(result: int):
+    if result != 0:
+        raise RuntimeError(_lib.vision_ml_last_error().decode("utf-8", "replace"))
+
+
+def _library():
+    if _lib is None:
+        raise RuntimeError("Vision ML library is not loaded")
+    return _lib
+
+
+def encode_segmentation_image(pixels, width: int, height: int, stride: int = 0, format=BGRA):
+    """Runs the segmentation image encoder. Following predictions refer to this image."""
+    global _segmentation_extent
+    lib = _library()
+    stride = stride or width * 4
+    with _Buffer(pixels, stride * height) as ptr:
+        _check(lib.vision_ml_encode_segmentation_image(ptr, width, height, stride, format))
+    _segmentation_extent = (width, height)
+
+
+def predict_segmentation_mask(point: tuple[int, int] | None = None, box: tuple[int, int, int, int] | None = None, out=None):
+    """Predicts a mask for the last encoded image from either a point or a box (x0, y0, x1, y1)."""
+    lib = _library()
+    if _segmentation_extent is None:
+        raise RuntimeError("No image was encoded for segmentation")
+    width, height = _segmentation_extent
+    out = bytearray(width * height) if out is None else out
+    with _Buffer(out, width * height, writable=True) as ptr:
+        if box is not None:
+            _check(lib.vision_ml_predict_segmentation_box(*box, ptr, width, height, width))
+        elif point is not None:
+            _check(lib.vision_ml_predict_segmentation_point(*point, ptr, width, height, width))
+        else:
+            raise ValueError("Either point or box must be specified")
+    return out
+
+
+def remove_background(pixels, width: int, height: int, stride: int = 0, format=BGRA, out=None):
+    """Returns the foreground mask of the image. Results are cached by image content and model."""
+    lib = _library()
+    stride = stride or width * 4
+    out = bytearray(width * height) if out is None else out
+    with _Buffer(pixels, stride * height) as src, _Buffer(out, width * height, writable=True) as dst:
+        _check(lib.vision_ml_remove_background(src, width, height, stride, format, dst, width))
+    return out
+
+
+def inpaint(pixels, mask, width: int, height: int, stride: int = 0, mask_stride: int = 0, format=BGRA, out=None):
+    """Fills the masked region of the image like the inpaint tool. The result has the same size and pixel format as
+    the input, pixels away from the mask are copied."""
+    lib = _library()
+    stride = stride or width * 4
+    mask_stride = mask_stride or width
+    out = bytearray(width * height * 4) if out is None else out
+    with _Buffer(pixels, stride * height) as src, _Buffer(mask, mask_stride * height) as msk:
+        with _Buffer(out, width * height * 4, writable=True) as dst:
+            _check(lib.vision_ml_inpaint(src, width, height, stride, format, msk, mask_stride, dst, width * 4))
+    return out
@@ -1,9 +1,13 @@
+from __future__ import annotations  # PEP 604 annotations on Python < 3.10
+
 import ctypes
 import os
 import sys
 from krita import Extension, Krita
 from pathlib import Path
 
+from . import api
+
 if sys.platform in ["win32", "cygwin", "msys"]:
     platform = "windows"
 elif sys.platform == "linux":
@@ -37,6 +41,7 @@ class VisionMLExtension(Extension):
 
     def __init__(self, parent):
         super().__init__(parent)
+        self._lib = None
 
         ext = {"windows": ".dll", "linux": ".so", "macos": ".dylib"}[platform]
         lib_dir = Path(__file__).parent / "lib"
@@ -58,6 +63,8 @@ class VisionMLExtension(Extension):
         try:
             lib = ctypes.CDLL(str(lib_file.resolve()))
             lib.load_vision_ml_plugin()
+            api._bind(lib)
+            self._lib = lib
 
         except OSError as e:
             deps = ""
@@ -80,7 +87,15 @@ class VisionMLExtension(Extension):
         pass
 
     def createActions(self, window):
-        pass
+        if self._lib is None:
+            return
+        action = window.createAction(
+            "vision_ml_remove_background_batch",
+            "Background Removal (Selected Layers and Frames)",
+            "tools/scripts",
+        )
+        # triggered passes a "checked" argument, which the native function doesn't take
+        action.triggered.connect(lambda checked=False: self._lib.vision_ml_remove_background_batch())
 
 
 Krita.instance().addExtension(VisionMLExtension(Krita.instance()))
@@ -1,11 +1,12 @@
 #include "VisionML.h"
+#include "VisionMLBackendLoader.h"
+#include "VisionMLImageOps.h"
 
 #include "KisOptionButtonStrip.h"
-#include "KoColorSpace.h"
 #include "KoJsonTrader.h"
 #include "KoResourcePaths.h"
 #include "kis_icon_utils.h"
-#include "kis_paint_device.h"
+#include "kis_image_config.h"
 #include <klocalizedstring.h>
 #include <ksharedconfig.h>
 
@@ -13,14 +14,21 @@
 #include <QDebug>
 #include <QDesktopServices>
 #include <QDir>
-#include <QFileSystemWatcher>
+#include <QElapsedTimer>
 #include <QHBoxLayout>
+#include <QLocale>
 #include <QMessageBox>
 #include <QMutexLocker>
+#include <QPointer>
+#include <QSaveFile>
 #include <QString>
+#include <QThread>
+#include <QThreadPool>
 #include <QToolButton>
 #include <QUrl>
 
+#include <mutex>
+#include <sstream>
 #include <string>
 
 #include <ggml-backend.h>
@@ -34,6 +42,9 @@ void handleGGMLFatalError(const char *error_message)
     throw visp::exception(error_message);
 }
 
+// Number of individual events kept when timings are recorded as trace, older events are dropped.
+size_t const traceCapacity = 100000;
+
 struct Paths {
     QString plugin;
     QString lib;
@@ -52,52 +63,57 @@ void initPaths()
     }
 }
 
-void loadGGMLBackend(char const *name)
+// Number of threads Krita is configured to use for image processing.
+int kritaThreadLimit()
+{
+    return std::max(1, KisImageConfig(true).maxNumberOfThreads());
+}
+
+QString workerExecutable()
 {
 #if defined(WIN32)
-    char const *ext = "dll";
-#elif defined(__APPLE__)
-    char const *ext = "dylib";
+    return paths.lib + "visionml-worker.exe";
 #else
-    char const *ext = "so";
+    return paths.lib + "visionml-worker";
 #endif
-    QString path = QString("%1ggml-%2.%3").arg(paths.lib, name, ext);
-    ggml_backend_load(path.toUtf8().constData());
 }
 
-QString findModelPath(VisionMLTask task)
+// Calls fn when leaving the scope, also on exceptions.
+template<typename Fn>
+class ScopeExit
 {
-    switch (task) {
-    case VisionMLTask::segmentation:
-        return paths.models + "sam";
-    case VisionMLTask::background_removal:
-        return paths.models + "birefnet";
-    case VisionMLTask::inpainting:
-        return paths.models + "migan";
-    default:
-        return paths.models;
+public:
+    explicit ScopeExit(Fn fn)
+        : m_fn(std::move(fn))
+    {
     }
-}
+    ~ScopeExit()
+    {
+        m_fn();
+    }
+
+private:
+    Fn m_fn;
+};
 
-char const *toString(VisionMLTask task)
+// Runs inference in the worker process if there is one, otherwise (or if it stopped responding) in-process.
+template<typename Remote, typename Local>
+auto runInference(std::unique_ptr<VisionMLWorkerClient> &worker, Remote &&remote, Local &&local)
 {
-    switch (task) {
-    case VisionMLTask::segmentation:
-        return "segmentation";
-    case VisionMLTask::inpainting:
-        return "inpainting";
-    case VisionMLTask::background_removal:
-        return "background_removal";
-    default:
-        return "unknown";
+    if (worker) {
+        try {
+            return remote(*worker);
+        } catch (VisionMLWorkerClient::Unavailable const &e) {
+            qWarning() << "[VisionML] Inference worker unavailable, running in-process:" << e.what();
+            worker.reset();
+        }
     }
+    return local();
 }
 
-void unloadFromGPU(visp::compute_graph &graph, visp::backend_type devType)
+QString findModelPath(VisionMLTask task)
 {
-    if (devType == visp::backend_type::gpu) {
-        graph = {};
-    }
+    return paths.models + VisionMLModelRegistry::taskDirectory(task);
 }
 
 } // namespace
@@ -105,38 +121,98 @@ void unloadFromGPU(visp::compute_graph &graph, visp::backend_type devType)
 QSharedPointer<VisionModels> VisionModels::create()
 {
     initPaths();
-
-    QSharedPointer<VisionModels> result(new VisionModels());
-    if (!result->m_backend) {
-        return nullptr;
-    }
-    return result;
+    return QSharedPointer<VisionModels>(new VisionModels());
 }
 
+// Backend libraries, backends and models are loaded on first use (see loadBackends and ensureInitialized), so that
+// Krita sessions which don't use the plugin don't pay for it at startup.
 VisionModels::VisionModels()
 {
-    ggml_set_abort_callback(handleGGMLFatalError);
+    QElapsedTimer timer;
+    timer.start();
 
-    loadGGMLBackend("cpu");
-    loadGGMLBackend("vulkan");
+    ggml_set_abort_callback(handleGGMLFatalError);
 
     m_config = KSharedConfig::openConfig()->group("VisionML");
+
+    m_registry = new VisionMLModelRegistry(paths.models, this);
     QString backendString = m_config.readEntry("backend", "cpu");
-    visp::backend_type backendType = backendString == "gpu" ? visp::backend_type::gpu : visp::backend_type::cpu;
+    m_backendType = backendString == "gpu" ? visp::backend_type::gpu : visp::backend_type::cpu;
 
     configureModel(VisionMLTask::segmentation, "sam/MobileSAM-F16.gguf");
     configureModel(VisionMLTask::inpainting, "migan/MIGAN-512-places2-F16.gguf");
     configureModel(VisionMLTask::background_removal, "birefnet/BiRefNet-lite-F16.gguf");
 
-    QString err = initialize(backendType);
-    if (!err.isEmpty()) {
-        QMessageBox::warning(nullptr,
-                             i18nc("@title:window", "Krita - VisionML Plugin"),
-                             i18n("Failed to initialize AI tools plugin.\n") + err);
-        return;
+    for (int i = 0; i < (int)VisionMLTask::_count; ++i) {
+        m_threadCount[i] = m_config.readEntry(QString("threads_%1").arg(toString(VisionMLTask(i))), 0);
+    }
+    m_pinThreads = m_config.readEntry("pin_threads", false);
+    applyThreadSettings();
+
+    // "timings": "json" or "trace". With "inference_worker", the pipeline runs in the worker process and its stages
+    // (model loading, "<task>.sam_encode", ...) are not recorded. Only the stages of this process are, eg.
+    // "segmentation.encode", which then includes the round trip to the worker.
+    QString const timings = m_config.readEntry("timings", QString());
+    if (timings == "json" || timings == "trace") {
+        m_timingsTrace = timings == "trace";
+        m_timings = std::make_unique<VisionMLTimings>(m_timingsTrace ? traceCapacity : 0);
+        m_timingsFile = m_config.readEntry("timings_file", paths.plugin + "timings.json");
+    }
+    QString const recordDirectory = m_config.readEntry("record_session", QString());
+    if (!recordDirectory.isEmpty()) {
+        m_recorder = std::make_unique<VisionMLRecorder>(recordDirectory, m_config.readEntry("record_snapshots", false));
+        m_recorder->record("backend", {{"backend", backendString}});
+    }
+
+    m_budget.memory = m_config.readEntry("memory_budget_mb", 0) * qint64(1024 * 1024);
+    m_budget.latency = m_config.readEntry("latency_budget_ms", 0.0);
+    for (int i = 0; i < (int)VisionMLTask::_count; ++i) {
+        updateActiveModel(VisionMLTask(i));
     }
 
     connect(QCoreApplication::instance(), SIGNAL(aboutToQuit()), this, SLOT(cleanUp()));
+    qDebug() << "[VisionML] Plugin setup took" << timer.elapsed() << "ms";
+}
+
+// Loading the libraries only registers backends and devices. It is needed to know whether a GPU is available,
+// also when inference runs in the worker process. Probing for Vulkan devices and selecting the CPU variant take
+// a while, so it happens when the plugin is first used rather than at startup.
+void VisionModels::loadBackends()
+{
+    static std::once_flag loaded;
+    std::call_once(loaded, []() {
+        QElapsedTimer timer;
+        timer.start();
+        VisionMLBackendLoader::loadBackends(paths.lib);
+        qDebug() << "[VisionML] Loading GGML backends took" << timer.elapsed() << "ms";
+    });
+}
+
+bool VisionModels::isGpuAvailable()
+{
+    loadBackends();
+    return visp::backend_is_available(visp::backend_type::gpu);
+}
+
+// On CPU, a memory or latency budget may select a smaller weight variant (eg. Q8_0) of the configured model.
+// Registry directories are only scanned when a budget is set.
+void VisionModels::updateActiveModel(VisionMLTask task)
+{
+    QString const &name = m_modelName[(int)task];
+    QString active = name;
+    if (m_backendType == visp::backend_type::cpu && (m_budget.memory > 0 || m_budget.latency > 0)) {
+        active = m_registry->selectVariant(name, m_budget);
+        if (active != name) {
+            qDebug() << "[VisionML] Using" << active << "instead of" << name << "to stay within budget";
+        }
+    }
+    m_activeModelName[(int)task] = active;
+    if (m_pipeline) {
+        m_pipeline->setModelName(task, active.toStdString());
+    }
+    if (m_worker) {
+        m_worker->setModelName(task, active);
+    }    updateSegmentationImageFlag();
 }
 
 void VisionModels::configureModel(VisionMLTask task, QString const &defaultName)
@@ -148,103 +224,261 @@ void VisionModels::configureModel(VisionMLTask task, QString const &defaultName)
     m_modelName[(int)task] = modelName;
 }
 
-QString VisionModels::initialize(visp::backend_type backendType)
+// Called when a tool or filter of the plugin is first shown. Initializes in the background while the user is still
+// choosing where to click, so that the first inference doesn't wait for it. Off with "preinitialize" = false.
+void VisionModels::preinitialize()
 {
-    QMutexLocker lock(&m_mutex);
-    m_sam = {};
-    m_birefnet = {};
-    m_migan = {};
+    if (m_preinitialization.valid() || !m_config.readEntry("preinitialize", true)) {
+        return;
+    }
+    m_preinitialization = std::async(std::launch::async, [this]() {
+        QMutexLocker lock(&m_mutex);
+        try {
+            ensureInitialized();
+        } catch (std::exception const &e) {
+            qWarning() << "[VisionML] Background initialization failed:" << e.what();
+        }
+    });
+}
+
+// Connects to the inference worker if it is enabled, otherwise initializes the in-process pipeline.
+// Throws if neither is available. Must be called with m_mutex locked.
+void VisionModels::ensureInitialized()
+{
+    if (m_initialized) {
+        return;
+    }
+    loadBackends();
+    connectWorker();
+    if (!m_worker) {
+        pipeline();
+    }
+    m_initialized = true;
+}
+
+// In-process pipeline, also used as fallback when the worker is not available. Must be called with m_mutex locked.
+VisionMLPipeline &VisionModels::pipeline()
+{
+    if (m_pipeline) {
+        return *m_pipeline;
+    }
+    QElapsedTimer timer;
+    timer.start();
     try {
-        m_backend = visp::backend_init(backendType);
-    } catch (const std::exception &e) {
-        return QString(e.what());
+        m_pipeline = std::make_unique<VisionMLPipeline>(m_backendType, paths.models.toStdString());
+    } catch (std::exception const &e) {
+        throw std::runtime_error(std::string("Failed to initialize AI tools plugin.\n") + e.what());
+    }
+    for (int i = 0; i < (int)VisionMLTask::_count; ++i) {
+        m_pipeline->setModelName(VisionMLTask(i), m_activeModelName[i].toStdString());
     }
-    m_backendType = backendType;
+    m_pipeline->setTimings(m_timings.get());
+    m_pipeline->setGraphProfile(graphProfileFile().toStdString());
+    applyThreadSettings();
+    qDebug() << "[VisionML] Initialized" << (m_backendType == visp::backend_type::gpu ? "GPU" : "CPU")
+             << "backend in" << timer.elapsed() << "ms";
+    return *m_pipeline;
+}
 
-    m_config.writeEntry("backend", backendType == visp::backend_type::gpu ? "gpu" : "cpu");
-    return QString();
+// Graph profile file if "profile_graphs" is enabled, otherwise empty.
+QString VisionModels::graphProfileFile() const
+{
+    if (!m_config.readEntry("profile_graphs", false)) {
+        return {};
+    }
+    QString file = m_config.readEntry("profile_file", paths.plugin + "graph-profile.txt");
+    qDebug() << "[VisionML] Profiling GGML graphs, writing to" << file;
+    return file;
 }
 
+// Optional worker process which keeps models loaded across Krita sessions and isolates backend crashes.
+void VisionModels::connectWorker()
+{
+    m_worker.reset();
+    if (!m_config.readEntry("inference_worker", false)) {
+        return;
+    }
+    auto worker = std::make_unique<VisionMLWorkerClient>(workerExecutable(), paths.models, paths.lib);
+    worker->setIdleTimeout(m_config.readEntry("inference_worker_idle_timeout", 30));
+    worker->setBackend(m_backendType);
+    for (int i = 0; i < (int)VisionMLTask::_count; ++i) {
+        worker->setModelName(VisionMLTask(i), m_activeModelName[i]);
+    }
+    worker->setGraphProfile(graphProfileFile());
+    try {
+        worker->connect();
+        m_worker = std::move(worker);
+        applyThreadSettings();
+    } catch (VisionMLWorkerClient::Unavailable const &e) {
+        qWarning() << "[VisionML] Inference worker unavailable, running in-process:" << e.what();
+    }
+}
+
+// Timings of these calls include waiting for other tools and the round trip to the worker process, if there is one.
 void VisionModels::encodeSegmentationImage(visp::image_view const &image)
 {
+    VisionMLScopedTimer timer(m_timings.get(), "segmentation.encode");
     QMutexLocker lock(&m_mutex);
-    if (!m_sam.weights) {
-        unloadModels();
-        QByteArray path = modelPath(VisionMLTask::segmentation);
-        m_sam = visp::sam_load_model(path.data(), m_backend);
-    }
-    visp::sam_encode(m_sam, image);
+    ScopeExit update([this]() { updateSegmentationImageFlag(); });
+    ensureInitialized();
+    runInference(
+        m_worker,
+        [&](VisionMLWorkerClient &w) { w.encodeSegmentationImage(image); },
+        [&]() { pipeline().encodeSegmentationImage(image); });
 }
 
+// Doesn't wait for inference on other threads, so that the UI can check it before starting a stroke.
 bool VisionModels::hasSegmentationImage() const
 {
-    return m_sam.input_image != nullptr;
+    return m_hasSegmentationImage;
+}
+
+// Models of other tasks may replace the SAM model (and its image embedding), and the worker may drop it for another
+// session. Must be called with m_mutex locked, after anything which may have changed it.
+void VisionModels::updateSegmentationImageFlag()
+{
+    m_hasSegmentationImage = m_worker ? m_worker->hasSegmentationImage()
+                                      : m_pipeline && m_pipeline->hasSegmentationImage();
 }
 
 visp::image_data VisionModels::predictSegmentationMask(visp::i32x2 point)
 {
+    VisionMLScopedTimer timer(m_timings.get(), "segmentation.predict");
     QMutexLocker lock(&m_mutex);
-    return visp::sam_compute(m_sam, point);
+    ScopeExit update([this]() { updateSegmentationImageFlag(); });
+    ensureInitialized();
+    return runInference(
+        m_worker,
+        [&](VisionMLWorkerClient &w) { return w.predictSegmentationMask(point); },
+        [&]() { return predictSegmentationMaskInProcess(point); });
 }
 
 visp::image_data VisionModels::predictSegmentationMask(visp::box_2d box)
 {
+    VisionMLScopedTimer timer(m_timings.get(), "segmentation.predict");
     QMutexLocker lock(&m_mutex);
-    return visp::sam_compute(m_sam, box);
+    ScopeExit update([this]() { updateSegmentationImageFlag(); });
+    ensureInitialized();
+    return runInference(
+        m_worker,
+        [&](VisionMLWorkerClient &w) { return w.predictSegmentationMask(box); },
+        [&]() { return predictSegmentationMaskInProcess(box); });
+}
+
+// The encoded image is lost if the worker stops between encode and predict.
+template<typename Prompt>
+visp::image_data VisionModels::predictSegmentationMaskInProcess(Prompt prompt)
+{
+    if (!m_pipeline || !m_pipeline->hasSegmentationImage()) {
+        throw std::runtime_error("Inference worker stopped, please try again.");
+    }
+    return m_pipeline->predictSegmentationMask(prompt);
 }
 
 visp::image_data VisionModels::removeBackground(visp::image_view const &image)
 {
+    VisionMLScopedTimer timer(m_timings.get(), "background_removal.inference");
     QMutexLocker lock(&m_mutex);
-    if (!m_birefnet.weights) {
-        QByteArray path = modelPath(VisionMLTask::background_removal);
-        m_birefnet = visp::birefnet_load_model(path.data(), m_backend);
-    }
-    auto result = visp::birefnet_compute(m_birefnet, image);
-    unloadFromGPU(m_birefnet.graph, m_backendType);
-    return result;
+    ScopeExit update([this]() { updateSegmentationImageFlag(); });
+    ensureInitialized();
+    return runInference(
+        m_worker,
+        [&](VisionMLWorkerClient &w) { return w.removeBackground(image); },
+        [&]() { return pipeline().removeBackground(image); });
 }
 
-visp::image_data VisionModels::inpaint(visp::image_view const &image, visp::image_view const &mask)
+int VisionModels::inpaintResolution(QSize const &extent)
 {
     QMutexLocker lock(&m_mutex);
-    if (!m_migan.weights) {
-        QByteArray path = modelPath(VisionMLTask::inpainting);
-        m_migan = visp::migan_load_model(path.data(), m_backend);
-    }
-    return visp::migan_compute(m_migan, image, mask);
+    ensureInitialized();
+    return runInference(
+        m_worker,
+        [&](VisionMLWorkerClient &w) { return w.inpaintResolution(extent.width(), extent.height()); },
+        [&]() { return pipeline().inpaintResolution(extent.width(), extent.height()); });
+}
+
+visp::image_data VisionModels::inpaint(visp::image_view const &image, visp::image_view const &mask, int resolution)
+{
+    VisionMLScopedTimer timer(m_timings.get(), "inpainting.inference");
+    QMutexLocker lock(&m_mutex);
+    ScopeExit update([this]() { updateSegmentationImageFlag(); });
+    ensureInitialized();
+    return runInference(
+        m_worker,
+        [&](VisionMLWorkerClient &w) { return w.inpaint(image, mask, resolution); },
+        [&]() { return pipeline().inpaint(image, mask, resolution); });
+}
+
+VisionModels::InpaintRegion VisionModels::inpaintRegion(QRect const &maskBounds, QRect const &imageBounds)
+{
+    int const pad = 64;
+    InpaintRegion region;
+    region.resolution = inpaintResolution(maskBounds.adjusted(-pad, -pad, pad, pad).size());
+    region.bounds = VisionMLImage::padBounds(maskBounds, pad, region.resolution, imageBounds);
+    return region;
+}
+
+visp::image_data
+VisionModels::inpaintBlended(visp::image_view const &image, visp::image_view const &mask, int resolution)
+{
+    visp::image_data result = inpaint(image, mask, resolution);
+    VisionMLScopedTimer timer(m_timings.get(), "inpainting.blend_mask");
+    VisionMLImageOps::erodeBlurMaskToAlpha(mask, result);
+    return result;
 }
 
 void VisionModels::unload(VisionMLTask task)
 {
-    // Models and working memory are not that big.
-    // Keep them in RAM for CPU inference to avoid loading models again from disk.
+    writeTimings();
+
+    // Keep models and working memory in RAM for CPU inference to avoid loading models again from disk. How much
+    // that is, is shown in the backend options (see memoryUsage), where it can also be released.
     // Unload from GPU memory because VRAM is more precious.
     if (m_backendType == visp::backend_type::gpu) {
         QMutexLocker lock(&m_mutex);
-        switch (task) {
-        case VisionMLTask::segmentation:
-            m_sam = {};
-            break;
-        case VisionMLTask::inpainting:
-            m_migan = {};
-            break;
-        case VisionMLTask::background_removal:
-            m_birefnet = {};
-            break;
-        default:
-            break;
-        }
+        ScopeExit update([this]() { updateSegmentationImageFlag(); });
+        runInference(
+            m_worker,
+            [&](VisionMLWorkerClient &w) { w.unload(task); },
+            [&]() {
+                if (m_pipeline) {
+                    m_pipeline->unload(task);
+                }
+            });
     }
 }
 
-QByteArray VisionModels::modelPath(VisionMLTask task) const
+bool VisionModels::memoryUsage(VisionMLTask task, VisionMLPipeline::MemoryUsage &usage)
 {
-    QString path = paths.models + modelName(task);
-    if (!QFile::exists(path)) {
-        throw std::runtime_error("Model file not found: " + path.toStdString());
+    if (!m_mutex.tryLock()) {
+        return false;
+    }
+    bool success = true;
+    try {
+        usage = runInference(
+            m_worker,
+            [&](VisionMLWorkerClient &w) { return w.memoryUsage(task); },
+            [&]() { return m_pipeline ? m_pipeline->memoryUsage(task) : VisionMLPipeline::MemoryUsage{}; });
+    } catch (std::exception const &e) {
+        qWarning() << "[VisionML] Failed to query memory usage:" << e.what();
+        success = false;
     }
-    return path.toUtf8();
+    m_mutex.unlock();
+    return success;
+}
+
+void VisionModels::releaseMemory(VisionMLTask task)
+{
+    QMutexLocker lock(&m_mutex);
+    ScopeExit update([this]() { updateSegmentationImageFlag(); });
+    runInference(
+        m_worker,
+        [&](VisionMLWorkerClient &w) { w.releaseMemory(task); },
+        [&]() {
+            if (m_pipeline) {
+                m_pipeline->releaseMemory(task);
+            }
+        });
 }
 
 visp::backend_type VisionModels::backend() const
@@ -257,13 +491,36 @@ bool VisionModels::setBackend(visp::backend_type backendType)
     if (backendType == m_backendType) {
         return true;
     }
-    QString err = initialize(backendType);
-    if (!err.isEmpty()) {
-        QMessageBox::warning(nullptr,
-                             i18nc("@title:window", "Krita - Vision ML Tools Plugin"),
-                             i18n("Error while trying to switch inference backend.\n") + err);
-        return false;
+    QMutexLocker lock(&m_mutex);
+    visp::backend_type const previous = m_backendType;
+    bool const wasInitialized = m_initialized;
+    auto reset = [this](visp::backend_type type) {
+        m_worker.reset();
+        m_pipeline.reset();
+        m_hasSegmentationImage = false;
+        m_initialized = false;
+        m_backendType = type;
+        for (int i = 0; i < (int)VisionMLTask::_count; ++i) {
+            updateActiveModel(VisionMLTask(i));
+        }
+    };
+    reset(backendType);
+    if (wasInitialized) {
+        try {
+            ensureInitialized();
+        } catch (std::exception const &e) {
+            reset(previous);
+            lock.unlock();
+            QString message = i18n("Error while trying to switch inference backend.\n") + QString::fromUtf8(e.what());
+            QMessageBox::warning(nullptr, i18nc("@title:window", "Krita - Vision ML Tools Plugin"), message);
+            return false;
+        }
     }
+    m_config.writeEntry("backend", backendType == visp::backend_type::gpu ? "gpu" : "cpu");
+    if (m_recorder) {
+        m_recorder->record("backend", {{"backend", backendType == visp::backend_type::gpu ? "gpu" : "cpu"}});
+    }
+    lock.unlock();
     Q_EMIT backendChanged(m_backendType);
     return true;
 }
@@ -273,6 +530,11 @@ QString const &VisionModels::modelName(VisionMLTask task) const
     return m_modelName[(int)task];
 }
 
+QString const &VisionModels::activeModelName(VisionMLTask task) const
+{
+    return m_activeModelName[(int)task];
+}
+
 void VisionModels::setModelName(VisionMLTask task, QString const &name)
 {
     if (modelName(task) == name) {
@@ -281,92 +543,140 @@ void VisionModels::setModelName(VisionMLTask task, QString const &name)
     QMutexLocker lock(&m_mutex);
     m_modelName[(int)task] = name;
     m_config.writeEntry(QString("model_%1").arg((int)task), name);
-    unloadModels();
+    updateActiveModel(task);
     Q_EMIT modelNameChanged(task, name);
 }
 
-QString VisionModels::backendDeviceDescription() const
+VisionMLModelRegistry &VisionModels::modelRegistry()
 {
-    ggml_backend_dev_t dev = ggml_backend_get_device(m_backend);
-    char const *name = ggml_backend_dev_name(dev);
-    char const *desc = ggml_backend_dev_description(dev);
-    return QString("%1 [%2]").arg(QString(desc).trimmed(), name);
+    return *m_registry;
 }
 
-void VisionModels::unloadModels()
+int VisionModels::threadCount(VisionMLTask task) const
 {
-    m_sam = {};
-    m_birefnet = {};
-    m_migan = {};
+    return m_threadCount[(int)task];
 }
 
-void VisionModels::cleanUp()
+void VisionModels::setThreadCount(VisionMLTask task, int threads)
 {
-    // This would run in the destructor anyway, but because the plugin manager which keeps this
-    // object alive is static, it may happen too late and in arbitrary order. Dynamic libraries
-    // which the plugin relies on may already be gone.
-    unloadModels();
-    m_backend = {};
+    QMutexLocker lock(&m_mutex);
+    m_threadCount[(int)task] = threads;
+    m_config.writeEntry(QString("threads_%1").arg(toString(task)), threads);
+    applyThreadSettings();
 }
 
-//
-// VisionMLImage
+int VisionModels::inferenceThreadCount(VisionMLTask task) const
+{
+    if (m_backendType == visp::backend_type::gpu) {
+        return 1;
+    }
+    int threads = m_threadCount[(int)task] > 0 ? m_threadCount[(int)task] : VisionMLImageOps::physicalCoreCount();
+    return std::min(threads, kritaThreadLimit());
+}
 
-VisionMLImage VisionMLImage::prepare(KisPaintDevice const &device, QRect bounds)
+// Tools run inference and post-processing (VisionMLImageOps) one after the other, so both may use Krita's whole
+// thread budget. Where they overlap (BackgroundRemovalBatch), post-processing is limited to what inference leaves.
+// Must be called with m_mutex locked.
+void VisionModels::applyThreadSettings()
 {
-    VisionMLImage result;
-    if (bounds.isEmpty()) {
-        bounds = device.exactBounds();
+    int const limit = kritaThreadLimit();
+    VisionMLImageOps::setThreadCount(limit);
+    for (int i = 0; i < (int)VisionMLTask::_count; ++i) {
+        int threads = m_threadCount[i] > 0 ? m_threadCount[i] : VisionMLImageOps::physicalCoreCount();
+        threads = std::min(threads, limit);
+        if (m_pipeline) {
+            m_pipeline->setThreadCount(VisionMLTask(i), threads);
+        }
+        if (m_worker) {
+            m_worker->setThreadCount(VisionMLTask(i), threads);
+        }
+    }
+    if (m_pipeline) {
+        m_pipeline->setThreadPinning(m_pinThreads);
+    }
+    if (m_worker) {
+        m_worker->setThreadPinning(m_pinThreads);
     }
-    if (bounds.isEmpty()) {
-        return result; // Can happen eg. when using color label mode without matching layers.
+}
+
+VisionMLTimings *VisionModels::timings()
+{
+    return m_timings.get();
+}
+
+VisionMLRecorder *VisionModels::recorder()
+{
+    return m_recorder.get();
+}
+
+// Overwrites the file with all timings since Krita started.
+void VisionModels::writeTimings()
+{
+    if (!m_timings) {
+        return;
     }
-    KoColorSpace const *cs = device.colorSpace();
-    if (cs->pixelSize() == 4 && cs->id() == "RGBA") {
-        // Stored as BGRA, 8 bits per channel in Krita. No conversions for now, the segmentation network expects
-        // gamma-compressed sRGB, but works fine with other color spaces (probably).
-        result.view.format = visp::image_format::bgra_u8;
-        result.data = QImage(bounds.width(), bounds.height(), QImage::Format_ARGB32);
-        device.readBytes(result.data.bits(), bounds.x(), bounds.y(), bounds.width(), bounds.height());
+    std::ostringstream out;
+    if (m_timingsTrace) {
+        m_timings->writeChromeTrace(out);
     } else {
-        // Convert everything else to QImage::Format_ARGB32 in default color space (sRGB).
-        result.view.format = visp::image_format::argb_u8;
-        result.data = device.convertToQImage(nullptr, bounds);
+        m_timings->writeJson(out);
+    }
+    QSaveFile file(m_timingsFile);
+    std::string const data = out.str();
+    if (!file.open(QIODevice::WriteOnly) || file.write(data.data(), qint64(data.size())) != qint64(data.size())
+        || !file.commit()) {
+        qWarning() << "[VisionML] Failed to write timings to" << m_timingsFile << file.errorString();
     }
-    result.view.extent = {result.data.width(), result.data.height()};
-    result.view.stride = result.data.bytesPerLine();
-    result.view.data = result.data.bits();
-    return result;
 }
 
-// Convert outputs to QImage - this is mainly because they're RGBA, but Krita paint device uses BGRA internally (but may
-// also use some other color space).
-QImage VisionMLImage::convertToQImage(visp::image_view const &img, QRect b)
+// Doesn't wait for initialization, which may be running in the background. Describes the device which the pipeline
+// selects for the backend, or the one reported by the worker process once it is connected.
+QString VisionModels::backendDeviceDescription()
 {
-    if (img.format != visp::image_format::rgba_u8) {
-        throw std::runtime_error("Unsupported image format for conversion to QImage");
+    if (m_mutex.tryLock()) {
+        QString workerDevice = m_worker ? m_worker->backendDeviceDescription() : QString();
+        m_mutex.unlock();
+        if (!workerDevice.isEmpty()) {
+            return workerDevice + i18n(" (worker process)");
+        }
     }
-    if (b.isEmpty()) {
-        b = QRect(0, 0, img.extent[0], img.extent[1]);
+    loadBackends();
+    ggml_backend_dev_t dev = ggml_backend_dev_by_type(m_backendType == visp::backend_type::gpu
+                                                          ? GGML_BACKEND_DEVICE_TYPE_GPU
+                                                          : GGML_BACKEND_DEVICE_TYPE_CPU);
+    if (!dev) {
+        return i18n("Not available: no supported devices found");
     }
+    char const *name = ggml_backend_dev_name(dev);
+    char const *desc = ggml_backend_dev_description(dev);
+    return QString("%1 [%2]").arg(QString(desc).trimmed(), name);
+}
 
-    QImage result(b.width(), b.height(), QImage::Format_RGBA8888);
-    // copy scanlines, row stride might be different
-    size_t rowSize = b.width() * n_bytes(img.format);
-    size_t rowStride = img.extent[0] * n_bytes(img.format);
-    size_t rowOffset = b.x() * n_bytes(img.format);
-    for (int y = 0; y < b.height(); ++y) {
-        memcpy(result.scanLine(y), ((uint8_t const *)img.data) + (y + b.y()) * rowStride + rowOffset, rowSize);
+void VisionModels::cleanUp()
+{
+    // This would run in the destructor anyway, but because the plugin manager which keeps this
+    // object alive is static, it may happen too late and in arbitrary order. Dynamic libraries
+    // which the plugin relies on may already be gone.
+    if (m_preinitialization.valid()) {
+        m_preinitialization.wait();
     }
-    return result;
+    writeTimings();
+    QMutexLocker lock(&m_mutex);
+    m_worker.reset(); // the worker process keeps running for the next session
+    m_pipeline.reset();
+    m_hasSegmentationImage = false;
 }
 
 //
 // VisionMLBackendWidget
 
-VisionMLBackendWidget::VisionMLBackendWidget(QSharedPointer<VisionModels> shared, bool showDevice, QWidget *parent)
+VisionMLBackendWidget::VisionMLBackendWidget(QSharedPointer<VisionModels> shared,
+                                             VisionMLTask task,
+                                             bool showDevice,
+                                             QWidget *parent)
     : KisOptionCollectionWidgetWithHeader(i18n("Backend"), parent)
     , m_shared(std::move(shared))
+    , m_task(task)
 {
     QWidget *widget = new QWidget;
     QHBoxLayout *layout = new QHBoxLayout(widget);
@@ -375,12 +685,17 @@ VisionMLBackendWidget::VisionMLBackendWidget(QSharedPointer<VisionModels> shared
     KisOptionButtonStrip *strip = new KisOptionButtonStrip;
     m_cpuButton = strip->addButton(i18n("CPU"));
     m_gpuButton = strip->addButton(i18n("GPU"));
-    if (!visp::backend_is_available(visp::backend_type::gpu)) {
-        m_gpuButton->setEnabled(false);
-        m_gpuButton->setToolTip(i18n("GPU backend not available, no supported devices found"));
-    }
     layout->addWidget(strip);
 
+    m_threads = new QSpinBox;
+    m_threads->setRange(0, QThread::idealThreadCount());
+    m_threads->setSpecialValueText(i18n("Auto"));
+    m_threads->setSuffix(i18n(" threads"));
+    m_threads->setToolTip(i18n("Number of CPU threads used for inference. Auto uses one thread per physical core. "
+                               "Limited by the number of threads Krita is configured to use."));
+    m_threads->setValue(m_shared->threadCount(task));
+    layout->addWidget(m_threads);
+
     if (showDevice) {
         m_deviceLabel = new QLabel;
         layout->addWidget(m_deviceLabel);
@@ -388,7 +703,27 @@ VisionMLBackendWidget::VisionMLBackendWidget(QSharedPointer<VisionModels> shared
 
     setPrimaryWidget(widget);
 
+    QWidget *memoryWidget = new QWidget;
+    QHBoxLayout *memoryLayout = new QHBoxLayout(memoryWidget);
+    memoryLayout->setContentsMargins(0, 0, 0, 0);
+    m_memoryLabel = new QLabel;
+    m_memoryLabel->setToolTip(i18n("Memory used by the model weights, by buffers for inference, and by cached results. "
+                                   "For the GPU backend most of it is video memory."));
+    memoryLayout->addWidget(m_memoryLabel, 1);
+    QToolButton *releaseButton = new QToolButton;
+    releaseButton->setText(i18n("Unload now"));
+    releaseButton->setToolTip(i18n("Unload the model and free cached data. It is loaded again on next use."));
+    memoryLayout->addWidget(releaseButton);
+    appendWidget("memoryUsage", memoryWidget);
+
+    // Polled, because memory changes in stroke jobs which run on other threads.
+    m_memoryTimer.setInterval(2000);
+    m_memoryTimer.start();
+    connect(&m_memoryTimer, SIGNAL(timeout()), this, SLOT(updateMemoryUsage()));
+    connect(releaseButton, SIGNAL(clicked()), this, SLOT(releaseMemory()));
+
     connect(strip, SIGNAL(buttonToggled(KoGroupButton *, bool)), this, SLOT(switchBackend(KoGroupButton *, bool)));
+    connect(m_threads, SIGNAL(valueChanged(int)), this, SLOT(setThreadCount(int)));
     connect(m_shared.get(), SIGNAL(backendChanged(visp::backend_type)), this, SLOT(updateBackend(visp::backend_type)));
 
     updateBackend(m_shared->backend());
@@ -398,8 +733,9 @@ void VisionMLBackendWidget::updateBackend(visp::backend_type backend)
 {
     m_cpuButton->setChecked(backend == visp::backend_type::cpu);
     m_gpuButton->setChecked(backend == visp::backend_type::gpu);
+    m_threads->setEnabled(backend == visp::backend_type::cpu);
 
-    if (m_deviceLabel) {
+    if (m_deviceLabel && m_backendsChecked) {
         m_deviceLabel->setText(QString(m_shared->backendDeviceDescription()).trimmed());
     }
 }
@@ -418,6 +754,87 @@ void VisionMLBackendWidget::switchBackend(KoGroupButton *button, bool checked)
     }
 }
 
+void VisionMLBackendWidget::setThreadCount(int threads)
+{
+    m_shared->setThreadCount(m_task, threads);
+}
+
+void VisionMLBackendWidget::showEvent(QShowEvent *event)
+{
+    KisOptionCollectionWidgetWithHeader::showEvent(event);
+    if (!m_backendsChecked) {
+        // Devices are only known after loading the backend libraries, which is deferred until the plugin is used.
+        m_backendsChecked = true;
+        m_shared->preinitialize();
+        if (!VisionModels::isGpuAvailable()) {
+            m_gpuButton->setEnabled(false);
+            m_gpuButton->setToolTip(i18n("GPU backend not available, no supported devices found"));
+        }
+        updateBackend(m_shared->backend());
+    }
+    updateMemoryUsage();
+}
+
+// Queried on a pool thread, with the worker process it is a round trip which may wait for inference of another
+// Krita instance. The label is updated on the UI thread when the result arrives.
+void VisionMLBackendWidget::updateMemoryUsage()
+{
+    if (!isVisible() || m_memoryQueryPending) {
+        return;
+    }
+    m_memoryQueryPending = true;
+    QPointer<VisionMLBackendWidget> self(this);
+    QThreadPool::globalInstance()->start([self, shared = m_shared, task = m_task]() {
+        VisionMLPipeline::MemoryUsage usage;
+        bool const success = shared->memoryUsage(task, usage);
+        QMetaObject::invokeMethod(
+            QCoreApplication::instance(),
+            [self, success, usage]() {
+                if (self) {
+                    self->m_memoryQueryPending = false;
+                    if (success) {
+                        self->showMemoryUsage(usage);
+                    }
+                }
+            },
+            Qt::QueuedConnection);
+    });
+}
+
+void VisionMLBackendWidget::showMemoryUsage(VisionMLPipeline::MemoryUsage const &usage)
+{
+    if (usage.weights + usage.compute + usage.cache == 0) {
+        m_memoryLabel->setText(i18n("Memory: nothing loaded"));
+        return;
+    }
+    QLocale locale;
+    m_memoryLabel->setText(i18n("Memory: %1 model, %2 compute, %3 cache",
+                                locale.formattedDataSize(qint64(usage.weights)),
+                                locale.formattedDataSize(qint64(usage.compute)),
+                                locale.formattedDataSize(qint64(usage.cache))));
+}
+
+// Waits on a pool thread for inference which is still running, rather than blocking the UI.
+void VisionMLBackendWidget::releaseMemory()
+{
+    QPointer<VisionMLBackendWidget> self(this);
+    QThreadPool::globalInstance()->start([self, shared = m_shared, task = m_task]() {
+        try {
+            shared->releaseMemory(task);
+        } catch (std::exception const &e) {
+            qWarning() << "[VisionML] Failed to release memory:" << e.what();
+        }
+        QMetaObject::invokeMethod(
+            QCoreApplication::instance(),
+            [self]() {
+                if (self) {
+                    self->updateMemoryUsage();
+                }
+            },
+            Qt::QueuedConnection);
+    });
+}
+
 //
 // VisionMLModelSelect
 
@@ -449,9 +866,11 @@ VisionMLModelSelect::VisionMLModelSelect(QSharedPointer<VisionModels> models,
         layout->addWidget(folderButton);
     }
 
-    m_fileWatcher = new QFileSystemWatcher(this);
-    m_fileWatcher->addPath(findModelPath(m_task));
-    connect(m_fileWatcher, &QFileSystemWatcher::directoryChanged, this, &VisionMLModelSelect::updateModels);
+    connect(&m_shared->modelRegistry(), &VisionMLModelRegistry::modelsChanged, this, [this](VisionMLTask task) {
+        if (task == m_task) {
+            updateModels();
+        }
+    });
 
     setPrimaryWidget(widget);
 }
@@ -463,28 +882,9 @@ void VisionMLModelSelect::updateModels()
     QVariant current = m_select->currentData();
     m_select->clear();
 
-    auto addModels = [this](const QString &arch) {
-        QDir modelDir(paths.models + arch);
-        QStringList modelFiles = modelDir.entryList(QStringList() << "*.gguf", QDir::Files);
-        for (QString &file : modelFiles) {
-            QString fullName = arch + "/" + file;
-            m_select->addItem(file.replace(".gguf", ""), fullName);
-        }
-    };
-
-    switch (m_task) {
-    case VisionMLTask::segmentation:
-        addModels("sam");
-        break;
-    case VisionMLTask::background_removal:
-        addModels("birefnet");
-        break;
-    case VisionMLTask::inpainting:
-        addModels("migan");
-        break;
-    default:
-        qWarning() << "Unknown VisionMLTask" << (int)m_task;
-        return;
+    for (VisionMLModelInfo const &model : m_shared->modelRegistry().models(m_task)) {
+        m_select->addItem(model.displayName(), model.name);
+        m_select->setItemData(m_select->count() - 1, model.description(), Qt::ToolTipRole);
     }
 
     m_select->blockSignals(false);
@@ -5,32 +5,34 @@
 #include "KoGroupButton.h"
 #include <kconfiggroup.h>
 
+#include "VisionMLImage.h"
+#include "VisionMLModelRegistry.h"
+#include "VisionMLPipeline.h"
+#include "VisionMLRecorder.h"
+#include "VisionMLTimings.h"
+#include "VisionMLWorkerClient.h"
+
 #include <visp/vision.h>
 
 #include <QComboBox>
-#include <QFileSystemWatcher>
 #include <QImage>
 #include <QLabel>
 #include <QMutex>
 #include <QObject>
+#include <QSpinBox>
 #include <QSharedPointer>
+#include <QTimer>
 #include <QWidget>
 
-
-class KisPaintDevice;
+#include <atomic>
+#include <future>
+#include <memory>
 
 enum class SegmentationMode {
     fast,
     precise
 };
 
-enum class VisionMLTask {
-    segmentation = 0,
-    inpainting,
-    background_removal,
-    _count
-};
-
 // Vision ML library, environment and config. One instance is shared between individual tools.
 class VisionModels : public QObject
 {
@@ -38,23 +40,67 @@ class VisionModels : public QObject
 public:
     static QSharedPointer<VisionModels> create();
 
+    // Loads the GGML backend libraries if that didn't happen yet. Blocks while another thread is loading them.
+    static void loadBackends();
+    static bool isGpuAvailable();
+
+    // Starts initialization in the background, once. Called when the UI of the plugin is first shown.
+    void preinitialize();
+
     void encodeSegmentationImage(const visp::image_view &view);
     bool hasSegmentationImage() const;
     visp::image_data predictSegmentationMask(visp::i32x2 point);
     visp::image_data predictSegmentationMask(visp::box_2d box);
 
+    // Results are cached by image content and model, see VisionMLPipeline::removeBackground.
     visp::image_data removeBackground(const visp::image_view &view);
 
-    visp::image_data inpaint(visp::image_view const &image, visp::image_view const &mask);
+    // Native resolution of the installed MI-GAN variant which fits a region of the given size best.
+    int inpaintResolution(QSize const &extent);
+    visp::image_data inpaint(visp::image_view const &image, visp::image_view const &mask, int resolution);
+
+    // Inpainting as the inpaint tool does it, shared with the script API. The model runs on the region which
+    // inpaintRegion() returns for the mask bounds: padded with context and sized to the model resolution.
+    // inpaintBlended() sets the mask, eroded and blurred at its edges, as alpha of the result, which is then
+    // composited over the image.
+    struct InpaintRegion {
+        QRect bounds;
+        int resolution = 0;
+    };
+    InpaintRegion inpaintRegion(QRect const &maskBounds, QRect const &imageBounds);
+    visp::image_data inpaintBlended(visp::image_view const &image, visp::image_view const &mask, int resolution);
 
     void unload(VisionMLTask);
 
+    // Memory held for a task, see VisionMLPipeline::MemoryUsage. Returns false without waiting if inference is
+    // running in this process. With the worker process it is a blocking round trip, the UI calls it from a pool thread.
+    bool memoryUsage(VisionMLTask task, VisionMLPipeline::MemoryUsage &usage);
+    // Unloads the model of the task and drops its caches, also for the CPU backend. Waits for running inference.
+    void releaseMemory(VisionMLTask task);
+
     visp::backend_type backend() const;
     bool setBackend(visp::backend_type backend);
-    QString backendDeviceDescription() const;
+    QString backendDeviceDescription();
 
     QString const &modelName(VisionMLTask task) const;
+    QString const &activeModelName(VisionMLTask task) const; // after variant selection
     void setModelName(VisionMLTask task, QString const &name);
+    VisionMLModelRegistry &modelRegistry();
+
+    // CPU threads used for inference of a task, 0 = number of physical cores. Capped by Krita's thread limit.
+    int threadCount(VisionMLTask task) const;
+    void setThreadCount(VisionMLTask task, int threads);
+    // CPU threads which inference of a task actually uses: the thread count within Krita's limit, 1 for GPU.
+    int inferenceThreadCount(VisionMLTask task) const;
+
+    // Stage timings of all tools, null unless enabled with the "timings" setting ("json" for per-stage histograms,
+    // "trace" for Chrome trace events). Written to "timings_file" when a tool is deactivated and on exit.
+    VisionMLTimings *timings();
+    void writeTimings();
+
+    // Records tool interactions for replay, null unless enabled with the "record_session" setting (directory for
+    // session recordings). Snapshots of sampled images are stored if "record_snapshots" is set.
+    VisionMLRecorder *recorder();
 
 Q_SIGNALS:
     void backendChanged(visp::backend_type);
@@ -65,34 +111,35 @@ private Q_SLOTS:
 
 private:
     VisionModels();
-    QString initialize(visp::backend_type);
     void configureModel(VisionMLTask task, QString const& defaultName);
-    QByteArray modelPath(VisionMLTask) const;
-    void unloadModels();
+    void updateActiveModel(VisionMLTask task);
+    void ensureInitialized();
+    VisionMLPipeline &pipeline();
+    void connectWorker();
+    void applyThreadSettings();
+    void updateSegmentationImageFlag();
+    QString graphProfileFile() const;
+    template<typename Prompt>
+    visp::image_data predictSegmentationMaskInProcess(Prompt prompt);
 
     KConfigGroup m_config;
     visp::backend_type m_backendType = visp::backend_type::cpu;
-    visp::backend_device m_backend;
-    visp::sam_model m_sam;
-    visp::birefnet_model m_birefnet;
-    visp::migan_model m_migan;
+    std::unique_ptr<VisionMLPipeline> m_pipeline;
+    std::unique_ptr<VisionMLWorkerClient> m_worker; // optional, see "inference_worker" setting
+    bool m_initialized = false;
+    std::atomic<bool> m_hasSegmentationImage{false};
+    std::future<void> m_preinitialization;
     std::array<QString, (int)VisionMLTask::_count> m_modelName;
-    QMutex m_mutex;
-};
-
-// Helper for reading images from paint device to a format compatible with vision models.
-struct VisionMLImage {
-    QImage data;
-    visp::image_span view;
-
-    explicit operator bool() const
-    {
-        return !data.isNull();
-    }
-
-    static VisionMLImage prepare(KisPaintDevice const &device, QRect bounds = {});
-
-    static QImage convertToQImage(visp::image_view const &view, QRect bounds = {});
+    std::array<QString, (int)VisionMLTask::_count> m_activeModelName; // after variant selection
+    VisionMLModelRegistry *m_registry;
+    VisionMLModelRegistry::Budget m_budget;
+    std::array<int, (int)VisionMLTask::_count> m_threadCount{};
+    bool m_pinThreads = false;
+    std::unique_ptr<VisionMLTimings> m_timings;
+    bool m_timingsTrace = false;
+    QString m_timingsFile;
+    std::unique_ptr<VisionMLRecorder> m_recorder;
+    mutable QMutex m_mutex;
 };
 
 // Shows a widget to switch between CPU and GPU backends. Shared across all tools.
@@ -100,17 +147,34 @@ class VisionMLBackendWidget : public KisOptionCollectionWidgetWithHeader
 {
     Q_OBJECT
 public:
-    VisionMLBackendWidget(QSharedPointer<VisionModels> shared, bool showDevice = false, QWidget *parent = nullptr);
+    VisionMLBackendWidget(QSharedPointer<VisionModels> shared,
+                          VisionMLTask task,
+                          bool showDevice = false,
+                          QWidget *parent = nullptr);
 
 public Q_SLOTS:
     void switchBackend(KoGroupButton *, bool);
     void updateBackend(visp::backend_type);
+    void setThreadCount(int);
+    void updateMemoryUsage();
+    void releaseMemory();
+
+protected:
+    void showEvent(QShowEvent *event) override;
 
 private:
+    void showMemoryUsage(VisionMLPipeline::MemoryUsage const &usage);
+
     QSharedPointer<VisionModels> m_shared;
+    VisionMLTask m_task;
     KoGroupButton *m_cpuButton;
     KoGroupButton *m_gpuButton;
+    QSpinBox *m_threads;
     QLabel *m_deviceLabel = nullptr;
+    QLabel *m_memoryLabel;
+    bool m_memoryQueryPending = false;
+    bool m_backendsChecked = false; // on first show
+    QTimer m_memoryTimer;
 };
 
 // Shows a drop-down list with available models. Shared across specific tasks.
@@ -133,7 +197,6 @@ private:
     QSharedPointer<VisionModels> m_shared;
     VisionMLTask m_task;
     QComboBox *m_select;
-    QFileSystemWatcher *m_fileWatcher = nullptr;
 };
 
 // Helper to report errors from different threads ("stroke applicators")
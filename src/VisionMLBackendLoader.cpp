@@ -0,0 +1,70 @@
+#include "VisionMLBackendLoader.h"
+
+#include <QDebug>
+#include <QDir>
+#include <QLibrary>
+
+#include <ggml-backend.h>
+
+namespace
+{
+
+#if defined(WIN32)
+char const *const libraryExtension = "dll";
+#elif defined(__APPLE__)
+char const *const libraryExtension = "dylib";
+#else
+char const *const libraryExtension = "so";
+#endif
+
+bool loadLibrary(QDir const &dir, QString const &file)
+{
+    if (!dir.exists(file)) {
+        return false;
+    }
+    return ggml_backend_load(dir.filePath(file).toUtf8().constData()) != nullptr;
+}
+
+// Each CPU variant exports ggml_backend_score, which checks CPU features of the host. Zero means unsupported,
+// otherwise higher is better. Same selection as ggml_backend_load_best, but with our library naming.
+QString selectCPUVariant(QDir const &dir)
+{
+    QStringList variants = dir.entryList({QString("ggml-cpu-*.%1").arg(libraryExtension)}, QDir::Files);
+    QString best;
+    int bestScore = 0;
+    for (QString const &file : variants) {
+        QLibrary library(dir.filePath(file));
+        auto score = reinterpret_cast<int (*)()>(library.resolve("ggml_backend_score"));
+        int value = score ? score() : 0;
+        library.unload();
+        qDebug() << "[VisionML] CPU backend variant" << file << "score" << value;
+        if (value > bestScore) {
+            best = file;
+            bestScore = value;
+        }
+    }
+    return best;
+}
+
+} // namespace
+
+namespace VisionMLBackendLoader
+{
+
+QString loadBackends(QString const &directory)
+{
+    QDir dir(directory);
+    QString cpu = selectCPUVariant(dir);
+    if (cpu.isEmpty()) {
+        cpu = QString("ggml-cpu.%1").arg(libraryExtension);
+    }
+    if (loadLibrary(dir, cpu)) {
+        qDebug() << "[VisionML] Selected CPU backend" << cpu;
+    } else {
+        qWarning() << "[VisionML] Failed to load CPU backend" << dir.filePath(cpu);
+    }
+    loadLibrary(dir, QString("ggml-vulkan.%1").arg(libraryExtension));
+    return cpu;
+}
+
+} // namespace VisionMLBackendLoader
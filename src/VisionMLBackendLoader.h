@@ -0,0 +1,16 @@
+#ifndef VISION_ML_BACKEND_LOADER_H_
+#define VISION_ML_BACKEND_LOADER_H_
+
+#include <QString>
+
+namespace VisionMLBackendLoader
+{
+
+// Loads GGML backend libraries (CPU and Vulkan) from the given directory. The CPU backend may be shipped in several
+// variants built for different instruction sets (ggml-cpu-haswell, ggml-cpu-skylakex, ...), the one which fits the
+// host CPU best is selected. Falls back to a single ggml-cpu library. Returns the name of the CPU library.
+QString loadBackends(QString const &directory);
+
+} // namespace VisionMLBackendLoader
+
+#endif // VISION_ML_BACKEND_LOADER_H_
@@ -0,0 +1,220 @@
+#include "VisionMLGraphProfiler.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <exception>
+#include <fstream>
+#include <utility>
+#include <vector>
+
+namespace
+{
+
+using Clock = std::chrono::steady_clock;
+
+// Number of rows in the per-shape table, the remaining entries are summarized in one line.
+size_t const maxShapeRows = 40;
+
+double milliseconds(Clock::duration d)
+{
+    return std::chrono::duration<double, std::milli>(d).count();
+}
+
+std::string describe(ggml_tensor const *t)
+{
+    std::string result = ggml_type_name(t->type);
+    result += " [";
+    int dims = 4;
+    while (dims > 1 && t->ne[dims - 1] == 1) {
+        --dims;
+    }
+    for (int i = 0; i < dims; ++i) {
+        result += (i > 0 ? "," : "") + std::to_string(t->ne[i]);
+    }
+    return result + "]";
+}
+
+// Size of the first two inputs and the output, roughly the memory the node reads and writes.
+double nodeBytes(ggml_tensor const *node)
+{
+    double bytes = double(ggml_nbytes(node));
+    for (int i = 0; i < 2 && node->src[i]; ++i) {
+        bytes += double(ggml_nbytes(node->src[i]));
+    }
+    return bytes;
+}
+
+// Op with the types and shapes of its first two inputs and the output, eg. "MUL_MAT q8_0 [256,1024] f32 [256,4096]
+// -> f32 [1024,4096]". Weight types and shapes determine which kernels run and how fast they are.
+std::string describeNode(ggml_tensor const *node)
+{
+    std::string result = ggml_op_desc(node);
+    for (int i = 0; i < 2 && node->src[i]; ++i) {
+        result += " " + describe(node->src[i]);
+    }
+    return result + " -> " + describe(node);
+}
+
+template<typename Map>
+std::vector<std::pair<std::string, typename Map::mapped_type>> sortedByTime(Map const &map)
+{
+    std::vector<std::pair<std::string, typename Map::mapped_type>> result(map.begin(), map.end());
+    std::sort(result.begin(), result.end(), [](auto const &a, auto const &b) {
+        return a.second.ms != b.second.ms ? a.second.ms > b.second.ms : a.second.bytes > b.second.bytes;
+    });
+    return result;
+}
+
+// Ops which only change how a tensor is viewed, backends don't run anything for them.
+bool isEmpty(ggml_tensor const *node)
+{
+    switch (node->op) {
+    case GGML_OP_NONE:
+    case GGML_OP_VIEW:
+    case GGML_OP_RESHAPE:
+    case GGML_OP_PERMUTE:
+    case GGML_OP_TRANSPOSE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Computes the nodes of the graph one at a time, each as a graph of its own, and returns their times. Empty if a
+// node fails. ggml_graph_view would avoid building the one-node graph, but it returns the graph struct by value,
+// which is opaque outside of GGML.
+std::vector<double> timeNodes(ggml_backend_t backend, ggml_cgraph *graph)
+{
+    int const nodes = ggml_graph_n_nodes(graph);
+    ggml_init_params params{ggml_graph_overhead_custom(1, false), nullptr, /*no_alloc*/ true};
+    ggml_context *ctx = ggml_init(params);
+    if (!ctx) {
+        return {};
+    }
+    ggml_cgraph *single = ggml_new_graph_custom(ctx, 1, false);
+    std::vector<double> result(nodes, 0.0);
+    for (int i = 0; i < nodes; ++i) {
+        ggml_tensor *node = ggml_graph_node(graph, i);
+        if (isEmpty(node)) {
+            continue;
+        }
+        ggml_graph_clear(single);
+        ggml_graph_add_node(single, node);
+        auto start = Clock::now();
+        if (ggml_backend_graph_compute(backend, single) != GGML_STATUS_SUCCESS) {
+            result.clear();
+            break;
+        }
+        ggml_backend_synchronize(backend);
+        result[i] = milliseconds(Clock::now() - start);
+    }
+    ggml_free(ctx);
+    return result;
+}
+
+} // namespace
+
+VisionMLGraphProfiler::VisionMLGraphProfiler(std::string file)
+    : m_file(std::move(file))
+{
+}
+
+void VisionMLGraphProfiler::begin(std::string label)
+{
+    m_label = std::move(label);
+    m_start = Clock::now();
+}
+
+void VisionMLGraphProfiler::end(ggml_backend_t backend, ggml_cgraph *graph)
+{
+    ggml_backend_synchronize(backend);
+    double const totalMs = milliseconds(Clock::now() - m_start);
+    std::vector<double> nodeMs;
+    if (graph) {
+        nodeMs = timeNodes(backend, graph);
+    }
+    write(totalMs, graph, nodeMs);
+}
+
+void VisionMLGraphProfiler::write(double totalMs, ggml_cgraph *graph, std::vector<double> const &nodeMs) const
+{
+    std::ofstream out(m_file, std::ios::app);
+    if (!out) {
+        std::fprintf(stderr, "[VisionML] Failed to write graph profile to %s\n", m_file.c_str());
+        return;
+    }
+    std::map<std::string, Entry> byOp;
+    std::map<std::string, Entry> byShape;
+    double totalBytes = 0;
+    double totalNodeMs = 0;
+    int const nodes = graph ? ggml_graph_n_nodes(graph) : 0;
+    bool const timed = int(nodeMs.size()) == nodes;
+    for (int i = 0; i < nodes; ++i) {
+        ggml_tensor const *node = ggml_graph_node(graph, i);
+        double const bytes = nodeBytes(node);
+        double const ms = timed ? nodeMs[i] : 0.0;
+        for (Entry *entry : {&byOp[ggml_op_desc(node)], &byShape[describeNode(node)]}) {
+            entry->count += 1;
+            entry->bytes += bytes;
+            entry->ms += ms;
+        }
+        totalBytes += bytes;
+        totalNodeMs += ms;
+    }
+    char line[512];
+    std::snprintf(line, sizeof(line), "== %s: %.2f ms, %d nodes, %.1f MB read and written by nodes\n",
+                  m_label.c_str(), totalMs, nodes, totalBytes / (1024 * 1024));
+    out << line;
+    if (timed && nodes > 0) {
+        std::snprintf(line, sizeof(line), "   %.2f ms when computed node by node\n", totalNodeMs);
+        out << line;
+    } else if (nodes > 0) {
+        out << "   node times not available, computing single nodes failed\n";
+    }
+
+    auto printRow = [&](Entry const &entry, std::string const &name) {
+        double share = totalNodeMs > 0 ? 100.0 * entry.ms / totalNodeMs : 0.0;
+        std::snprintf(line, sizeof(line), "%10.2f %6.1f%% %10.1f %6d  ", entry.ms, share, entry.bytes / (1024 * 1024),
+                      entry.count);
+        out << line << name << "\n";
+    };
+    out << "        ms   share         MB  count  op\n";
+    for (auto const &[name, entry] : sortedByTime(byOp)) {
+        printRow(entry, name);
+    }
+    out << "        ms   share         MB  count  op, inputs -> output\n";
+    auto shapes = sortedByTime(byShape);
+    Entry rest;
+    for (size_t i = 0; i < shapes.size(); ++i) {
+        if (i < maxShapeRows) {
+            printRow(shapes[i].second, shapes[i].first);
+        } else {
+            rest.bytes += shapes[i].second.bytes;
+            rest.count += shapes[i].second.count;
+            rest.ms += shapes[i].second.ms;
+        }
+    }
+    if (rest.count > 0) {
+        printRow(rest, "(" + std::to_string(shapes.size() - maxShapeRows) + " more)");
+    }
+    out << "\n";
+}
+
+VisionMLGraphProfiler::Invocation::Invocation(VisionMLGraphProfiler *profiler, std::string label,
+                                              ggml_backend_t backend, ggml_cgraph *const &graph)
+    : m_profiler(profiler)
+    , m_backend(backend)
+    , m_graph(graph)
+    , m_exceptions(std::uncaught_exceptions())
+{
+    if (m_profiler) {
+        m_profiler->begin(std::move(label));
+    }
+}
+
+VisionMLGraphProfiler::Invocation::~Invocation()
+{
+    if (m_profiler && std::uncaught_exceptions() == m_exceptions) {
+        m_profiler->end(m_backend, m_graph);
+    }
+}
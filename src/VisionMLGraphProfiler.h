@@ -0,0 +1,60 @@
+#ifndef VISION_ML_GRAPH_PROFILER_H_
+#define VISION_ML_GRAPH_PROFILER_H_
+
+#include <ggml-backend.h>
+#include <ggml.h>
+
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+
+// Profiling of GGML graphs per model invocation (eg. sam_encode). The graph runs as usual, including fused operations,
+// and the time until the backend has finished is measured. Afterwards the graph is computed again one node at a time
+// to time each node. Nodes are aggregated by op type and by op + tensor types and shapes, with their time, count and
+// the size of the tensors they read and write, and appended to the profile file as tables sorted by time.
+//
+// Node times don't include fusion of consecutive nodes, and each has the overhead of a separate compute call (eg.
+// waking up CPU threads), so they add up to more than the total. They show where the time goes, the total how fast
+// the model runs. Only the public GGML API is used.
+class VisionMLGraphProfiler
+{
+public:
+    explicit VisionMLGraphProfiler(std::string file);
+
+    void begin(std::string label);
+    // Waits for the backend, then times the nodes of the graph (may be null) and writes them with the time since
+    // begin(). Recomputing the nodes in their original order leaves the results of the graph as they were.
+    void end(ggml_backend_t backend, ggml_cgraph *graph);
+
+    // Calls begin() and end() for the lifetime of the object, does nothing if profiler is null. The graph is
+    // referenced and only read at the end, as visp creates graphs on first use. Nothing is written on exceptions.
+    class Invocation
+    {
+    public:
+        Invocation(VisionMLGraphProfiler *profiler, std::string label, ggml_backend_t backend,
+                   ggml_cgraph *const &graph);
+        ~Invocation();
+
+    private:
+        VisionMLGraphProfiler *m_profiler;
+        ggml_backend_t m_backend;
+        ggml_cgraph *const &m_graph;
+        int m_exceptions;
+    };
+
+private:
+    struct Entry {
+        int count = 0;
+        double bytes = 0;
+        double ms = 0;
+    };
+
+    void write(double totalMs, ggml_cgraph *graph, std::vector<double> const &nodeMs) const;
+
+    std::string m_file;
+    std::string m_label;
+    std::chrono::steady_clock::time_point m_start;
+};
+
+#endif // VISION_ML_GRAPH_PROFILER_H_
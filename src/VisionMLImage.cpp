@@ -0,0 +1,92 @@
+#include "VisionMLImage.h"
+
+#include "KoColorSpace.h"
+#include "kis_paint_device.h"
+
+#include <cstring>
+#include <stdexcept>
+
+VisionMLImage VisionMLImage::prepare(KisPaintDevice const &device, QRect bounds)
+{
+    VisionMLImage result;
+    if (bounds.isEmpty()) {
+        bounds = device.exactBounds();
+    }
+    if (bounds.isEmpty()) {
+        return result; // Can happen eg. when using color label mode without matching layers.
+    }
+    KoColorSpace const *cs = device.colorSpace();
+    if (cs->pixelSize() == 4 && cs->id() == "RGBA") {
+        // Stored as BGRA, 8 bits per channel in Krita. No conversions for now, the segmentation network expects
+        // gamma-compressed sRGB, but works fine with other color spaces (probably).
+        result.view.format = visp::image_format::bgra_u8;
+        result.data = QImage(bounds.width(), bounds.height(), QImage::Format_ARGB32);
+        device.readBytes(result.data.bits(), bounds.x(), bounds.y(), bounds.width(), bounds.height());
+    } else {
+        // Convert everything else to QImage::Format_ARGB32 in default color space (sRGB).
+        result.view.format = visp::image_format::argb_u8;
+        result.data = device.convertToQImage(nullptr, bounds);
+    }
+    result.view.extent = {result.data.width(), result.data.height()};
+    result.view.stride = result.data.bytesPerLine();
+    result.view.data = result.data.bits();
+    return result;
+}
+
+// Convert outputs to QImage - this is mainly because they're RGBA, but Krita paint device uses BGRA internally (but may
+// also use some other color space).
+QImage VisionMLImage::convertToQImage(visp::image_view const &img, QRect b)
+{
+    if (img.format != visp::image_format::rgba_u8) {
+        throw std::runtime_error("Unsupported image format for conversion to QImage");
+    }
+    if (b.isEmpty()) {
+        b = QRect(0, 0, img.extent[0], img.extent[1]);
+    }
+
+    QImage result(b.width(), b.height(), QImage::Format_RGBA8888);
+    // copy scanlines, row stride might be different
+    size_t rowSize = b.width() * n_bytes(img.format);
+    size_t rowStride = img.extent[0] * n_bytes(img.format);
+    size_t rowOffset = b.x() * n_bytes(img.format);
+    for (int y = 0; y < b.height(); ++y) {
+        memcpy(result.scanLine(y), ((uint8_t const *)img.data) + (y + b.y()) * rowStride + rowOffset, rowSize);
+    }
+    return result;
+}
+
+QRect VisionMLImage::padBounds(QRect const &bounds, int pad, int targetSize, QRect const &imageBounds)
+{
+    QRect padded = bounds.adjusted(-pad, -pad, pad, pad);
+
+    if (padded.width() < targetSize) {
+        int diff = targetSize - padded.width();
+        int leftPadding = diff / 2;
+        int rightPadding = diff - leftPadding;
+
+        if (padded.left() - leftPadding < imageBounds.left()) {
+            leftPadding = padded.left() - imageBounds.left();
+            rightPadding = diff - leftPadding;
+        } else if (padded.right() + rightPadding > imageBounds.right()) {
+            rightPadding = imageBounds.right() - padded.right();
+            leftPadding = diff - rightPadding;
+        }
+        padded.adjust(-leftPadding, 0, rightPadding, 0);
+    }
+
+    if (padded.height() < targetSize) {
+        int diff = targetSize - padded.height();
+        int topPadding = diff / 2;
+        int bottomPadding = diff - topPadding;
+
+        if (padded.top() - topPadding < imageBounds.top()) {
+            topPadding = padded.top() - imageBounds.top();
+            bottomPadding = diff - topPadding;
+        } else if (padded.bottom() + bottomPadding > imageBounds.bottom()) {
+            bottomPadding = imageBounds.bottom() - padded.bottom();
+            topPadding = diff - bottomPadding;
+        }
+        padded.adjust(0, -topPadding, 0, bottomPadding);
+    }
+    return padded.intersected(imageBounds);
+}
@@ -0,0 +1,30 @@
+#ifndef VISION_ML_IMAGE_H_
+#define VISION_ML_IMAGE_H_
+
+#include <visp/vision.h>
+
+#include <QImage>
+#include <QRect>
+
+class KisPaintDevice;
+
+// Helper for reading images from paint device to a format compatible with vision models.
+struct VisionMLImage {
+    QImage data;
+    visp::image_span view;
+
+    explicit operator bool() const
+    {
+        return !data.isNull();
+    }
+
+    static VisionMLImage prepare(KisPaintDevice const &device, QRect bounds = {});
+
+    static QImage convertToQImage(visp::image_view const &view, QRect bounds = {});
+
+    // Region to process around `bounds`: extended by `pad` on all sides, and to at least `targetSize` (the model
+    // resolution) if the image is large enough. Shifted rather than cropped where it would leave `imageBounds`.
+    static QRect padBounds(QRect const &bounds, int pad, int targetSize, QRect const &imageBounds);
+};
+
+#endif // VISION_ML_IMAGE_H_
@@ -0,0 +1,1392 @@
+#include "VisionMLImageOps.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#if defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#elif defined(__APPLE__)
+#include <sys/sysctl.h>
+#endif
+
+namespace VisionMLImageOps
+{
+
+namespace
+{
+
+std::atomic<int> threadCountSetting{0};
+thread_local int threadLimit = 0; // see ScopedThreadLimit, 0 = no limit
+
+// Worker threads for parallelFor. Threads are started when needed and then wait for tasks until the process exits.
+class ThreadPool
+{
+public:
+    // Never destroyed: joining threads during static destruction can deadlock when the library is unloaded.
+    static ThreadPool &instance()
+    {
+        static ThreadPool *pool = new ThreadPool;
+        return *pool;
+    }
+
+    void run(int threads, std::function<void()> task, int copies)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        while (int(m_threads.size()) < threads) {
+            m_threads.emplace_back([this]() { work(); });
+        }
+        for (int i = 0; i < copies; ++i) {
+            m_tasks.push_back(task);
+        }
+        m_wake.notify_all();
+    }
+
+private:
+    void work()
+    {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_wake.wait(lock, [this]() { return !m_tasks.empty(); });
+                task = std::move(m_tasks.front());
+                m_tasks.pop_front();
+            }
+            task();
+        }
+    }
+
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::deque<std::function<void()>> m_tasks;
+    std::vector<std::thread> m_threads;
+};
+
+// Chunks of one parallelFor call. Pool threads which start after all chunks were taken return without touching fn,
+// which only lives as long as the call.
+struct ParallelJob {
+    std::function<void(int, int)> const *fn = nullptr;
+    int count = 0;
+    int chunks = 0;
+    std::atomic<int> next{0};
+    int finished = 0;
+    std::exception_ptr error;
+    std::mutex mutex;
+    std::condition_variable done;
+
+    // Processes chunks until none are left.
+    void runChunks()
+    {
+        for (int i = next++; i < chunks; i = next++) {
+            int begin = int(int64_t(count) * i / chunks);
+            int end = int(int64_t(count) * (i + 1) / chunks);
+            std::exception_ptr chunkError;
+            try {
+                (*fn)(begin, end);
+            } catch (...) {
+                chunkError = std::current_exception();
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            if (chunkError) {
+                error = chunkError;
+            }
+            if (++finished == chunks) {
+                done.notify_all();
+            }
+        }
+    }
+};
+
+uint8_t const *row(visp::image_view const &img, int y)
+{
+    return (uint8_t const *)img.data + size_t(y) * img.stride;
+}
+
+int clampIndex(int i, int n)
+{
+    return std::clamp(i, 0, n - 1);
+}
+
+} // namespace
+
+//
+// Threading
+
+int threadCount()
+{
+    int count = threadCountSetting.load();
+    if (count <= 0) {
+        count = std::max(1, int(std::thread::hardware_concurrency()));
+    }
+    return threadLimit > 0 ? std::min(count, threadLimit) : count;
+}
+
+void setThreadCount(int count)
+{
+    threadCountSetting = count;
+}
+
+ScopedThreadLimit::ScopedThreadLimit(int count)
+    : m_previous(threadLimit)
+{
+    threadLimit = m_previous > 0 ? std::min(m_previous, std::max(1, count)) : std::max(1, count);
+}
+
+ScopedThreadLimit::~ScopedThreadLimit()
+{
+    threadLimit = m_previous;
+}
+
+int physicalCoreCount()
+{
+    static int const count = []() {
+        int const logical = std::max(1, int(std::thread::hardware_concurrency()));
+#if defined(_WIN32)
+        DWORD length = 0;
+        GetLogicalProcessorInformation(nullptr, &length);
+        std::vector<SYSTEM_LOGICAL_PROCESSOR_INFORMATION> info(length / sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION));
+        if (!info.empty() && GetLogicalProcessorInformation(info.data(), &length)) {
+            int cores = int(std::count_if(info.begin(), info.end(), [](auto const &i) {
+                return i.Relationship == RelationProcessorCore;
+            }));
+            if (cores > 0) {
+                return cores;
+            }
+        }
+#elif defined(__APPLE__)
+        int cores = 0;
+        size_t size = sizeof(cores);
+        if (sysctlbyname("hw.physicalcpu", &cores, &size, nullptr, 0) == 0 && cores > 0) {
+            return cores;
+        }
+#else
+        // Count distinct (physical id, core id) pairs.
+        std::ifstream cpuinfo("/proc/cpuinfo");
+        std::set<std::pair<int, int>> cores;
+        int package = 0;
+        for (std::string line; std::getline(cpuinfo, line);) {
+            size_t colon = line.find(':');
+            if (colon == std::string::npos) {
+                continue;
+            }
+            if (line.rfind("physical id", 0) == 0) {
+                package = std::atoi(line.c_str() + colon + 1);
+            } else if (line.rfind("core id", 0) == 0) {
+                cores.emplace(package, std::atoi(line.c_str() + colon + 1));
+            }
+        }
+        if (!cores.empty()) {
+            return std::min(int(cores.size()), logical);
+        }
+#endif
+        return logical;
+    }();
+    return count;
+}
+
+void parallelFor(int count, int grain, std::function<void(int, int)> const &fn)
+{
+    if (count <= 0) {
+        return;
+    }
+    grain = std::max(1, grain);
+    int chunks = std::min(threadCount(), (count + grain - 1) / grain);
+    if (chunks <= 1) {
+        fn(0, count);
+        return;
+    }
+
+    auto job = std::make_shared<ParallelJob>();
+    job->fn = &fn;
+    job->count = count;
+    job->chunks = chunks;
+    ThreadPool::instance().run(threadCount() - 1, [job]() { job->runChunks(); }, chunks - 1);
+    job->runChunks();
+
+    std::unique_lock<std::mutex> lock(job->mutex);
+    job->done.wait(lock, [&]() { return job->finished == chunks; });
+    if (job->error) {
+        std::rethrow_exception(job->error);
+    }
+}
+
+void post(std::function<void()> task)
+{
+    ThreadPool::instance().run(std::max(1, threadCount() - 1), std::move(task), 1);
+}
+
+//
+// Hashing
+
+uint64_t hashImage(visp::image_view const &image)
+{
+    auto mix = [](uint64_t h, uint64_t v) {
+        h ^= v + 0x9e3779b97f4a7c15ull + (h << 6) + (h >> 2);
+        h *= 0xff51afd7ed558ccdull;
+        return h ^ (h >> 33);
+    };
+
+    int const h = image.extent[1];
+    size_t const rowSize = size_t(image.extent[0]) * visp::n_bytes(image.format);
+    std::vector<uint64_t> rowHashes(h);
+    parallelFor(h, 64, [&](int y0, int y1) {
+        for (int y = y0; y < y1; ++y) {
+            uint8_t const *bytes = row(image, y);
+            uint64_t hash = rowSize;
+            size_t i = 0;
+            for (; i + 8 <= rowSize; i += 8) {
+                uint64_t v;
+                memcpy(&v, bytes + i, 8);
+                hash = mix(hash, v);
+            }
+            uint64_t tail = 0;
+            memcpy(&tail, bytes + i, rowSize - i);
+            rowHashes[y] = mix(hash, tail);
+        }
+    });
+
+    uint64_t hash = mix(uint64_t(image.extent[0]), uint64_t(image.extent[1]));
+    hash = mix(hash, uint64_t(image.format));
+    for (uint64_t rowHash : rowHashes) {
+        hash = mix(hash, rowHash);
+    }
+    return hash;
+}
+
+//
+// Mask bounds
+
+MaskBounds maskBounds(visp::image_view const &mask)
+{
+    if (mask.format != visp::image_format::alpha_u8) {
+        throw std::runtime_error("maskBounds: expected 8-bit mask");
+    }
+    int const w = mask.extent[0];
+    int const h = mask.extent[1];
+    int x0 = w, x1 = -1, y0 = h, y1 = -1;
+    std::mutex mutex;
+    parallelFor(h, 64, [&](int begin, int end) {
+        int minX = w, maxX = -1, minY = h, maxY = -1;
+        for (int y = begin; y < end; ++y) {
+            uint8_t const *r = row(mask, y);
+            int left = 0;
+            while (left < w && r[left] == 0) {
+                ++left;
+            }
+            if (left == w) {
+                continue;
+            }
+            int right = w - 1;
+            while (right > maxX && r[right] == 0) {
+                --right; // columns up to maxX are already covered by a previous row
+            }
+            minX = std::min(minX, left);
+            maxX = std::max(maxX, right);
+            minY = std::min(minY, y);
+            maxY = y;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        x0 = std::min(x0, minX);
+        x1 = std::max(x1, maxX);
+        y0 = std::min(y0, minY);
+        y1 = std::max(y1, maxY);
+    });
+    if (x1 < 0) {
+        return MaskBounds{};
+    }
+    return MaskBounds{x0, y0, x1 - x0 + 1, y1 - y0 + 1};
+}
+
+visp::image_data cropMask(visp::image_view const &mask, MaskBounds const &region)
+{
+    visp::image_data result = visp::image_alloc({region.width, region.height}, visp::image_format::alpha_u8);
+    memset(result.data.get(), 0, size_t(region.width) * region.height);
+    int const x0 = std::max(region.x, 0);
+    int const x1 = std::min(region.x + region.width, mask.extent[0]);
+    int const y0 = std::max(region.y, 0);
+    int const y1 = std::min(region.y + region.height, mask.extent[1]);
+    for (int y = y0; y < y1 && x0 < x1; ++y) {
+        uint8_t *dst = result.data.get() + size_t(y - region.y) * region.width + (x0 - region.x);
+        memcpy(dst, row(mask, y) + x0, x1 - x0);
+    }
+    return result;
+}
+
+//
+// Mask morphology and feathering
+
+namespace
+{
+
+// Half height of the circular structuring element for each horizontal offset in [-radius, radius]. Same as
+// KisSelectionFilter::computeBorder, so that results match Krita's filters.
+//
+// This is the set {(dx, dy) : c(dx) + c(dy) <= 4 radius^2} with c(0) = 0 and c(d) = (2 |d| - 1)^2. It is symmetric,
+// so result[radius + k] is also the half width at vertical offset k.
+std::vector<int> circleExtents(int radius)
+{
+    std::vector<int> result(2 * radius + 1);
+    for (int i = 0; i < 2 * radius + 1; ++i) {
+        double d = i == radius ? 0.0 : std::abs(i - radius) - 0.5;
+        result[i] = int(std::floor(std::sqrt(double(radius) * radius - d * d) + 0.5));
+    }
+    return result;
+}
+
+// dst = max(dst, src) or min(dst, src) for n bytes. Taking the count by value (not a captured reference, which byte
+// stores might alias) lets the compiler vectorize the loop.
+template<bool dilate>
+void combineRow(uint8_t *dst, uint8_t const *src, int n)
+{
+    for (int x = 0; x < n; ++x) {
+        dst[x] = dilate ? std::max(dst[x], src[x]) : std::min(dst[x], src[x]);
+    }
+}
+
+bool isBinary(visp::image_view const &mask)
+{
+    for (int y = 0; y < mask.extent[1]; ++y) {
+        uint8_t const *p = row(mask, y);
+        bool binary = true;
+        for (int x = 0; x < mask.extent[0]; ++x) {
+            binary &= p[x] == 0 || p[x] == 255;
+        }
+        if (!binary) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Output rows of the mask without morphology, for feathering only.
+class CopyRows
+{
+public:
+    explicit CopyRows(visp::image_view const &src)
+        : m_src(src)
+    {
+    }
+
+    void computeRow(int y, uint8_t *out)
+    {
+        memcpy(out, row(m_src, y), m_src.extent[0]);
+    }
+
+private:
+    visp::image_view m_src;
+};
+
+// Dilation (max) or erosion (min) with the circle, one output row at a time. For each output row, the max/min over
+// vertical windows of growing size is built incrementally, then windows of the circle's height at each horizontal
+// offset are combined. Loops run over contiguous rows, which compilers vectorize. Works for any mask, but the cost per
+// pixel grows with the radius, see BinaryMorphologyRows.
+template<bool dilate>
+class ChordMorphologyRows
+{
+public:
+    ChordMorphologyRows(visp::image_view const &src, std::vector<int> const &circle, int radius)
+        : m_src(src)
+        , m_circle(circle)
+        , m_radius(radius)
+        , m_stride(src.extent[0] + 2 * radius)
+        , m_windows(m_stride * (radius + 1), 0)
+    {
+    }
+
+    void computeRow(int y, uint8_t *out)
+    {
+        int const w = m_src.extent[0];
+        int const h = m_src.extent[1];
+        memcpy(window(0), row(m_src, y), w);
+        for (int k = 1; k <= m_radius; ++k) {
+            uint8_t const *prev = window(k - 1);
+            uint8_t *cur = window(k);
+            uint8_t const *above = y - k >= 0 ? row(m_src, y - k) : nullptr;
+            uint8_t const *below = y + k < h ? row(m_src, y + k) : nullptr;
+            if (!dilate && (!above || !below)) {
+                memset(cur, 0, w);
+                continue;
+            }
+            memcpy(cur, prev, w);
+            for (uint8_t const *r : {above, below}) {
+                if (r) { // rows outside are 0, which doesn't change the max
+                    combineRow<dilate>(cur, r, w);
+                }
+            }
+        }
+
+        memcpy(out, window(m_circle[m_radius]), w);
+        for (int dx = -m_radius; dx <= m_radius; ++dx) {
+            if (dx != 0) {
+                combineRow<dilate>(out, window(m_circle[dx + m_radius]) + dx, w);
+            }
+        }
+    }
+
+private:
+    // Max/min of rows [y - k, y + k], with `radius` zeros on both sides.
+    uint8_t *window(int k)
+    {
+        return m_windows.data() + k * m_stride + m_radius;
+    }
+
+    visp::image_view m_src;
+    std::vector<int> const &m_circle;
+    int m_radius;
+    size_t m_stride;
+    std::vector<uint8_t> m_windows;
+};
+
+// Largest radius for BinaryMorphologyRows, distances are stored as 16 bit.
+int const maxBinaryRadius = 0xfffe;
+
+// Vertical distance from each pixel to the nearest pixel in its column which spreads: 255 when dilating, 0 when
+// eroding. Pixels outside the mask count as 0. Distances larger than the radius are stored as radius + 1.
+template<bool dilate>
+std::vector<uint16_t> columnDistances(visp::image_view const &src, int radius)
+{
+    int const w = src.extent[0];
+    int const h = src.extent[1];
+    uint16_t const far = uint16_t(radius + 1);
+    uint8_t const spreads = dilate ? 255 : 0;
+    uint16_t const outside = dilate ? far : 0;
+    std::vector<uint16_t> distances(size_t(w) * h);
+    parallelFor(w, 256, [&](int x0, int x1) {
+        int const n = x1 - x0;
+        for (int y = 0; y < h; ++y) {
+            uint8_t const *p = row(src, y) + x0;
+            uint16_t *d = distances.data() + size_t(y) * w + x0;
+            uint16_t const *above = y > 0 ? d - w : nullptr;
+            for (int x = 0; x < n; ++x) {
+                uint16_t const next = std::min<uint16_t>(uint16_t((above ? above[x] : outside) + 1), far);
+                d[x] = p[x] == spreads ? 0 : next;
+            }
+        }
+        for (int y = h - 1; y >= 0; --y) {
+            uint16_t *d = distances.data() + size_t(y) * w + x0;
+            uint16_t const *below = y < h - 1 ? d + w : nullptr;
+            for (int x = 0; x < n; ++x) {
+                uint16_t const next = std::min<uint16_t>(uint16_t((below ? below[x] : outside) + 1), far);
+                d[x] = std::min(d[x], next);
+            }
+        }
+    });
+    return distances;
+}
+
+// Dilation or erosion with the circle for masks which only contain 0 and 255, at a cost per pixel which doesn't depend
+// on the radius (a distance transform with the circle's metric). A pixel which spreads at vertical distance k covers
+// the pixels of the output row within the circle's half width at k. The covered intervals of a row are collected by
+// their start and merged in one sweep. Same result as ChordMorphologyRows.
+template<bool dilate>
+class BinaryMorphologyRows
+{
+public:
+    BinaryMorphologyRows(std::vector<uint16_t> const &distances, std::vector<int> const &circle, int radius, int width)
+        : m_distances(distances)
+        , m_circle(circle)
+        , m_radius(radius)
+        , m_width(width)
+        , m_reach(width)
+    {
+    }
+
+    void computeRow(int y, uint8_t *out)
+    {
+        int const w = m_width;
+        uint16_t const *d = m_distances.data() + size_t(y) * w;
+        // m_reach[x] is the last pixel covered by an interval which starts at x (intervals are clipped to the row).
+        std::fill(m_reach.begin(), m_reach.end(), -1);
+        if (!dilate) { // pixels left and right of the mask are 0 and spread
+            m_reach[0] = m_radius - 1;
+            int const right = std::max(0, w - m_radius);
+            m_reach[right] = std::max(m_reach[right], w - 1);
+        }
+        for (int x = 0; x < w; ++x) {
+            if (d[x] <= m_radius) {
+                int const extent = m_circle[m_radius + d[x]];
+                int const start = std::max(0, x - extent);
+                m_reach[start] = std::max(m_reach[start], x + extent);
+            }
+        }
+        int covered = -1;
+        for (int x = 0; x < w; ++x) {
+            covered = std::max(covered, m_reach[x]);
+            out[x] = (covered >= x) == dilate ? 255 : 0;
+        }
+    }
+
+private:
+    std::vector<uint16_t> const &m_distances;
+    std::vector<int> const &m_circle;
+    int m_radius;
+    int m_width;
+    std::vector<int> m_reach;
+};
+
+// Weights of a Gaussian with sigma = radius and kernel size 2 * radius + 1, as in KisFeatherSelectionFilter.
+std::vector<float> gaussianWeights(int radius)
+{
+    std::vector<float> weights(2 * radius + 1);
+    for (int k = -radius; k <= radius; ++k) {
+        weights[k + radius] = std::exp(-float(k * k) / float(2 * radius * radius));
+    }
+    float const sum = std::accumulate(weights.begin(), weights.end(), 0.f);
+    for (float &weight : weights) {
+        weight /= sum;
+    }
+    return weights;
+}
+
+// Horizontal pass of the separable Gaussian, one row at a time. The result is rounded to 8 bit before the vertical
+// pass like in Krita, where it goes through a paint device.
+class HorizontalBlur
+{
+public:
+    HorizontalBlur(std::vector<float> const &weights, int width)
+        : m_weights(weights)
+        , m_radius(int(weights.size()) / 2)
+        , m_padded(width + 2 * m_radius, 0.f)
+        , m_sums(width)
+    {
+    }
+
+    void computeRow(uint8_t const *in, uint8_t *out)
+    {
+        int const w = int(m_sums.size());
+        for (int x = 0; x < w; ++x) {
+            m_padded[x + m_radius] = in[x];
+        }
+        std::fill(m_sums.begin(), m_sums.end(), 0.f);
+        for (int k = 0; k < 2 * m_radius + 1; ++k) {
+            float const weight = m_weights[k];
+            float const *p = m_padded.data() + k;
+            for (int x = 0; x < w; ++x) {
+                m_sums[x] += weight * p[x];
+            }
+        }
+        for (int x = 0; x < w; ++x) {
+            out[x] = uint8_t(std::min(m_sums[x] + 0.5f, 255.f));
+        }
+    }
+
+private:
+    std::vector<float> const &m_weights;
+    int m_radius;
+    std::vector<float> m_padded;
+    std::vector<float> m_sums;
+};
+
+visp::image_data verticalBlur(visp::image_view const &src, std::vector<float> const &weights)
+{
+    int const w = src.extent[0];
+    int const h = src.extent[1];
+    int const radius = int(weights.size()) / 2;
+    visp::image_data dst = visp::image_alloc(src.extent, visp::image_format::alpha_u8);
+    parallelFor(h, 16, [&](int y0, int y1) {
+        std::vector<float> sums(w);
+        for (int y = y0; y < y1; ++y) {
+            std::fill(sums.begin(), sums.end(), 0.f);
+            for (int k = std::max(-radius, -y); k <= std::min(radius, h - 1 - y); ++k) {
+                float const weight = weights[k + radius];
+                uint8_t const *in = row(src, y + k);
+                for (int x = 0; x < w; ++x) {
+                    sums[x] += weight * in[x];
+                }
+            }
+            uint8_t *out = dst.data.get() + size_t(y) * w;
+            for (int x = 0; x < w; ++x) {
+                out[x] = uint8_t(std::min(sums[x] + 0.5f, 255.f));
+            }
+        }
+    });
+    return dst;
+}
+
+// Computes the rows of a mask with `makeRows()` (called per chunk of rows, see CopyRows), and feathers them with
+// the Gaussian. The horizontal pass of the blur runs on each row right after it is computed, so the unblurred mask is
+// never stored.
+template<typename MakeRows>
+visp::image_data computeAndFeather(visp::i32x2 extent, int feather, MakeRows const &makeRows)
+{
+    int const w = extent[0];
+    int const h = extent[1];
+    std::vector<float> const weights = feather > 0 ? gaussianWeights(feather) : std::vector<float>();
+    visp::image_data dst = visp::image_alloc(extent, visp::image_format::alpha_u8);
+    parallelFor(h, 16, [&](int y0, int y1) {
+        auto rows = makeRows();
+        if (feather > 0) {
+            HorizontalBlur blur(weights, w);
+            std::vector<uint8_t> line(w);
+            for (int y = y0; y < y1; ++y) {
+                rows.computeRow(y, line.data());
+                blur.computeRow(line.data(), dst.data.get() + size_t(y) * w);
+            }
+        } else {
+            for (int y = y0; y < y1; ++y) {
+                rows.computeRow(y, dst.data.get() + size_t(y) * w);
+            }
+        }
+    });
+    return feather > 0 ? verticalBlur(dst, weights) : std::move(dst);
+}
+
+template<bool dilate>
+visp::image_data morphologyAndFeather(visp::image_view const &src, int radius, int feather)
+{
+    std::vector<int> const circle = circleExtents(radius);
+    if (radius <= maxBinaryRadius && isBinary(src)) {
+        std::vector<uint16_t> const distances = columnDistances<dilate>(src, radius);
+        return computeAndFeather(src.extent, feather, [&] {
+            return BinaryMorphologyRows<dilate>(distances, circle, radius, src.extent[0]);
+        });
+    }
+    return computeAndFeather(src.extent, feather, [&] { return ChordMorphologyRows<dilate>(src, circle, radius); });
+}
+
+} // namespace
+
+void adjustMask(visp::image_data &mask, int grow, int feather)
+{
+    if (mask.format != visp::image_format::alpha_u8) {
+        throw std::runtime_error("adjustMask: expected 8-bit mask");
+    }
+    feather = std::max(feather, 0);
+    if (grow > 0) {
+        mask = morphologyAndFeather<true>(mask, grow, feather);
+    } else if (grow < 0) {
+        mask = morphologyAndFeather<false>(mask, -grow, feather);
+    } else if (feather > 0) {
+        mask = computeAndFeather(mask.extent, feather, [&] { return CopyRows(mask); });
+    }
+}
+
+//
+// Anti-aliasing
+
+namespace
+{
+
+// Distances between the samples when searching for the end of an edge, growing like in FXAA.
+int const edgeSearchSteps[] = {1, 1, 1, 1, 1, 2, 2, 2, 2, 4, 8};
+
+// Pixels which differ less from all their neighbors are not on an edge.
+int const edgeThreshold = 64;
+
+} // namespace
+
+void antiAliasMask(visp::image_data &mask)
+{
+    if (mask.format != visp::image_format::alpha_u8) {
+        throw std::runtime_error("antiAliasMask: expected 8-bit mask");
+    }
+    int const w = mask.extent[0];
+    int const h = mask.extent[1];
+    uint8_t const *src = mask.data.get();
+    auto at = [&](int x, int y) -> int {
+        return x >= 0 && x < w && y >= 0 && y < h ? src[size_t(y) * w + x] : 0;
+    };
+
+    visp::image_data result = visp::image_alloc(mask.extent, visp::image_format::alpha_u8);
+    parallelFor(h, 16, [&](int y0, int y1) {
+        for (int y = y0; y < y1; ++y) {
+            uint8_t *out = result.data.get() + size_t(y) * w;
+            memcpy(out, src + size_t(y) * w, w);
+            for (int x = 0; x < w; ++x) {
+                int const center = out[x];
+                int const north = std::abs(at(x, y - 1) - center);
+                int const south = std::abs(at(x, y + 1) - center);
+                int const west = std::abs(at(x - 1, y) - center);
+                int const east = std::abs(at(x + 1, y) - center);
+                if (std::max({north, south, west, east}) < edgeThreshold) {
+                    continue;
+                }
+                // The edge runs horizontally if the pixel differs more from a vertical neighbor. Its pair is the
+                // neighbor across the edge (cx, cy), the edge is followed in direction (ax, ay).
+                bool const horizontal = std::max(north, south) >= std::max(west, east);
+                int const ax = horizontal ? 1 : 0;
+                int const ay = horizontal ? 0 : 1;
+                int const cx = horizontal ? 0 : (west >= east ? -1 : 1);
+                int const cy = horizontal ? (north >= south ? -1 : 1) : 0;
+                int const pair = at(x + cx, y + cy);
+                int const edge = center + pair; // twice the value between the pixel and its pair
+                int const threshold = std::abs(pair - center) / 2;
+
+                // Follows the edge until the average across it changes. Returns the distance, and the change (0 if
+                // the edge doesn't end within the search distance).
+                auto findEnd = [&](int direction, int &change) {
+                    int distance = 0;
+                    for (int step : edgeSearchSteps) {
+                        distance += step;
+                        int const px = x + direction * ax * distance;
+                        int const py = y + direction * ay * distance;
+                        change = at(px, py) + at(px + cx, py + cy) - edge;
+                        if (std::abs(change) >= threshold) {
+                            return distance;
+                        }
+                    }
+                    change = 0;
+                    return distance;
+                };
+                int negativeChange = 0;
+                int positiveChange = 0;
+                int const negative = findEnd(-1, negativeChange);
+                int const positive = findEnd(1, positiveChange);
+                // Blend with the pair towards the closer end of the edge if it steps to this pixel's side, so that
+                // the blend goes from 50% at the step to 0% in the middle of the edge.
+                int const change = negative < positive ? negativeChange : positiveChange;
+                if (change == 0 || (change < 0) == (2 * center < edge)) {
+                    continue;
+                }
+                float const offset = 0.5f - float(std::min(negative, positive)) / float(negative + positive);
+                out[x] = uint8_t(std::lround(center + (pair - center) * offset));
+            }
+        }
+    });
+    mask = std::move(result);
+}
+
+//
+// Contour tracing
+
+namespace
+{
+
+// Cell edges, clockwise. Cell (x, y) has corner pixels (x, y), (x + 1, y), (x + 1, y + 1), (x, y + 1).
+enum Edge { top, right, bottom, left };
+
+// Corners at the ends of each edge in clockwise order: top-left, top-right, bottom-right, bottom-left.
+int const edgeStart[4] = {0, 1, 2, 3};
+int const edgeEnd[4] = {1, 2, 3, 0};
+int const cornerDx[4] = {0, 1, 1, 0};
+int const cornerDy[4] = {0, 0, 1, 1};
+
+class ContourTracer
+{
+public:
+    ContourTracer(visp::image_view const &mask, float level)
+        : m_mask(mask)
+        , m_level(level)
+        , m_cellsX(mask.extent[0] + 1)
+        , m_cellsY(mask.extent[1] + 1)
+        , m_visited(size_t(m_cellsX) * m_cellsY, 0)
+    {
+    }
+
+    std::vector<Contour> trace()
+    {
+        std::vector<Contour> result;
+        for (int cy = -1; cy < m_cellsY - 1; ++cy) {
+            for (int cx = -1; cx < m_cellsX - 1; ++cx) {
+                int const inside = insideCorners(cx, cy);
+                if (inside == 0 || inside == 0xf) {
+                    continue;
+                }
+                for (int e = 0; e < 4; ++e) {
+                    if (isEntry(inside, e) && !(visited(cx, cy) & (1 << e))) {
+                        result.push_back(follow(cx, cy, e));
+                    }
+                }
+            }
+        }
+        return result;
+    }
+
+private:
+    float value(int x, int y) const
+    {
+        if (x < 0 || y < 0 || x >= m_mask.extent[0] || y >= m_mask.extent[1]) {
+            return 0.f;
+        }
+        return row(m_mask, y)[x];
+    }
+
+    // Bit i is set if corner i of the cell is inside.
+    int insideCorners(int cx, int cy) const
+    {
+        int result = 0;
+        for (int i = 0; i < 4; ++i) {
+            result |= value(cx + cornerDx[i], cy + cornerDy[i]) > m_level ? (1 << i) : 0;
+        }
+        return result;
+    }
+
+    // Contours are oriented with the inside on the left: they enter a cell through edges where going clockwise
+    // crosses from outside to inside, and leave where it crosses from inside to outside.
+    static bool isEntry(int inside, int e)
+    {
+        return !(inside & (1 << edgeStart[e])) && (inside & (1 << edgeEnd[e]));
+    }
+
+    int exitEdge(int cx, int cy, int inside, int entry) const
+    {
+        bool const saddle = inside == 0x5 || inside == 0xa;
+        if (saddle) {
+            // Cut off the corners which are not connected through the cell center.
+            float center = 0.f;
+            for (int i = 0; i < 4; ++i) {
+                center += value(cx + cornerDx[i], cy + cornerDy[i]);
+            }
+            bool const centerInside = center / 4 > m_level;
+            // The corner shared by the entry edge and the exit edge is at the end of the entry edge (inside) if the
+            // contour cuts off an inside corner, at its start (outside) otherwise.
+            return centerInside ? (entry + 3) % 4 : (entry + 1) % 4;
+        }
+        for (int e = 0; e < 4; ++e) {
+            if ((inside & (1 << edgeStart[e])) && !(inside & (1 << edgeEnd[e]))) {
+                return e;
+            }
+        }
+        return -1;
+    }
+
+    ContourPoint crossing(int cx, int cy, int e) const
+    {
+        int const x0 = cx + cornerDx[edgeStart[e]], y0 = cy + cornerDy[edgeStart[e]];
+        int const x1 = cx + cornerDx[edgeEnd[e]], y1 = cy + cornerDy[edgeEnd[e]];
+        float const v0 = value(x0, y0), v1 = value(x1, y1);
+        float const t = (m_level - v0) / (v1 - v0);
+        return {x0 + t * (x1 - x0) + 0.5f, y0 + t * (y1 - y0) + 0.5f};
+    }
+
+    uint8_t &visited(int cx, int cy)
+    {
+        return m_visited[size_t(cy + 1) * m_cellsX + (cx + 1)];
+    }
+
+    Contour follow(int cx, int cy, int entry)
+    {
+        Contour contour;
+        int const startX = cx, startY = cy, startEntry = entry;
+        do {
+            visited(cx, cy) |= 1 << entry;
+            int const exit = exitEdge(cx, cy, insideCorners(cx, cy), entry);
+            addPoint(contour, crossing(cx, cy, exit));
+            switch (exit) {
+            case top:
+                cy -= 1;
+                break;
+            case right:
+                cx += 1;
+                break;
+            case bottom:
+                cy += 1;
+                break;
+            case left:
+                cx -= 1;
+                break;
+            }
+            entry = (exit + 2) % 4;
+        } while (cx != startX || cy != startY || entry != startEntry);
+
+        // Also check the points where the contour wraps around.
+        while (contour.size() > 3 && collinear(contour[contour.size() - 2], contour.back(), contour.front())) {
+            contour.pop_back();
+        }
+        while (contour.size() > 3 && collinear(contour.back(), contour[0], contour[1])) {
+            contour.erase(contour.begin());
+        }
+        return contour;
+    }
+
+    static bool collinear(ContourPoint a, ContourPoint b, ContourPoint c)
+    {
+        float const cross = (b.x - a.x) * (c.y - b.y) - (b.y - a.y) * (c.x - b.x);
+        return std::abs(cross) < 1e-4f;
+    }
+
+    static void addPoint(Contour &contour, ContourPoint p)
+    {
+        if (contour.size() >= 2 && collinear(contour[contour.size() - 2], contour.back(), p)) {
+            contour.back() = p;
+        } else {
+            contour.push_back(p);
+        }
+    }
+
+    visp::image_view m_mask;
+    float m_level;
+    int m_cellsX;
+    int m_cellsY;
+    std::vector<uint8_t> m_visited; // entry edges of contours which were traced, per cell
+};
+
+} // namespace
+
+std::vector<Contour> traceContours(visp::image_view const &mask, float level)
+{
+    if (mask.format != visp::image_format::alpha_u8) {
+        throw std::runtime_error("traceContours: expected 8-bit mask");
+    }
+    return ContourTracer(mask, level).trace();
+}
+
+//
+// Inpaint mask post-processing
+
+void erodeBlurMaskToAlpha(visp::image_view const &mask, visp::image_data &rgba)
+{
+    int const w = mask.extent[0];
+    int const h = mask.extent[1];
+    if (mask.format != visp::image_format::alpha_u8 || rgba.format != visp::image_format::rgba_u8) {
+        throw std::runtime_error("erodeBlurMaskToAlpha: expected alpha_u8 mask and rgba_u8 image");
+    }
+    if (rgba.extent[0] != w || rgba.extent[1] != h) {
+        throw std::runtime_error("erodeBlurMaskToAlpha: mask and image size don't match");
+    }
+
+    // Erosion followed by blur reads a 5x5 neighbourhood. Output only differs from input where that neighbourhood
+    // is not constant. For each row, find runs of pixels which differ from their neighbour to the right or below, and
+    // widen them to the columns whose neighbourhood includes such a pair.
+    using Interval = std::pair<int, int>; // first and last column, inclusive
+    std::vector<std::vector<Interval>> edges(h);
+    parallelFor(h, 64, [&](int y0, int y1) {
+        for (int y = y0; y < y1; ++y) {
+            uint8_t const *cur = row(mask, y);
+            uint8_t const *next = row(mask, std::min(y + 1, h - 1));
+            std::vector<Interval> &runs = edges[y];
+            for (int x = 0; x < w; ++x) {
+                if (cur[x] != next[x] || (x + 1 < w && cur[x] != cur[x + 1])) {
+                    int const begin = std::max(x - 2, 0);
+                    int const end = std::min(x + 3, w - 1);
+                    if (!runs.empty() && runs.back().second >= begin - 1) {
+                        runs.back().second = end;
+                    } else {
+                        runs.emplace_back(begin, end);
+                    }
+                }
+            }
+        }
+    });
+
+    size_t const rgbaStride = size_t(w) * 4;
+    parallelFor(h, 32, [&](int y0, int y1) {
+        std::vector<uint8_t> vmin(w);
+        std::vector<uint8_t> eroded(3 * size_t(w));
+        std::vector<Interval> bands;
+
+        // Eroded row r (3x3 min, clamped at borders) for columns [x0, x1].
+        auto erodeRow = [&](int r, int x0, int x1, uint8_t *out) {
+            uint8_t const *above = row(mask, clampIndex(r - 1, h));
+            uint8_t const *center = row(mask, r);
+            uint8_t const *below = row(mask, clampIndex(r + 1, h));
+            int v0 = std::max(x0 - 1, 0);
+            int v1 = std::min(x1 + 1, w - 1);
+            for (int x = v0; x <= v1; ++x) {
+                vmin[x] = std::min(std::min(above[x], center[x]), below[x]);
+            }
+            for (int x = x0; x <= x1; ++x) {
+                out[x] = std::min(std::min(vmin[clampIndex(x - 1, w)], vmin[x]), vmin[clampIndex(x + 1, w)]);
+            }
+        };
+
+        for (int y = y0; y < y1; ++y) {
+            uint8_t const *src = row(mask, y);
+            uint8_t *dst = rgba.data.get() + size_t(y) * rgbaStride + 3;
+            for (int x = 0; x < w; ++x) {
+                dst[4 * x] = src[x];
+            }
+
+            // Edge runs of the rows within reach, merged. Solid interior between them is skipped.
+            bands.clear();
+            for (int r = std::max(y - 2, 0); r <= std::min(y + 2, h - 1); ++r) {
+                bands.insert(bands.end(), edges[r].begin(), edges[r].end());
+            }
+            std::sort(bands.begin(), bands.end());
+            size_t merged = 0;
+            for (size_t i = 0; i < bands.size(); ++i) {
+                if (merged > 0 && bands[i].first <= bands[merged - 1].second + 1) {
+                    bands[merged - 1].second = std::max(bands[merged - 1].second, bands[i].second);
+                } else {
+                    bands[merged++] = bands[i];
+                }
+            }
+            bands.resize(merged);
+
+            uint8_t *rows[3] = {eroded.data(), eroded.data() + w, eroded.data() + 2 * w};
+            for (auto [bandBegin, bandEnd] : bands) {
+                int e0 = std::max(bandBegin - 1, 0);
+                int e1 = std::min(bandEnd + 1, w - 1);
+                for (int k = 0; k < 3; ++k) {
+                    erodeRow(clampIndex(y - 1 + k, h), e0, e1, rows[k]);
+                }
+                for (int x = bandBegin; x <= bandEnd; ++x) {
+                    int xl = clampIndex(x - 1, w);
+                    int xr = clampIndex(x + 1, w);
+                    int sum = 0;
+                    for (uint8_t const *e : rows) {
+                        sum += e[xl] + e[x] + e[xr];
+                    }
+                    dst[4 * x] = uint8_t((sum + 4) / 9);
+                }
+            }
+        }
+    });
+}
+
+//
+// Matte refinement
+
+visp::image_data refineMatte(visp::image_view const &image, visp::image_view const &mask, int radius, float eps)
+{
+    if (visp::n_bytes(image.format) != 4 || mask.format != visp::image_format::alpha_u8) {
+        throw std::runtime_error("refineMatte: expected 4-channel u8 image and alpha_u8 mask");
+    }
+    if (image.extent[0] != mask.extent[0] || image.extent[1] != mask.extent[1]) {
+        throw std::runtime_error("refineMatte: image and mask size don't match");
+    }
+    int const w = mask.extent[0];
+    int const h = mask.extent[1];
+    int const r = std::max(1, radius);
+    visp::image_data result = visp::image_alloc(mask.extent, visp::image_format::alpha_u8);
+    uint8_t *out = result.data.get();
+
+    std::vector<int> fractionalRows(h + 1, 0);
+    parallelFor(h, 64, [&](int y0, int y1) {
+        for (int y = y0; y < y1; ++y) {
+            uint8_t const *p = row(mask, y);
+            bool fractional = false;
+            for (int x = 0; x < w; ++x) {
+                fractional |= p[x] != 0 && p[x] != 255;
+            }
+            std::copy(p, p + w, out + size_t(y) * w);
+            fractionalRows[y + 1] = fractional ? 1 : 0;
+        }
+    });
+    for (int y = 0; y < h; ++y) {
+        fractionalRows[y + 1] += fractionalRows[y];
+    }
+    auto inBand = [&](int y) {
+        return fractionalRows[std::min(h, y + r + 1)] - fractionalRows[std::max(0, y - r)] > 0;
+    };
+
+    // Guide is luminance in [0, 255], weights are symmetric so it doesn't matter if the image is RGBA or BGRA.
+    auto guideRow = [&](int y, int32_t *guide) {
+        uint8_t const *px = row(image, y);
+        for (int x = 0; x < w; ++x) {
+            guide[x] = (px[4 * x] + 2 * px[4 * x + 1] + px[4 * x + 2] + 2) / 4;
+        }
+    };
+
+    int const stripeHeight = 64;
+    int const stripeCount = (h + stripeHeight - 1) / stripeHeight;
+    parallelFor(stripeCount, 1, [&](int s0, int s1) {
+        std::vector<int32_t> guide(w);
+        std::vector<int32_t> statSums(4 * size_t(w)); // I, p, I*p, I*I
+        std::vector<int64_t> statPrefix(4 * (size_t(w) + 1));
+        std::vector<float> coeffs; // a, b per pixel for rows [ya0, ya1)
+        std::vector<double> coeffSums(3 * size_t(w)); // a, b, fractional count
+        std::vector<double> coeffPrefix(3 * (size_t(w) + 1));
+
+        auto addStats = [&](int y, int sign) {
+            guideRow(y, guide.data());
+            uint8_t const *p = row(mask, y);
+            int32_t *sumI = statSums.data();
+            int32_t *sumP = sumI + w;
+            int32_t *sumIP = sumI + 2 * w;
+            int32_t *sumII = sumI + 3 * w;
+            for (int x = 0; x < w; ++x) {
+                int32_t i = sign * guide[x];
+                sumI[x] += i;
+                sumP[x] += sign * p[x];
+                sumIP[x] += i * p[x];
+                sumII[x] += i * guide[x];
+            }
+        };
+        auto addCoeffs = [&](int y, int ya0, int sign) {
+            float const *ab = coeffs.data() + size_t(y - ya0) * 2 * w;
+            uint8_t const *p = row(mask, y);
+            double *sumA = coeffSums.data();
+            double *sumB = sumA + w;
+            double *sumF = sumA + 2 * w;
+            for (int x = 0; x < w; ++x) {
+                sumA[x] += sign * ab[2 * x];
+                sumB[x] += sign * ab[2 * x + 1];
+                sumF[x] += (p[x] != 0 && p[x] != 255) ? sign : 0;
+            }
+        };
+        auto windowRows = [&](int y) {
+            return std::min(h - 1, y + r) - std::max(0, y - r) + 1;
+        };
+
+        for (int s = s0; s < s1; ++s) {
+            int const y0 = s * stripeHeight;
+            int const y1 = std::min(h, y0 + stripeHeight);
+            bool any = false;
+            for (int y = y0; y < y1 && !any; ++y) {
+                any = inBand(y);
+            }
+            if (!any) {
+                continue;
+            }
+
+            // First box filter: local linear coefficients a, b for all rows the second box filter reads.
+            int const ya0 = std::max(0, y0 - r);
+            int const ya1 = std::min(h, y1 + r);
+            coeffs.resize(size_t(ya1 - ya0) * 2 * w);
+            std::fill(statSums.begin(), statSums.end(), 0);
+            for (int y = std::max(0, ya0 - r); y <= std::min(h - 1, ya0 + r); ++y) {
+                addStats(y, 1);
+            }
+            for (int y = ya0; y < ya1; ++y) {
+                for (int p = 0; p < 4; ++p) {
+                    int32_t const *sums = statSums.data() + p * size_t(w);
+                    int64_t *prefix = statPrefix.data() + p * (size_t(w) + 1);
+                    prefix[0] = 0;
+                    for (int x = 0; x < w; ++x) {
+                        prefix[x + 1] = prefix[x] + sums[x];
+                    }
+                }
+                float *ab = coeffs.data() + size_t(y - ya0) * 2 * w;
+                int const rows = windowRows(y);
+                for (int x = 0; x < w; ++x) {
+                    int x0 = std::max(0, x - r);
+                    int x1 = std::min(w - 1, x + r);
+                    float norm = 1.f / (float(rows) * (x1 - x0 + 1) * 255.f);
+                    auto mean = [&](int p) {
+                        int64_t const *prefix = statPrefix.data() + p * (size_t(w) + 1);
+                        return float(prefix[x1 + 1] - prefix[x0]) * norm;
+                    };
+                    float meanI = mean(0);
+                    float meanP = mean(1);
+                    float meanIP = mean(2) / 255.f;
+                    float meanII = mean(3) / 255.f;
+                    float a = (meanIP - meanI * meanP) / (meanII - meanI * meanI + eps);
+                    ab[2 * x] = a;
+                    ab[2 * x + 1] = meanP - a * meanI;
+                }
+                if (y + 1 + r < h) {
+                    addStats(y + 1 + r, 1);
+                }
+                if (y - r >= 0) {
+                    addStats(y - r, -1);
+                }
+            }
+
+            // Second box filter: average coefficients and apply them to the guide inside the band.
+            std::fill(coeffSums.begin(), coeffSums.end(), 0.0);
+            for (int y = std::max(0, y0 - r); y <= std::min(h - 1, y0 + r); ++y) {
+                addCoeffs(y, ya0, 1);
+            }
+            for (int y = y0; y < y1; ++y) {
+                if (inBand(y)) {
+                    for (int p = 0; p < 3; ++p) {
+                        double const *sums = coeffSums.data() + p * size_t(w);
+                        double *prefix = coeffPrefix.data() + p * (size_t(w) + 1);
+                        prefix[0] = 0;
+                        for (int x = 0; x < w; ++x) {
+                            prefix[x + 1] = prefix[x] + sums[x];
+                        }
+                    }
+                    auto windowSum = [&](int p, int x0, int x1) {
+                        double const *prefix = coeffPrefix.data() + p * (size_t(w) + 1);
+                        return prefix[x1 + 1] - prefix[x0];
+                    };
+                    guideRow(y, guide.data());
+                    uint8_t *q = out + size_t(y) * w;
+                    int const rows = windowRows(y);
+                    for (int x = 0; x < w; ++x) {
+                        int x0 = std::max(0, x - r);
+                        int x1 = std::min(w - 1, x + r);
+                        if (windowSum(2, x0, x1) < 0.5) {
+                            continue; // no uncertain pixels nearby
+                        }
+                        double norm = 1.0 / (double(rows) * (x1 - x0 + 1));
+                        double a = windowSum(0, x0, x1) * norm;
+                        double b = windowSum(1, x0, x1) * norm;
+                        double value = (a * guide[x] / 255.0 + b) * 255.0;
+                        q[x] = uint8_t(std::clamp(value + 0.5, 0.0, 255.0));
+                    }
+                }
+                if (y + 1 + r < ya1) {
+                    addCoeffs(y + 1 + r, ya0, 1);
+                }
+                if (y - r >= 0) {
+                    addCoeffs(y - r, ya0, -1);
+                }
+            }
+        }
+    });
+    return result;
+}
+
+//
+// Foreground estimation
+
+ForegroundEstimator::ForegroundEstimator(visp::image_view const &image, visp::image_view const &mask, int radius)
+    : m_image(image)
+    , m_mask(mask)
+    , m_radius(std::max(1, radius))
+{
+    if (visp::n_bytes(image.format) != 4 || mask.format != visp::image_format::alpha_u8) {
+        throw std::runtime_error("ForegroundEstimator: expected 4-channel u8 image and alpha_u8 mask");
+    }
+    if (image.extent[0] != mask.extent[0] || image.extent[1] != mask.extent[1]) {
+        throw std::runtime_error("ForegroundEstimator: image and mask size don't match");
+    }
+    size_t const w = size_t(image.extent[0]);
+    m_columnSums.resize(7 * w);
+    m_prefixSums.resize(7 * (w + 1));
+}
+
+void ForegroundEstimator::resetWindow(int y)
+{
+    std::fill(m_columnSums.begin(), m_columnSums.end(), 0);
+    int const h = m_image.extent[1];
+    for (int r = std::max(0, y - m_radius); r <= std::min(h - 1, y + m_radius); ++r) {
+        addRow(r, 1);
+    }
+    m_next = y;
+}
+
+void ForegroundEstimator::addRow(int y, int sign)
+{
+    int const w = m_image.extent[0];
+    uint8_t const *pixels = row(m_image, y);
+    uint8_t const *alpha = row(m_mask, y);
+    int32_t *sumA = m_columnSums.data();
+    for (int x = 0; x < w; ++x) {
+        sumA[x] += sign * alpha[x];
+    }
+    for (int c = 0; c < 3; ++c) {
+        int32_t *sumFg = sumA + (1 + c) * w;
+        int32_t *sumBg = sumA + (4 + c) * w;
+        for (int x = 0; x < w; ++x) {
+            int32_t value = sign * pixels[4 * x + c];
+            sumFg[x] += value * alpha[x];
+            sumBg[x] += value * (255 - alpha[x]);
+        }
+    }
+}
+
+void ForegroundEstimator::estimateRow(int y, uint8_t *dst)
+{
+    int const w = m_image.extent[0];
+    int const h = m_image.extent[1];
+    uint8_t const *pixels = row(m_image, y);
+    uint8_t const *alpha = row(m_mask, y);
+
+    bool fractional = false;
+    for (int x = 0; x < w; ++x) {
+        dst[4 * x + 0] = pixels[4 * x + 0];
+        dst[4 * x + 1] = pixels[4 * x + 1];
+        dst[4 * x + 2] = pixels[4 * x + 2];
+        dst[4 * x + 3] = alpha[x];
+        fractional |= alpha[x] != 0 && alpha[x] != 255;
+    }
+    if (!fractional) {
+        return;
+    }
+
+    // Prefix sums along the row turn the horizontal part of the box blur into two lookups per pixel.
+    size_t const stride = size_t(w) + 1;
+    for (int p = 0; p < 7; ++p) {
+        int32_t const *sums = m_columnSums.data() + p * size_t(w);
+        int64_t *prefix = m_prefixSums.data() + p * stride;
+        prefix[0] = 0;
+        for (int x = 0; x < w; ++x) {
+            prefix[x + 1] = prefix[x] + sums[x];
+        }
+    }
+    auto windowSum = [&](int p, int x0, int x1) {
+        int64_t const *prefix = m_prefixSums.data() + p * stride;
+        return prefix[x1 + 1] - prefix[x0];
+    };
+
+    int const rows = std::min(h - 1, y + m_radius) - std::max(0, y - m_radius) + 1;
+    for (int x = 0; x < w; ++x) {
+        int const a = alpha[x];
+        if (a == 0 || a == 255) {
+            continue;
+        }
+        int x0 = std::max(0, x - m_radius);
+        int x1 = std::min(w - 1, x + m_radius);
+        int64_t count = int64_t(rows) * (x1 - x0 + 1);
+        int64_t sumA = windowSum(0, x0, x1);
+        int64_t sumB = 255 * count - sumA;
+        float const fa = a / 255.f;
+        for (int c = 0; c < 3; ++c) {
+            float value = pixels[4 * x + c];
+            float fg = sumA > 0 ? float(windowSum(1 + c, x0, x1)) / float(sumA) : value;
+            float bg = sumB > 0 ? float(windowSum(4 + c, x0, x1)) / float(sumB) : value;
+            float result = fg + fa * (value - fa * fg - (1.f - fa) * bg);
+            dst[4 * x + c] = uint8_t(std::clamp(result + 0.5f, 0.f, 255.f));
+        }
+    }
+}
+
+void ForegroundEstimator::estimateRows(int y0, int y1, uint8_t *dst, size_t dstStride)
+{
+    int const h = m_image.extent[1];
+    if (m_next != y0) {
+        resetWindow(y0);
+    }
+    for (int y = y0; y < y1; ++y) {
+        estimateRow(y, dst + size_t(y - y0) * dstStride);
+
+        // Slide the vertical window down by one row.
+        if (y + 1 + m_radius < h) {
+            addRow(y + 1 + m_radius, 1);
+        }
+        if (y - m_radius >= 0) {
+            addRow(y - m_radius, -1);
+        }
+        m_next = y + 1;
+    }
+}
+
+visp::image_data extractForeground(visp::image_view const &image,
+                                   visp::image_view const &mask,
+                                   bool refineEdges,
+                                   bool estimateForeground)
+{
+    if (visp::n_bytes(image.format) != 4 || mask.format != visp::image_format::alpha_u8) {
+        throw std::runtime_error("extractForeground: expected 4-channel u8 image and alpha_u8 mask");
+    }
+    visp::image_data refined;
+    visp::image_view alpha = mask;
+    if (refineEdges) {
+        refined = refineMatte(image, mask);
+        alpha = refined;
+    }
+    visp::image_data result = visp::image_alloc(image.extent, image.format);
+    size_t const stride = size_t(image.extent[0]) * 4;
+    parallelFor(image.extent[1], 64, [&](int y0, int y1) {
+        if (estimateForeground) {
+            ForegroundEstimator estimator(image, alpha);
+            estimator.estimateRows(y0, y1, result.data.get() + y0 * stride, stride);
+            return;
+        }
+        for (int y = y0; y < y1; ++y) {
+            uint8_t const *src = row(image, y);
+            uint8_t const *a = row(alpha, y);
+            uint8_t *dst = result.data.get() + y * stride;
+            for (int x = 0; x < image.extent[0]; ++x) {
+                dst[4 * x + 0] = src[4 * x + 0];
+                dst[4 * x + 1] = src[4 * x + 1];
+                dst[4 * x + 2] = src[4 * x + 2];
+                dst[4 * x + 3] = a[x];
+            }
+        }
+    });
+    return result;
+}
+
+} // namespace VisionMLImageOps
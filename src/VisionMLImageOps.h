@@ -0,0 +1,148 @@
+#ifndef VISION_ML_IMAGE_OPS_H_
+#define VISION_ML_IMAGE_OPS_H_
+
+#include <visp/vision.h>
+
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <memory>
+#include <vector>
+
+// Image and mask kernels used for pre- and post-processing around inference. They work on 8-bit data in place or
+// stream through small per-thread buffers, to avoid full-size float temporaries for large images.
+namespace VisionMLImageOps
+{
+
+// Number of threads used by parallelFor. Defaults to the number of hardware threads.
+int threadCount();
+void setThreadCount(int count);
+
+// Limits parallelFor on the calling thread while it is in scope, eg. for post-processing which runs at the same time
+// as inference. Only lowers the global thread count, never raises it.
+class ScopedThreadLimit
+{
+public:
+    explicit ScopedThreadLimit(int count);
+    ~ScopedThreadLimit();
+
+    ScopedThreadLimit(ScopedThreadLimit const &) = delete;
+    ScopedThreadLimit &operator=(ScopedThreadLimit const &) = delete;
+
+private:
+    int m_previous;
+};
+
+// Number of physical CPU cores (without SMT siblings). Falls back to hardware threads if it can't be determined.
+int physicalCoreCount();
+
+// Splits [0, count) into chunks of at least `grain` elements and runs fn(begin, end) for each on worker threads.
+// Blocks until all chunks are done. Exceptions thrown by fn are rethrown in the calling thread. Worker threads are
+// shared by all callers and kept alive between calls. The calling thread processes chunks too, so nested and
+// concurrent calls don't wait for each other.
+void parallelFor(int count, int grain, std::function<void(int, int)> const &fn);
+
+// Runs task on one of the parallelFor worker threads, eg. a pipeline stage which overlaps with inference. The task
+// should not wait for other async tasks, as they may be queued behind it.
+void post(std::function<void()> task);
+
+// Like post(), returns a future for the result or exception of fn.
+template<typename Fn>
+auto runAsync(Fn fn) -> std::future<decltype(fn())>
+{
+    auto task = std::make_shared<std::packaged_task<decltype(fn())()>>(std::move(fn));
+    std::future<decltype(fn())> result = task->get_future();
+    post([task]() { (*task)(); });
+    return result;
+}
+
+// 64-bit hash of the pixel content (not padding) of an image. Used to recognize inputs which were processed before.
+uint64_t hashImage(visp::image_view const &image);
+
+// Bounding box of the non-zero pixels of an 8-bit mask. Empty if all pixels are zero.
+struct MaskBounds {
+    int x = 0;
+    int y = 0;
+    int width = 0;
+    int height = 0;
+
+    bool empty() const
+    {
+        return width <= 0 || height <= 0;
+    }
+};
+MaskBounds maskBounds(visp::image_view const &mask);
+
+// Copies a region of a mask into a new contiguous mask. Parts of the region outside the mask are 0.
+visp::image_data cropMask(visp::image_view const &mask, MaskBounds const &region);
+
+// Grows (grow > 0) or shrinks (grow < 0) the mask with a circular structuring element, then blurs it with a Gaussian
+// of standard deviation `feather`. Same results as Krita's grow, shrink and feather selection filters (up to rounding
+// of the blur), with pixels outside the mask treated as 0. The mask needs a margin of max(grow, 0) + feather around
+// its content, see cropMask. For masks with only 0 and 255 the cost of grow/shrink doesn't depend on the radius.
+void adjustMask(visp::image_data &mask, int grow, int feather);
+
+// Smooths staircase edges of the mask, like Krita's anti-alias selection filter (FXAA-style: pixels along an edge are
+// blended with their neighbor across it, depending on the distance to the nearest step of the edge). Results are
+// close to, but not the same as Krita's. Changes pixels up to one pixel outside of the content, so the mask needs a
+// margin of 1.
+void antiAliasMask(visp::image_data &mask);
+
+// Closed contours of a mask at the given level (0-255), using marching squares with linear interpolation between
+// pixel centers for subpixel positions. Pixels outside the mask count as 0, so all contours are closed. Points are in
+// pixel coordinates, pixel (0, 0) covers [0, 1) x [0, 1). Points on straight lines between two others are removed.
+struct ContourPoint {
+    float x;
+    float y;
+};
+using Contour = std::vector<ContourPoint>;
+std::vector<Contour> traceContours(visp::image_view const &mask, float level = 127.5f);
+
+// Erodes the inpaint mask by one pixel and softens it with a 3x3 box blur, writing the result into the alpha
+// channel of `rgba` (same extent as mask). Only pixels close to a mask edge are filtered, the rest is copied.
+void erodeBlurMaskToAlpha(visp::image_view const &mask, visp::image_data &rgba);
+
+// Refines a soft matte with a guided filter (He et al. 2013), using luminance of the 4-channel 8-bit image as guide.
+// This recovers detail from the full resolution image where the matte was upsampled from model resolution. Only
+// pixels within `radius` of a fractional mask value are changed, the result is otherwise a copy of the mask.
+visp::image_data refineMatte(visp::image_view const &image, visp::image_view const &mask, int radius = 8,
+                             float eps = 1e-4f);
+
+// Estimates foreground colors of pixels where the mask is fractional, using Blur-Fusion (Forte & Pitie 2021):
+// F = F' + a * (I - a * F' - (1 - a) * B'), where F' and B' are box-blurred foreground and background colors.
+// Works on 4-channel 8-bit images with alpha in the last channel, other channels keep their order. Output is the
+// image with alpha replaced by the mask. Pixels where the mask is 0 or 255 are copied.
+//
+// Rows are processed as a stream. Only running column sums of the blur window are kept, so memory use does not
+// depend on image height. Consecutive calls to estimateRows continue from the previous window.
+class ForegroundEstimator
+{
+public:
+    ForegroundEstimator(visp::image_view const &image, visp::image_view const &mask, int radius = 45);
+
+    // Writes rows [y0, y1) to dst, which has space for (y1 - y0) rows of `dstStride` bytes.
+    void estimateRows(int y0, int y1, uint8_t *dst, size_t dstStride);
+
+private:
+    void resetWindow(int y);
+    void addRow(int y, int sign);
+    void estimateRow(int y, uint8_t *dst);
+
+    visp::image_view m_image;
+    visp::image_view m_mask;
+    int m_radius;
+    int m_next = -1; // row for which column sums are valid
+    std::vector<int32_t> m_columnSums; // 7 planes: a, a*c0..2, (1-a)*c0..2
+    std::vector<int64_t> m_prefixSums; // 7 planes of width+1
+};
+
+// Whole-image background removal post-processing: optionally refines the mask, and returns a copy of the image
+// with the mask as alpha, or with estimated foreground colors.
+visp::image_data extractForeground(visp::image_view const &image,
+                                   visp::image_view const &mask,
+                                   bool refineEdges,
+                                   bool estimateForeground);
+
+} // namespace VisionMLImageOps
+
+#endif // VISION_ML_IMAGE_OPS_H_
@@ -0,0 +1,379 @@
+#include "VisionMLModelRegistry.h"
+#include "VisionMLModelVariants.h"
+
+#include <klocalizedstring.h>
+
+#include <QDateTime>
+#include <QDebug>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QLocale>
+#include <QMap>
+#include <QRegularExpression>
+#include <QSaveFile>
+#include <QSet>
+
+#include <algorithm>
+
+#include <ggml.h>
+#include <gguf.h>
+
+namespace
+{
+
+int const indexVersion = 1;
+
+// Reads metadata without loading any tensor data.
+bool readHeader(QString const &path, VisionMLModelInfo &info)
+{
+    gguf_init_params params{/*no_alloc*/ true, /*ctx*/ nullptr};
+    gguf_context *ctx = gguf_init_from_file(QFile::encodeName(path).constData(), params);
+    if (!ctx) {
+        return false;
+    }
+
+    int64_t archKey = gguf_find_key(ctx, "general.architecture");
+    if (archKey >= 0 && gguf_get_kv_type(ctx, archKey) == GGUF_TYPE_STRING) {
+        info.arch = QString::fromUtf8(gguf_get_val_str(ctx, archKey));
+    }
+
+    // Keys are model specific, eg. "sam.image_size" or "migan.resolution".
+    for (int64_t i = 0; i < gguf_get_n_kv(ctx) && info.resolution == 0; ++i) {
+        QByteArray key = gguf_get_key(ctx, i);
+        if (key.endsWith("image_size") || key.endsWith("img_size") || key.endsWith("resolution")) {
+            switch (gguf_get_kv_type(ctx, i)) {
+            case GGUF_TYPE_UINT32:
+                info.resolution = int(gguf_get_val_u32(ctx, i));
+                break;
+            case GGUF_TYPE_INT32:
+                info.resolution = gguf_get_val_i32(ctx, i);
+                break;
+            default:
+                break;
+            }
+        }
+    }
+
+    QMap<QString, size_t> bytesPerType;
+    for (int64_t i = 0; i < gguf_get_n_tensors(ctx); ++i) {
+        bytesPerType[ggml_type_name(gguf_get_tensor_type(ctx, i))] += gguf_get_tensor_size(ctx, i);
+    }
+    info.tensorTypes = bytesPerType.keys();
+    size_t largest = 0;
+    for (auto it = bytesPerType.begin(); it != bytesPerType.end(); ++it) {
+        if (it.value() > largest) {
+            largest = it.value();
+            info.type = it.key();
+        }
+    }
+    gguf_free(ctx);
+
+    if (info.resolution == 0) {
+        // MI-GAN models encode the resolution in the name, eg. "MIGAN-512-places2-F16.gguf"
+        QRegularExpressionMatch match = QRegularExpression("MIGAN-(\\d+)-").match(info.name);
+        if (match.hasMatch()) {
+            info.resolution = match.captured(1).toInt();
+        }
+    }
+    return true;
+}
+
+QJsonObject toJson(VisionMLModelInfo const &info)
+{
+    return QJsonObject{
+        {"name", info.name},
+        {"task", int(info.task)},
+        {"size", info.size},
+        {"modified", info.modified},
+        {"arch", info.arch},
+        {"type", info.type},
+        {"tensor_types", QJsonArray::fromStringList(info.tensorTypes)},
+        {"resolution", info.resolution},
+    };
+}
+
+VisionMLModelInfo fromJson(QJsonObject const &obj)
+{
+    VisionMLModelInfo info;
+    info.name = obj["name"].toString();
+    info.task = VisionMLTask(obj["task"].toInt());
+    info.size = qint64(obj["size"].toDouble());
+    info.modified = qint64(obj["modified"].toDouble());
+    info.arch = obj["arch"].toString();
+    info.type = obj["type"].toString();
+    for (QJsonValue const &type : obj["tensor_types"].toArray()) {
+        info.tensorTypes.append(type.toString());
+    }
+    info.resolution = obj["resolution"].toInt();
+    return info;
+}
+
+} // namespace
+
+//
+// VisionMLModelInfo
+
+QString VisionMLModelInfo::displayName() const
+{
+    return QFileInfo(name).completeBaseName();
+}
+
+QString VisionMLModelInfo::description() const
+{
+    QString result = QString("%1\n%2: %3").arg(name, i18n("Size"), QLocale().formattedDataSize(size));
+    if (!arch.isEmpty()) {
+        result += QString("\n%1: %2").arg(i18n("Architecture"), arch);
+    }
+    if (!type.isEmpty()) {
+        result += QString("\n%1: %2").arg(i18n("Weights"), tensorTypes.join(", "));
+    }
+    if (resolution > 0) {
+        result += QString("\n%1: %2").arg(i18n("Resolution")).arg(resolution);
+    }
+    if (latency > 0) {
+        result += QString("\n%1: %2 ms").arg(i18n("Measured latency")).arg(latency, 0, 'f', 0);
+    }
+    return result;
+}
+
+//
+// VisionMLModelRegistry
+
+VisionMLModelRegistry::VisionMLModelRegistry(QString modelsDirectory, QObject *parent)
+    : QObject(parent)
+    , m_modelsDirectory(std::move(modelsDirectory))
+    , m_indexFile(QDir(m_modelsDirectory).filePath("index.json"))
+    , m_watcher(new QFileSystemWatcher(this))
+{
+    connect(m_watcher, &QFileSystemWatcher::directoryChanged, this, &VisionMLModelRegistry::directoryChanged);
+}
+
+QString VisionMLModelRegistry::taskDirectory(VisionMLTask task)
+{
+    switch (task) {
+    case VisionMLTask::segmentation:
+        return "sam";
+    case VisionMLTask::background_removal:
+        return "birefnet";
+    case VisionMLTask::inpainting:
+        return "migan";
+    default:
+        return QString();
+    }
+}
+
+QVector<VisionMLModelInfo> VisionMLModelRegistry::models(VisionMLTask task)
+{
+    ensureScanned(task);
+    QVector<VisionMLModelInfo> result;
+    for (VisionMLModelInfo const &info : qAsConst(m_models)) {
+        if (info.task == task) {
+            result.append(info);
+        }
+    }
+    std::sort(result.begin(), result.end(), [](auto const &a, auto const &b) { return a.name < b.name; });
+    return result;
+}
+
+bool VisionMLModelRegistry::contains(QString const &name)
+{
+    return !info(name).name.isEmpty();
+}
+
+VisionMLModelInfo VisionMLModelRegistry::info(QString const &name)
+{
+    for (int i = 0; i < (int)VisionMLTask::_count; ++i) {
+        if (name.startsWith(taskDirectory(VisionMLTask(i)) + "/")) {
+            ensureScanned(VisionMLTask(i));
+            break;
+        }
+    }
+    return m_models.value(name);
+}
+
+QVector<VisionMLModelInfo> VisionMLModelRegistry::variants(QString const &name)
+{
+    std::string const base = VisionMLModelVariants::baseName(name.toStdString());
+    QVector<VisionMLModelInfo> result;
+    VisionMLModelInfo model = info(name);
+    if (model.name.isEmpty()) {
+        return result;
+    }
+    for (VisionMLModelInfo const &candidate : models(model.task)) {
+        if (VisionMLModelVariants::baseName(candidate.name.toStdString()) == base) {
+            result.append(candidate);
+        }
+    }
+    return result;
+}
+
+QString VisionMLModelRegistry::selectVariant(QString const &name, Budget const &budget)
+{
+    QVector<VisionMLModelInfo> candidates = variants(name);
+    if (candidates.size() < 2) {
+        return name;
+    }
+    if (budget.latency > 0) {
+        loadMeasurements();
+        candidates = variants(name);
+    }
+    auto rank = [](VisionMLModelInfo const &info) {
+        return VisionMLModelVariants::precisionRank(VisionMLModelVariants::weightType(info.name.toStdString()));
+    };
+    std::sort(candidates.begin(), candidates.end(), [&](auto const &a, auto const &b) {
+        return rank(a) != rank(b) ? rank(a) > rank(b) : a.size < b.size;
+    });
+
+    auto fits = [&](VisionMLModelInfo const &info) {
+        bool memoryFits = budget.memory <= 0 || info.size <= budget.memory;
+        bool latencyFits = budget.latency <= 0 || (info.latency > 0 && info.latency <= budget.latency);
+        return memoryFits && latencyFits;
+    };
+    for (VisionMLModelInfo const &candidate : candidates) {
+        if (fits(candidate)) {
+            return candidate.name;
+        }
+    }
+
+    auto cost = [&](VisionMLModelInfo const &info) {
+        if (budget.latency > 0 && info.latency > 0) {
+            return info.latency;
+        }
+        return double(info.size);
+    };
+    auto cheapest = std::min_element(candidates.begin(), candidates.end(), [&](auto const &a, auto const &b) {
+        return cost(a) < cost(b);
+    });
+    return cheapest->name;
+}
+
+// Latency is measured per machine by the comparison harness, it is not part of the GGUF header. Results for all
+// variants of a model are stored next to them, eg. "sam/MobileSAM.variants.json".
+void VisionMLModelRegistry::loadMeasurements()
+{
+    QHash<QString, QJsonObject> files;
+    for (auto it = m_models.begin(); it != m_models.end(); ++it) {
+        QString base = QString::fromStdString(VisionMLModelVariants::baseName(it.key().toStdString()));
+        if (!files.contains(base)) {
+            QFile file(QDir(m_modelsDirectory).filePath(base + ".variants.json"));
+            QJsonObject models;
+            if (file.open(QIODevice::ReadOnly)) {
+                models = QJsonDocument::fromJson(file.readAll()).object()["models"].toObject();
+            }
+            files.insert(base, models);
+        }
+        it->latency = files[base][it.key()].toObject()["latency_ms"].toDouble();
+    }
+}
+
+void VisionMLModelRegistry::directoryChanged(QString const &path)
+{
+    for (int i = 0; i < (int)VisionMLTask::_count; ++i) {
+        VisionMLTask task = VisionMLTask(i);
+        if (QDir(m_modelsDirectory).filePath(taskDirectory(task)) == QDir::cleanPath(path) && scan(task)) {
+            saveIndex();
+            Q_EMIT modelsChanged(task);
+        }
+    }
+}
+
+void VisionMLModelRegistry::ensureScanned(VisionMLTask task)
+{
+    if (m_scanned[(int)task]) {
+        return;
+    }
+    m_scanned[(int)task] = true;
+    loadIndex();
+    QString dir = QDir(m_modelsDirectory).filePath(taskDirectory(task));
+    if (QDir(dir).exists()) {
+        m_watcher->addPath(dir);
+    }
+    if (scan(task)) {
+        saveIndex();
+    }
+}
+
+// Compares directory contents with the index, only reads headers of new or modified files.
+bool VisionMLModelRegistry::scan(VisionMLTask task)
+{
+    QElapsedTimer timer;
+    timer.start();
+    QString const prefix = taskDirectory(task) + "/";
+    QDir dir(QDir(m_modelsDirectory).filePath(taskDirectory(task)));
+    QFileInfoList files = dir.entryInfoList({"*.gguf"}, QDir::Files);
+
+    bool changed = false;
+    QSet<QString> present;
+    int headersRead = 0;
+    for (QFileInfo const &file : files) {
+        QString name = prefix + file.fileName();
+        present.insert(name);
+        qint64 modified = file.lastModified().toMSecsSinceEpoch();
+        auto it = m_models.find(name);
+        if (it != m_models.end() && it->size == file.size() && it->modified == modified) {
+            continue;
+        }
+        VisionMLModelInfo info;
+        info.name = name;
+        info.task = task;
+        info.size = file.size();
+        info.modified = modified;
+        if (!readHeader(file.filePath(), info)) {
+            qWarning() << "[VisionML] Failed to read GGUF header of" << file.filePath();
+        }
+        ++headersRead;
+        m_models.insert(name, info);
+        changed = true;
+    }
+    for (auto it = m_models.begin(); it != m_models.end();) {
+        if (it->task == task && !present.contains(it.key())) {
+            it = m_models.erase(it);
+            changed = true;
+        } else {
+            ++it;
+        }
+    }
+    qDebug() << "[VisionML] Scanned" << prefix << "in" << timer.elapsed() << "ms," << files.size() << "models,"
+             << headersRead << "headers read";
+    return changed;
+}
+
+void VisionMLModelRegistry::loadIndex()
+{
+    if (m_indexLoaded) {
+        return;
+    }
+    m_indexLoaded = true;
+    QFile file(m_indexFile);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return;
+    }
+    QJsonObject root = QJsonDocument::fromJson(file.readAll()).object();
+    if (root["version"].toInt() != indexVersion) {
+        return;
+    }
+    for (QJsonValue const &value : root["models"].toArray()) {
+        VisionMLModelInfo info = fromJson(value.toObject());
+        if (!info.name.isEmpty() && int(info.task) >= 0 && info.task < VisionMLTask::_count) {
+            m_models.insert(info.name, info);
+        }
+    }
+}
+
+void VisionMLModelRegistry::saveIndex() const
+{
+    QJsonArray models;
+    for (VisionMLModelInfo const &info : m_models) {
+        models.append(toJson(info));
+    }
+    QJsonObject root{{"version", indexVersion}, {"models", models}};
+    QSaveFile file(m_indexFile);
+    if (!file.open(QIODevice::WriteOnly) || file.write(QJsonDocument(root).toJson()) < 0 || !file.commit()) {
+        qWarning() << "[VisionML] Failed to write model index" << m_indexFile;
+    }
+}
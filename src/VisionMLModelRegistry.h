@@ -0,0 +1,82 @@
+#ifndef VISION_ML_MODEL_REGISTRY_H_
+#define VISION_ML_MODEL_REGISTRY_H_
+
+#include "VisionMLPipeline.h"
+
+#include <QFileSystemWatcher>
+#include <QHash>
+#include <QObject>
+#include <QString>
+#include <QStringList>
+#include <QVector>
+
+#include <array>
+
+// Metadata of an installed model, read from the GGUF header.
+struct VisionMLModelInfo {
+    QString name; // relative to the models directory, eg. "sam/MobileSAM-F16.gguf"
+    VisionMLTask task = VisionMLTask::segmentation;
+    qint64 size = 0;
+    qint64 modified = 0; // msecs since epoch
+    QString arch;        // general.architecture
+    QString type;        // tensor type which holds most of the weights, eg. "f16" or "q8_0"
+    QStringList tensorTypes;
+    int resolution = 0; // native input resolution, 0 if unknown
+    double latency = 0; // ms per image as measured by `visionml-batch --compare`, 0 if unknown
+
+    QString displayName() const;
+    QString description() const;
+};
+
+// Index of installed models for all tasks. Directories are scanned on first access and watched for changes. Only
+// GGUF headers are read, and results are cached in an index file next to the models, so that files which didn't
+// change since the last session are not opened at all.
+class VisionMLModelRegistry : public QObject
+{
+    Q_OBJECT
+public:
+    explicit VisionMLModelRegistry(QString modelsDirectory, QObject *parent = nullptr);
+
+    // Sub-directory which contains models for the task, eg. "sam".
+    static QString taskDirectory(VisionMLTask task);
+
+    QVector<VisionMLModelInfo> models(VisionMLTask task);
+    bool contains(QString const &name);
+    VisionMLModelInfo info(QString const &name); // empty name if not found
+
+    // Installed variants of a model which differ only in weight type (eg. F16, Q8_0), including the model itself.
+    QVector<VisionMLModelInfo> variants(QString const &name);
+
+    // Limits for automatic variant selection, zero means no limit.
+    struct Budget {
+        qint64 memory = 0; // bytes
+        double latency = 0; // ms
+    };
+
+    // Picks the most precise variant of a model which fits the budget. Memory is compared with file size, latency
+    // with measurements from `visionml-batch --compare`. If no variant fits, the smallest (memory) or fastest
+    // (latency) one is returned.
+    QString selectVariant(QString const &name, Budget const &budget);
+
+Q_SIGNALS:
+    void modelsChanged(VisionMLTask task);
+
+private Q_SLOTS:
+    void directoryChanged(QString const &path);
+
+private:
+    void ensureScanned(VisionMLTask task);
+    bool scan(VisionMLTask task); // returns true if anything changed
+    void loadIndex();
+    void saveIndex() const;
+    void loadMeasurements();
+
+    QString m_modelsDirectory;
+    QString m_indexFile;
+    QFileSystemWatcher *m_watcher;
+    QHash<QString, VisionMLModelInfo> m_models; // by name
+    std::array<bool, (int)VisionMLTask::_count> m_scanned{};
+    bool m_indexLoaded = false;
+};
+
+#endif // VISION_ML_MODEL_REGISTRY_H_
@@ -0,0 +1,67 @@
+#include "VisionMLModelVariants.h"
+
+#include <algorithm>
+#include <cctype>
+#include <regex>
+
+namespace VisionMLModelVariants
+{
+
+namespace
+{
+
+bool splitName(std::string const &name, std::string &base, std::string &type)
+{
+    static std::regex const pattern("^(.*)-(F32|F16|BF16|I?Q\\d[0-9A-Z_]*)\\.gguf$", std::regex::icase);
+    std::smatch match;
+    if (!std::regex_match(name, match, pattern)) {
+        return false;
+    }
+    base = match.str(1);
+    type = match.str(2);
+    std::transform(type.begin(), type.end(), type.begin(), [](unsigned char c) { return std::tolower(c); });
+    return true;
+}
+
+} // namespace
+
+std::string baseName(std::string const &name)
+{
+    std::string base, type;
+    if (splitName(name, base, type)) {
+        return base;
+    }
+    return name.size() > 5 && name.ends_with(".gguf") ? name.substr(0, name.size() - 5) : name;
+}
+
+std::string weightType(std::string const &name)
+{
+    std::string base, type;
+    splitName(name, base, type);
+    return type;
+}
+
+int precisionRank(std::string const &type)
+{
+    if (type == "f32") {
+        return 100;
+    }
+    if (type == "f16" || type == "bf16") {
+        return 90;
+    }
+    // q8_0 > q6_k > q5_1 > q5_0 > q4_k_m > ... , i-quants slightly below regular quants of the same bit count.
+    bool iquant = type.starts_with("iq");
+    size_t digit = iquant ? 2 : 1;
+    if ((type.starts_with("q") || iquant) && digit < type.size() && std::isdigit((unsigned char)type[digit])) {
+        int rank = (type[digit] - '0') * 10 - (iquant ? 5 : 0);
+        if (type.find("_1") != std::string::npos || type.ends_with("_l")) {
+            rank += 2;
+        } else if (type.ends_with("_m")) {
+            rank += 1;
+        }
+        return rank;
+    }
+    return 0;
+}
+
+} // namespace VisionMLModelVariants
@@ -0,0 +1,22 @@
+#ifndef VISION_ML_MODEL_VARIANTS_H_
+#define VISION_ML_MODEL_VARIANTS_H_
+
+#include <string>
+
+// Models may be installed in several variants which differ only in weight type, encoded as the last part of the file
+// name, eg. "sam/MobileSAM-F16.gguf" and "sam/MobileSAM-Q8_0.gguf".
+namespace VisionMLModelVariants
+{
+
+// Name without weight type and extension, eg. "sam/MobileSAM". Same as the name without extension if it has no type.
+std::string baseName(std::string const &name);
+
+// Lower-case weight type, eg. "f16" or "q4_k_m". Empty if the name doesn't have one.
+std::string weightType(std::string const &name);
+
+// Orders weight types by precision, higher is more precise. Unknown types rank lowest.
+int precisionRank(std::string const &weightType);
+
+} // namespace VisionMLModelVariants
+
+#endif // VISION_ML_MODEL_VARIANTS_H_
@@ -0,0 +1,450 @@
+#include "VisionMLPipeline.h"
+#include "VisionMLGraphProfiler.h"
+#include "VisionMLImageOps.h"
+#include "VisionMLTimings.h"
+
+#include <ggml-alloc.h>
+#include <ggml-backend.h>
+#include <ggml.h>
+#include <gguf.h>
+
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <filesystem>
+#include <regex>
+#include <stdexcept>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace
+{
+
+// MI-GAN model files encode their native resolution in the name, eg. "migan/MIGAN-512-places2-F16.gguf".
+bool matchMiganName(std::string const &name, std::smatch &match)
+{
+    static std::regex const pattern("^(.*MIGAN-)(\\d+)(-[^/]*)$");
+    return std::regex_match(name, match, pattern);
+}
+
+// Resolution part of a MI-GAN name, 0 if it is not a valid number.
+int parseResolution(std::string const &digits)
+{
+    int value = 0;
+    auto [end, ec] = std::from_chars(digits.data(), digits.data() + digits.size(), value);
+    return ec == std::errc() && end == digits.data() + digits.size() && value > 0 ? value : 0;
+}
+
+std::string miganVariantName(std::string const &name, int resolution)
+{
+    std::smatch match;
+    if (!matchMiganName(name, match)) {
+        return name;
+    }
+    return match.str(1) + std::to_string(resolution) + match.str(3);
+}
+
+int const defaultInpaintResolution = 512;
+
+// Number of background removal masks kept for reuse. Covers filter preview + apply and precise mode selections.
+size_t const maskCacheSize = 2;
+
+visp::image_data copyImage(visp::image_data const &image)
+{
+    visp::image_data result = visp::image_alloc(image.extent, image.format);
+    memcpy(result.data.get(), image.data.get(), size_t(image.extent[0]) * image.extent[1] * n_bytes(image.format));
+    return result;
+}
+
+// Functions of the CPU backend are resolved at runtime, it is loaded dynamically. Returns null for other backends.
+template<typename F>
+F cpuBackendProc(ggml_backend_t backend, char const *name)
+{
+    ggml_backend_reg_t reg = ggml_backend_dev_backend_reg(ggml_backend_get_device(backend));
+    return reinterpret_cast<F>(ggml_backend_reg_get_proc_address(reg, name));
+}
+
+using ThreadpoolNew = ggml_threadpool *(*)(ggml_threadpool_params *);
+using ThreadpoolFree = void (*)(ggml_threadpool *);
+using SetThreadpool = void (*)(ggml_backend_t, ggml_threadpool *);
+
+bool unloadFromGPU(visp::compute_graph &graph, visp::backend_type devType)
+{
+    if (devType == visp::backend_type::gpu) {
+        graph = {};
+        return true;
+    }
+    return false;
+}
+
+// Size of the buffers which the graph's allocator reserved for its tensors.
+uint64_t graphBytes(visp::compute_graph const &graph)
+{
+    return graph.allocr ? ggml_gallocr_get_buffer_size(graph.allocr.get(), 0) : 0;
+}
+
+} // namespace
+
+char const *toString(VisionMLTask task)
+{
+    switch (task) {
+    case VisionMLTask::segmentation:
+        return "segmentation";
+    case VisionMLTask::inpainting:
+        return "inpainting";
+    case VisionMLTask::background_removal:
+        return "background_removal";
+    default:
+        return "unknown";
+    }
+}
+
+VisionMLPipeline::VisionMLPipeline(visp::backend_type backendType, std::string modelsDirectory)
+    : m_backendType(backendType)
+    , m_backend(visp::backend_init(backendType))
+    , m_modelsDirectory(std::move(modelsDirectory))
+{
+}
+
+VisionMLPipeline::~VisionMLPipeline()
+{
+    unloadModels();
+    if (m_threadpool) {
+        ggml_backend_t backend = m_backend;
+        cpuBackendProc<SetThreadpool>(backend, "ggml_backend_cpu_set_threadpool")(backend, nullptr);
+        cpuBackendProc<ThreadpoolFree>(backend, "ggml_threadpool_free")(m_threadpool);
+    }
+}
+
+visp::backend_type VisionMLPipeline::backendType() const
+{
+    return m_backendType;
+}
+
+visp::backend_device const &VisionMLPipeline::backend() const
+{
+    return m_backend;
+}
+
+std::string const &VisionMLPipeline::modelsDirectory() const
+{
+    return m_modelsDirectory;
+}
+
+std::string const &VisionMLPipeline::modelName(VisionMLTask task) const
+{
+    return m_modelName[(int)task];
+}
+
+void VisionMLPipeline::setModelName(VisionMLTask task, std::string name)
+{
+    if (m_modelName[(int)task] == name) {
+        return;
+    }
+    m_modelName[(int)task] = std::move(name);
+    unloadModels();
+}
+
+std::string VisionMLPipeline::modelPath(VisionMLTask task) const
+{
+    fs::path path = fs::path(m_modelsDirectory) / modelName(task);
+    if (!fs::exists(path)) {
+        throw std::runtime_error("Model file not found: " + path.string());
+    }
+    return path.string();
+}
+
+void VisionMLPipeline::setThreadCount(VisionMLTask task, int threads)
+{
+    m_threadCount[(int)task] = threads;
+}
+
+void VisionMLPipeline::setThreadPinning(bool enabled)
+{
+    if (m_pinThreads != enabled) {
+        m_pinThreads = enabled;
+        m_appliedThreadCount = 0;
+    }
+}
+
+void VisionMLPipeline::applyThreadCount(VisionMLTask task)
+{
+    int threads = m_threadCount[(int)task] > 0 ? m_threadCount[(int)task] : VisionMLImageOps::physicalCoreCount();
+    if (threads == m_appliedThreadCount) {
+        return;
+    }
+    ggml_backend_t backend = m_backend;
+    auto setThreads = cpuBackendProc<ggml_backend_set_n_threads_t>(backend, "ggml_backend_set_n_threads");
+    if (!setThreads) {
+        return; // not a CPU backend
+    }
+    auto newPool = cpuBackendProc<ThreadpoolNew>(backend, "ggml_threadpool_new");
+    auto freePool = cpuBackendProc<ThreadpoolFree>(backend, "ggml_threadpool_free");
+    auto setPool = cpuBackendProc<SetThreadpool>(backend, "ggml_backend_cpu_set_threadpool");
+    if (newPool && freePool && setPool && (m_pinThreads || m_threadpool)) {
+        ggml_threadpool *pool = nullptr;
+        if (m_pinThreads) {
+            ggml_threadpool_params params = ggml_threadpool_params_default(threads);
+            for (int i = 0; i < threads && i < GGML_MAX_N_THREADS; ++i) {
+                params.cpumask[i] = true;
+            }
+            params.strict_cpu = true;
+            pool = newPool(&params);
+        }
+        setPool(backend, pool);
+        if (m_threadpool) {
+            freePool(m_threadpool);
+        }
+        m_threadpool = pool;
+    }
+    setThreads(backend, threads);
+    m_appliedThreadCount = threads;
+}
+
+void VisionMLPipeline::encodeSegmentationImage(visp::image_view const &image)
+{
+    if (!m_sam.weights) {
+        unloadModels();
+        VisionMLScopedTimer timer(m_timings, "segmentation.load_model");
+        m_sam = visp::sam_load_model(modelPath(VisionMLTask::segmentation).c_str(), m_backend);
+        m_loadedModelName[(int)VisionMLTask::segmentation] = modelName(VisionMLTask::segmentation);
+    }
+    applyThreadCount(VisionMLTask::segmentation);
+    VisionMLScopedTimer timer(m_timings, "segmentation.sam_encode");
+    VisionMLGraphProfiler::Invocation profile(m_profiler.get(), profileLabel("sam_encode", VisionMLTask::segmentation),
+                                              m_backend, m_sam.encoder.graph);
+    visp::sam_encode(m_sam, image);
+}
+
+bool VisionMLPipeline::hasSegmentationImage() const
+{
+    return m_sam.input_image != nullptr;
+}
+
+visp::image_data VisionMLPipeline::predictSegmentationMask(visp::i32x2 point)
+{
+    applyThreadCount(VisionMLTask::segmentation);
+    VisionMLScopedTimer timer(m_timings, "segmentation.sam_compute");
+    VisionMLGraphProfiler::Invocation profile(m_profiler.get(), profileLabel("sam_compute", VisionMLTask::segmentation),
+                                              m_backend, m_sam.decoder.graph);
+    return visp::sam_compute(m_sam, point);
+}
+
+visp::image_data VisionMLPipeline::predictSegmentationMask(visp::box_2d box)
+{
+    applyThreadCount(VisionMLTask::segmentation);
+    VisionMLScopedTimer timer(m_timings, "segmentation.sam_compute");
+    VisionMLGraphProfiler::Invocation profile(m_profiler.get(), profileLabel("sam_compute", VisionMLTask::segmentation),
+                                              m_backend, m_sam.decoder.graph);
+    return visp::sam_compute(m_sam, box);
+}
+
+visp::image_data VisionMLPipeline::removeBackground(visp::image_view const &image)
+{
+    uint64_t hash = VisionMLImageOps::hashImage(image);
+    std::string const &model = modelName(VisionMLTask::background_removal);
+    for (auto it = m_maskCache.begin(); it != m_maskCache.end(); ++it) {
+        if (it->imageHash == hash && it->extent[0] == image.extent[0] && it->extent[1] == image.extent[1]
+            && it->modelName == model) {
+            CachedMask entry = *it;
+            m_maskCache.erase(it);
+            m_maskCache.push_front(entry);
+            return copyImage(*entry.mask);
+        }
+    }
+
+    if (!m_birefnet.weights) {
+        VisionMLScopedTimer timer(m_timings, "background_removal.load_model");
+        m_birefnet = visp::birefnet_load_model(modelPath(VisionMLTask::background_removal).c_str(), m_backend);
+        m_loadedModelName[(int)VisionMLTask::background_removal] = model;
+    }
+    applyThreadCount(VisionMLTask::background_removal);
+    visp::image_data result;
+    {
+        VisionMLScopedTimer timer(m_timings, "background_removal.birefnet_compute");
+        VisionMLGraphProfiler::Invocation profile(m_profiler.get(),
+                                                  profileLabel("birefnet_compute", VisionMLTask::background_removal),
+                                                  m_backend, m_birefnet.graph.graph);
+        result = visp::birefnet_compute(m_birefnet, image);
+    }
+    unloadFromGPU(m_birefnet.graph, m_backendType);
+
+    m_maskCache.push_front({hash, image.extent, model, std::make_shared<visp::image_data>(copyImage(result))});
+    if (m_maskCache.size() > maskCacheSize) {
+        m_maskCache.pop_back();
+    }
+    return result;
+}
+
+int VisionMLPipeline::inpaintResolution(int width, int height) const
+{
+    std::smatch match;
+    std::string const &current = modelName(VisionMLTask::inpainting);
+    if (!matchMiganName(current, match)) {
+        return defaultInpaintResolution;
+    }
+    std::string const suffix = match.str(3);
+
+    // Directory contents are cached, and only listed again after files were added, removed or renamed.
+    std::error_code ec;
+    fs::path dir = (fs::path(m_modelsDirectory) / current).parent_path();
+    fs::file_time_type modified = fs::last_write_time(dir, ec);
+    InpaintVariants &variants = m_inpaintVariants[dir.string()];
+    if (ec || variants.modified != modified) {
+        variants = {modified, {}};
+        for (fs::directory_entry const &entry : fs::directory_iterator(dir, ec)) {
+            std::smatch variant;
+            std::string file = entry.path().filename().string();
+            if (entry.is_regular_file(ec) && matchMiganName(file, variant)) {
+                if (int resolution = parseResolution(variant.str(2))) {
+                    variants.entries.emplace_back(variant.str(3), resolution);
+                }
+            }
+        }
+    }
+    std::vector<int> available;
+    for (auto const &[variantSuffix, resolution] : variants.entries) {
+        if (variantSuffix == suffix) {
+            available.push_back(resolution);
+        }
+    }
+    if (available.empty()) {
+        int resolution = parseResolution(match.str(2));
+        return resolution > 0 ? resolution : defaultInpaintResolution;
+    }
+    std::sort(available.begin(), available.end());
+
+    // Smallest model which covers the region without downscaling, otherwise the largest one.
+    int size = std::max(width, height);
+    auto it = std::lower_bound(available.begin(), available.end(), size);
+    return it != available.end() ? *it : available.back();
+}
+
+visp::image_data VisionMLPipeline::inpaint(visp::image_view const &image, visp::image_view const &mask, int resolution)
+{
+    std::string const &name = modelName(VisionMLTask::inpainting);
+    if (m_migan.empty()) {
+        m_loadedModelName[(int)VisionMLTask::inpainting] = name;
+    }
+    visp::migan_model &model = m_migan[resolution];
+    if (!model.weights) {
+        fs::path path = fs::path(m_modelsDirectory) / miganVariantName(name, resolution);
+        if (!fs::exists(path)) {
+            throw std::runtime_error("Model file not found: " + path.string());
+        }
+        VisionMLScopedTimer timer(m_timings, "inpainting.load_model");
+        model = visp::migan_load_model(path.string().c_str(), m_backend);
+    }
+    applyThreadCount(VisionMLTask::inpainting);
+    VisionMLScopedTimer timer(m_timings, "inpainting.migan_compute");
+    VisionMLGraphProfiler::Invocation profile(m_profiler.get(), profileLabel("migan_compute", VisionMLTask::inpainting),
+                                              m_backend, model.graph.graph);
+    return visp::migan_compute(model, image, mask);
+}
+
+void VisionMLPipeline::unload(VisionMLTask task)
+{
+    switch (task) {
+    case VisionMLTask::segmentation:
+        m_sam = {};
+        break;
+    case VisionMLTask::inpainting:
+        m_migan.clear();
+        break;
+    case VisionMLTask::background_removal:
+        m_birefnet = {};
+        break;
+    default:
+        break;
+    }
+}
+
+void VisionMLPipeline::unloadModels()
+{
+    m_sam = {};
+    m_birefnet = {};
+    m_migan.clear();
+}
+
+void VisionMLPipeline::releaseMemory(VisionMLTask task)
+{
+    unload(task);
+    if (task == VisionMLTask::background_removal) {
+        m_maskCache.clear();
+    }
+}
+
+VisionMLPipeline::MemoryUsage VisionMLPipeline::memoryUsage(VisionMLTask task) const
+{
+    MemoryUsage usage;
+    std::string const &loaded = m_loadedModelName[(int)task];
+    switch (task) {
+    case VisionMLTask::segmentation:
+        usage.weights = m_sam.weights ? weightBytes(loaded) : 0;
+        usage.compute = graphBytes(m_sam.encoder) + graphBytes(m_sam.decoder);
+        break;
+    case VisionMLTask::inpainting:
+        for (auto const &[resolution, model] : m_migan) {
+            usage.weights += model.weights ? weightBytes(miganVariantName(loaded, resolution)) : 0;
+            usage.compute += graphBytes(model.graph);
+        }
+        break;
+    case VisionMLTask::background_removal:
+        usage.weights = m_birefnet.weights ? weightBytes(loaded) : 0;
+        usage.compute = graphBytes(m_birefnet.graph);
+        for (CachedMask const &entry : m_maskCache) {
+            usage.cache += uint64_t(entry.extent[0]) * entry.extent[1] * n_bytes(entry.mask->format);
+        }
+        break;
+    default:
+        break;
+    }
+    return usage;
+}
+
+// Tensor data size from the GGUF header, the file is not read completely.
+uint64_t VisionMLPipeline::weightBytes(std::string const &name) const
+{
+    auto it = m_weightBytes.find(name);
+    if (it != m_weightBytes.end()) {
+        return it->second;
+    }
+    uint64_t bytes = 0;
+    std::string path = (fs::path(m_modelsDirectory) / name).string();
+    gguf_init_params params{/*no_alloc*/ true, /*ctx*/ nullptr};
+    if (gguf_context *ctx = gguf_init_from_file(path.c_str(), params)) {
+        for (int64_t i = 0; i < gguf_get_n_tensors(ctx); ++i) {
+            bytes += gguf_get_tensor_size(ctx, i);
+        }
+        gguf_free(ctx);
+    }
+    m_weightBytes[name] = bytes;
+    return bytes;
+}
+
+void VisionMLPipeline::setTimings(VisionMLTimings *timings)
+{
+    m_timings = timings;
+}
+
+void VisionMLPipeline::setGraphProfile(std::string const &file)
+{
+    m_profiler.reset();
+    if (!file.empty()) {
+        m_profiler = std::make_unique<VisionMLGraphProfiler>(file);
+    }
+}
+
+// Eg. "sam_encode sam/MobileSAM-F16.gguf, cpu backend, 8 threads". Only built when profiling is enabled.
+std::string VisionMLPipeline::profileLabel(char const *op, VisionMLTask task) const
+{
+    if (!m_profiler) {
+        return {};
+    }
+    std::string label = std::string(op) + " " + modelName(task);
+    if (m_backendType == visp::backend_type::cpu) {
+        return label + ", cpu backend, " + std::to_string(m_appliedThreadCount) + " threads";
+    }
+    return label + ", gpu backend";
+}
@@ -0,0 +1,130 @@
+#ifndef VISION_ML_PIPELINE_H_
+#define VISION_ML_PIPELINE_H_
+
+#include <ggml-backend.h>
+#include <visp/vision.h>
+
+struct ggml_threadpool;
+class VisionMLGraphProfiler;
+class VisionMLTimings;
+
+#include <array>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+enum class VisionMLTask {
+    segmentation = 0,
+    inpainting,
+    background_removal,
+    _count
+};
+
+char const *toString(VisionMLTask task);
+
+// Backend, models and inference for all tasks. Has no dependencies on Krita or Qt, so that it can also be used by
+// command line tools. Not thread-safe, callers must serialize access.
+class VisionMLPipeline
+{
+public:
+    // Initializes the backend, throws if it is not available. Model names are relative to modelsDirectory.
+    VisionMLPipeline(visp::backend_type backendType, std::string modelsDirectory);
+    ~VisionMLPipeline();
+
+    visp::backend_type backendType() const;
+    visp::backend_device const &backend() const;
+    std::string const &modelsDirectory() const;
+
+    std::string const &modelName(VisionMLTask task) const;
+    void setModelName(VisionMLTask task, std::string name);
+    std::string modelPath(VisionMLTask task) const; // throws if the file doesn't exist
+
+    // CPU threads used for inference of a task, 0 selects the number of physical cores. With pinning enabled,
+    // inference runs on a dedicated GGML threadpool bound to the first cores. No effect for GPU backends.
+    void setThreadCount(VisionMLTask task, int threads);
+    void setThreadPinning(bool enabled);
+
+    // Records how long loading models and running them takes, see VisionMLTimings. Stages are named
+    // "<task>.<stage>", eg. "segmentation.sam_encode". Null (the default) disables timing.
+    void setTimings(VisionMLTimings *timings);
+
+    // Appends the time and the GGML operators of every model invocation to the file, see VisionMLGraphProfiler.
+    // Waits for the backend after each invocation, then computes the graph again node by node to time the nodes, which
+    // makes inference much slower. An empty file name disables profiling.
+    void setGraphProfile(std::string const &file);
+
+    void encodeSegmentationImage(visp::image_view const &image);
+    bool hasSegmentationImage() const;
+    visp::image_data predictSegmentationMask(visp::i32x2 point);
+    visp::image_data predictSegmentationMask(visp::box_2d box);
+
+    // Returns the foreground mask for the image. Results of recent calls are cached by image content and model, so
+    // that eg. a filter preview followed by apply, or changing post-processing options, runs inference only once.
+    visp::image_data removeBackground(visp::image_view const &image);
+
+    // Picks the native resolution of an installed MI-GAN variant of the current model which best fits a region
+    // of the given size. Variants differ only in the resolution part of the name, eg. MIGAN-256-places2-F16.
+    int inpaintResolution(int width, int height) const;
+    visp::image_data inpaint(visp::image_view const &image, visp::image_view const &mask, int resolution);
+
+    void unload(VisionMLTask task);
+    void unloadModels();
+
+    // Memory held for a task, in bytes, as reported by the GGUF header and the graph allocators. Lives in VRAM for
+    // GPU backends, except for cached masks.
+    struct MemoryUsage {
+        uint64_t weights = 0; // tensors of the loaded model files
+        uint64_t compute = 0; // buffers of the graphs of the loaded models, including the SAM image embedding
+        uint64_t cache = 0;   // background removal masks
+    };
+    MemoryUsage memoryUsage(VisionMLTask task) const;
+
+    // Frees everything counted by memoryUsage for the task. The next inference loads the model again.
+    void releaseMemory(VisionMLTask task);
+
+private:
+    uint64_t weightBytes(std::string const &name) const;
+
+    void applyThreadCount(VisionMLTask task);
+    std::string profileLabel(char const *op, VisionMLTask task) const;
+
+    visp::backend_type m_backendType;
+    visp::backend_device m_backend;
+    std::string m_modelsDirectory;
+    std::array<std::string, (int)VisionMLTask::_count> m_modelName;
+    std::array<int, (int)VisionMLTask::_count> m_threadCount{};
+    bool m_pinThreads = false;
+    int m_appliedThreadCount = 0;
+    ggml_threadpool *m_threadpool = nullptr;
+
+    visp::sam_model m_sam;
+    visp::birefnet_model m_birefnet;
+    std::map<int, visp::migan_model> m_migan; // by native resolution
+    std::array<std::string, (int)VisionMLTask::_count> m_loadedModelName;
+
+    VisionMLTimings *m_timings = nullptr;
+    std::unique_ptr<VisionMLGraphProfiler> m_profiler;
+    mutable std::map<std::string, uint64_t> m_weightBytes; // by model name
+
+    struct CachedMask {
+        uint64_t imageHash = 0;
+        visp::i32x2 extent{};
+        std::string modelName;
+        std::shared_ptr<visp::image_data const> mask;
+    };
+    std::deque<CachedMask> m_maskCache; // most recent first
+
+    // MI-GAN variants found in a models directory: name suffix (eg. "-places2-F16.gguf") and native resolution.
+    struct InpaintVariants {
+        std::filesystem::file_time_type modified;
+        std::vector<std::pair<std::string, int>> entries;
+    };
+    mutable std::map<std::string, InpaintVariants> m_inpaintVariants; // by directory
+};
+
+#endif // VISION_ML_PIPELINE_H_
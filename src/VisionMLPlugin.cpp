@@ -1,5 +1,7 @@
 #include "VisionMLPlugin.h"
 #include "VisionML.h"
+#include "VisionMLImageOps.h"
+#include "filters/BackgroundRemovalBatch.h"
 #include "filters/BackgroundRemovalFilter.h"
 #include "inpaint/InpaintTool.h"
 #include "segmentation/SelectSegmentFromPointTool.h"
@@ -14,12 +16,132 @@
 #include <kis_types.h>
 #include <kpluginfactory.h>
 
+#include <cstring>
+#include <string>
+
 K_PLUGIN_FACTORY_WITH_JSON(VisionMLPluginFactory, "kritavisionml.json", registerPlugin<VisionMLPlugin>();)
 
+namespace
+{
+
+// Tools and filters own the shared models. Keep a weak reference for entry points called from Python.
+QWeakPointer<VisionModels> sharedModels;
+
+// Error message of the last failed vision_ml_* call on this thread.
+thread_local std::string lastError;
+
+// Pixel layouts accepted by the C API, values must match python/api.py.
+enum {
+    VISION_ML_FORMAT_RGBA = 0,
+    VISION_ML_FORMAT_BGRA = 1,
+};
+
+visp::image_format imageFormat(int format)
+{
+    switch (format) {
+    case VISION_ML_FORMAT_RGBA:
+        return visp::image_format::rgba_u8;
+    case VISION_ML_FORMAT_BGRA:
+        return visp::image_format::bgra_u8;
+    default:
+        throw std::runtime_error("Unsupported pixel format: " + std::to_string(format));
+    }
+}
+
+// Wraps caller-owned memory without copying.
+visp::image_view wrapImage(uint8_t const *data, int width, int height, int stride, visp::image_format format)
+{
+    if (!data || width <= 0 || height <= 0 || stride < width * n_bytes(format)) {
+        throw std::runtime_error("Invalid image buffer");
+    }
+    visp::image_view view({width, height}, format, data);
+    view.stride = stride;
+    return view;
+}
+
+// Writes a model result into a caller-owned buffer. Results are RGBA or alpha, BGRA swaps channels on the fly.
+void writeResult(visp::image_data const &result, uint8_t *dst, int width, int height, int stride, int format)
+{
+    if (!dst || result.extent[0] != width || result.extent[1] != height) {
+        throw std::runtime_error("Output buffer doesn't match result size " + std::to_string(result.extent[0]) + "x"
+                                 + std::to_string(result.extent[1]));
+    }
+    size_t const rowSize = size_t(width) * n_bytes(result.format);
+    if (size_t(stride) < rowSize) {
+        throw std::runtime_error("Output buffer stride is too small");
+    }
+    bool const swap = result.format == visp::image_format::rgba_u8 && format == VISION_ML_FORMAT_BGRA;
+    for (int y = 0; y < height; ++y) {
+        uint8_t const *src = result.data.get() + y * rowSize;
+        uint8_t *row = dst + size_t(y) * stride;
+        if (!swap) {
+            memcpy(row, src, rowSize);
+            continue;
+        }
+        for (int x = 0; x < width; ++x) {
+            row[4 * x + 0] = src[4 * x + 2];
+            row[4 * x + 1] = src[4 * x + 1];
+            row[4 * x + 2] = src[4 * x + 0];
+            row[4 * x + 3] = src[4 * x + 3];
+        }
+    }
+}
+
+// View of a region of an image, sharing its memory.
+visp::image_view cropView(visp::image_view const &view, QRect const &region)
+{
+    uint8_t const *data = (uint8_t const *)view.data + size_t(region.y()) * view.stride
+        + size_t(region.x()) * n_bytes(view.format);
+    visp::image_view crop({region.width(), region.height()}, view.format, data);
+    crop.stride = view.stride;
+    return crop;
+}
+
+// Composites an RGBA result with alpha over a region of a caller-owned buffer, like the inpaint tool composites
+// its result over the layer.
+void compositeResult(visp::image_data const &result, uint8_t *dst, int stride, QRect const &region, int format)
+{
+    bool const swap = format == VISION_ML_FORMAT_BGRA;
+    for (int y = 0; y < region.height(); ++y) {
+        uint8_t const *src = result.data.get() + size_t(y) * region.width() * 4;
+        uint8_t *row = dst + size_t(y + region.y()) * stride + size_t(region.x()) * 4;
+        for (int x = 0; x < region.width(); ++x) {
+            int const a = src[4 * x + 3];
+            for (int c = 0; c < 3; ++c) {
+                uint8_t &d = row[4 * x + (swap ? 2 - c : c)];
+                d = uint8_t((src[4 * x + c] * a + d * (255 - a) + 127) / 255);
+            }
+            row[4 * x + 3] = uint8_t(a + (row[4 * x + 3] * (255 - a) + 127) / 255);
+        }
+    }
+}
+
+// Runs a C API call against the shared models. Returns 0 on success, -1 on error (see vision_ml_last_error).
+template<typename F>
+int runGuarded(F &&f)
+{
+    QSharedPointer<VisionModels> shared = sharedModels.toStrongRef();
+    if (!shared) {
+        lastError = "VisionML plugin is not loaded";
+        return -1;
+    }
+    try {
+        f(*shared);
+        lastError.clear();
+        return 0;
+    } catch (std::exception const &e) {
+        lastError = e.what();
+        return -1;
+    }
+}
+
+} // namespace
+
 VisionMLPlugin::VisionMLPlugin(QObject *parent, const QVariantList &)
     : QObject(parent)
 {
     if (QSharedPointer<VisionModels> shared = VisionModels::create()) {
+        sharedModels = shared;
         auto addTool = [this](KoToolFactoryBase *toolFactory) {
             qDebug() << "[VisionMLPlugin] Registering tool factory:" << toolFactory->id();
             KoToolRegistry::instance()->add(toolFactory);
@@ -67,6 +189,105 @@ Q_DECL_EXPORT void load_vision_ml_plugin()
     plugin.injectTools();
 }
 
+// Removes the background of all selected paint layers, including every keyframe of animated layers.
+Q_DECL_EXPORT void vision_ml_remove_background_batch()
+{
+    if (QSharedPointer<VisionModels> shared = sharedModels.toStrongRef()) {
+        BackgroundRemovalBatch::runOnSelectedLayers(shared);
+    } else {
+        qWarning() << "[VisionMLPlugin] Background removal batch: plugin is not loaded.";
+    }
+}
+
+// C API for scripts. Input images are read directly from caller memory (eg. Python objects which support the buffer
+// protocol), results are written into caller-provided buffers. Images are 8-bit RGBA or BGRA with 4 channels, masks
+// are 8-bit alpha. Functions return 0 on success and -1 on failure. They block until inference is done.
+
+Q_DECL_EXPORT char const *vision_ml_last_error()
+{
+    return lastError.c_str();
+}
+
+Q_DECL_EXPORT int
+vision_ml_encode_segmentation_image(uint8_t const *pixels, int width, int height, int stride, int format)
+{
+    return runGuarded([&](VisionModels &models) {
+        models.encodeSegmentationImage(wrapImage(pixels, width, height, stride, imageFormat(format)));
+    });
+}
+
+// Mask size must match the image passed to the last vision_ml_encode_segmentation_image call.
+Q_DECL_EXPORT int vision_ml_predict_segmentation_point(int x, int y, uint8_t *mask, int width, int height, int stride)
+{
+    return runGuarded([&](VisionModels &models) {
+        if (!models.hasSegmentationImage()) {
+            throw std::runtime_error("No image was encoded for segmentation");
+        }
+        visp::image_data result = models.predictSegmentationMask(visp::i32x2{x, y});
+        writeResult(result, mask, width, height, stride, VISION_ML_FORMAT_RGBA);
+    });
+}
+
+Q_DECL_EXPORT int
+vision_ml_predict_segmentation_box(int x0, int y0, int x1, int y1, uint8_t *mask, int width, int height, int stride)
+{
+    return runGuarded([&](VisionModels &models) {
+        if (!models.hasSegmentationImage()) {
+            throw std::runtime_error("No image was encoded for segmentation");
+        }
+        visp::box_2d box{visp::i32x2{x0, y0}, visp::i32x2{x1, y1}};
+        writeResult(models.predictSegmentationMask(box), mask, width, height, stride, VISION_ML_FORMAT_RGBA);
+    });
+}
+
+Q_DECL_EXPORT int vision_ml_remove_background(uint8_t const *pixels,
+                                              int width,
+                                              int height,
+                                              int stride,
+                                              int format,
+                                              uint8_t *mask,
+                                              int maskStride)
+{
+    return runGuarded([&](VisionModels &models) {
+        visp::image_view image = wrapImage(pixels, width, height, stride, imageFormat(format));
+        visp::image_data result = models.removeBackground(image);
+        writeResult(result, mask, width, height, maskStride, VISION_ML_FORMAT_RGBA);
+    });
+}
+
+// Result has the same size and pixel format as the input image. Pixels away from the mask are copied from the input,
+// the masked region is filled the same way as by the inpaint tool.
+Q_DECL_EXPORT int vision_ml_inpaint(uint8_t const *pixels,
+                                    int width,
+                                    int height,
+                                    int stride,
+                                    int format,
+                                    uint8_t const *mask,
+                                    int maskStride,
+                                    uint8_t *result,
+                                    int resultStride)
+{
+    return runGuarded([&](VisionModels &models) {
+        visp::image_view image = wrapImage(pixels, width, height, stride, imageFormat(format));
+        visp::image_view maskView = wrapImage(mask, width, height, maskStride, visp::image_format::alpha_u8);
+        if (!result || resultStride < width * 4) {
+            throw std::runtime_error("Invalid result buffer");
+        }
+        for (int y = 0; y < height && result != pixels; ++y) {
+            memcpy(result + size_t(y) * resultStride, pixels + size_t(y) * stride, size_t(width) * 4);
+        }
+        VisionMLImageOps::MaskBounds const maskBounds = VisionMLImageOps::maskBounds(maskView);
+        if (maskBounds.empty()) {
+            return;
+        }
+        VisionModels::InpaintRegion region = models.inpaintRegion(
+            QRect(maskBounds.x, maskBounds.y, maskBounds.width, maskBounds.height), QRect(0, 0, width, height));
+        visp::image_data patch = models.inpaintBlended(
+            cropView(image, region.bounds), cropView(maskView, region.bounds), region.resolution);
+        compositeResult(patch, result, resultStride, region.bounds, format);
+    });
+}
+
 } // extern "C"
 
 #include "VisionMLPlugin.moc"
\ No newline at end of file
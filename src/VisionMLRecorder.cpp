@@ -0,0 +1,113 @@
+#include "VisionMLRecorder.h"
+#include "VisionMLImageOps.h"
+
+#include <QDateTime>
+#include <QDebug>
+#include <QJsonDocument>
+#include <QMutexLocker>
+
+namespace
+{
+
+char const *formatName(visp::image_format format)
+{
+    switch (format) {
+    case visp::image_format::rgba_u8:
+        return "rgba_u8";
+    case visp::image_format::bgra_u8:
+        return "bgra_u8";
+    case visp::image_format::argb_u8:
+        return "argb_u8";
+    case visp::image_format::alpha_u8:
+        return "alpha_u8";
+    default:
+        return "other";
+    }
+}
+
+} // namespace
+
+VisionMLRecorder::VisionMLRecorder(QString const &directory, bool snapshots)
+    : m_snapshots(snapshots)
+    , m_start(Clock::now())
+{
+    QString name = QDateTime::currentDateTime().toString("yyyyMMdd-hhmmss");
+    m_dir = QDir(directory);
+    if (!m_dir.mkpath(name) || !m_dir.cd(name)) {
+        qWarning() << "[VisionML] Failed to create session directory" << m_dir.filePath(name);
+        return;
+    }
+    m_file.setFileName(m_dir.filePath("events.jsonl"));
+    if (!m_file.open(QIODevice::WriteOnly | QIODevice::Append)) {
+        qWarning() << "[VisionML] Failed to open" << m_file.fileName() << m_file.errorString();
+        return;
+    }
+    qDebug() << "[VisionML] Recording session to" << m_dir.absolutePath();
+}
+
+QJsonObject VisionMLRecorder::describeImage(QImage const &data, visp::image_view const &view)
+{
+    quint64 hash = VisionMLImageOps::hashImage(view);
+    QString hex = QString::number(hash, 16).rightJustified(16, '0'); // JSON numbers can't hold 64 bit
+    QJsonObject result{
+        {"width", view.extent[0]},
+        {"height", view.extent[1]},
+        {"format", formatName(view.format)},
+        {"hash", hex},
+    };
+    if (!m_snapshots) {
+        return result;
+    }
+    QString file = hex + ".png";
+    result["snapshot"] = file;
+    {
+        QMutexLocker lock(&m_mutex);
+        if (m_written.contains(hash)) {
+            return result;
+        }
+        m_written.insert(hash);
+    }
+    QImage image = data;
+    if (image.format() == QImage::Format_Alpha8) {
+        image = QImage(data.constBits(), data.width(), data.height(), data.bytesPerLine(), QImage::Format_Grayscale8);
+    }
+    if (!image.save(m_dir.filePath(file))) {
+        qWarning() << "[VisionML] Failed to write snapshot" << m_dir.filePath(file);
+    }
+    return result;
+}
+
+void VisionMLRecorder::record(char const *type, QJsonObject event, Clock::time_point start, Clock::time_point end)
+{
+    event["type"] = type;
+    event["t_ms"] = milliseconds(m_start, start);
+    event["duration_ms"] = milliseconds(start, end);
+    append(event);
+}
+
+void VisionMLRecorder::record(char const *type, QJsonObject event)
+{
+    event["type"] = type;
+    event["t_ms"] = milliseconds(m_start, Clock::now());
+    append(event);
+}
+
+double VisionMLRecorder::milliseconds(Clock::time_point start, Clock::time_point end)
+{
+    return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+QString VisionMLRecorder::sessionDirectory() const
+{
+    return m_dir.absolutePath();
+}
+
+void VisionMLRecorder::append(QJsonObject const &event)
+{
+    QByteArray line = QJsonDocument(event).toJson(QJsonDocument::Compact) + '\n';
+    QMutexLocker lock(&m_mutex);
+    if (m_file.isOpen()) {
+        m_file.write(line);
+        m_file.flush(); // keep events if Krita crashes
+    }
+}
@@ -0,0 +1,55 @@
+#ifndef VISION_ML_RECORDER_H_
+#define VISION_ML_RECORDER_H_
+
+#include "VisionMLTimings.h"
+
+#include <visp/vision.h>
+
+#include <QDir>
+#include <QFile>
+#include <QImage>
+#include <QJsonObject>
+#include <QMutex>
+#include <QSet>
+#include <QString>
+
+// Records tool interactions, so that sessions with performance problems can be replayed offline with
+// `visionml-bench --replay`. Every step is appended to events.jsonl as one JSON object per line: the prompt, tool
+// options, model, size and content hash of the sampled image, and how long the step took in Krita. Optionally the
+// sampled images and masks are written as PNG snapshots next to it, so that replay runs on the same pixels. Without
+// snapshots, replay uses synthetic images of the recorded size. Thread-safe.
+//
+// Recorded durations exclude the time spent describing images, but stage timings (VisionMLTimings) of enclosing
+// scopes include it, so both shouldn't be enabled when collecting timings.
+class VisionMLRecorder
+{
+public:
+    using Clock = VisionMLTimings::Clock;
+
+    // Creates a new session directory, named by date and time, inside `directory`.
+    VisionMLRecorder(QString const &directory, bool snapshots);
+
+    // Extent, format and content hash of an image, and the snapshot file name if snapshots are enabled. Each
+    // distinct image is written once. Alpha8 images (masks) are stored as grayscale.
+    QJsonObject describeImage(QImage const &data, visp::image_view const &view);
+
+    // Appends an event, adding its type, start time relative to the start of the session and duration.
+    void record(char const *type, QJsonObject event, Clock::time_point start, Clock::time_point end);
+    void record(char const *type, QJsonObject event);
+
+    static double milliseconds(Clock::time_point start, Clock::time_point end);
+
+    QString sessionDirectory() const;
+
+private:
+    void append(QJsonObject const &event);
+
+    QMutex m_mutex;
+    QDir m_dir;
+    QFile m_file;
+    bool m_snapshots;
+    Clock::time_point m_start;
+    QSet<quint64> m_written;
+};
+
+#endif // VISION_ML_RECORDER_H_
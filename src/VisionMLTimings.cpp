@@ -0,0 +1,137 @@
+#include "VisionMLTimings.h"
+
+#include <algorithm>
+#include <bit>
+
+namespace
+{
+
+int64_t microseconds(VisionMLTimings::Clock::duration d)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+}
+
+int bucketIndex(int64_t us)
+{
+    return std::min(int(std::bit_width(uint64_t(std::max<int64_t>(us, 0)))), VisionMLTimings::bucketCount - 1);
+}
+
+// Smallest bucket upper bound below which the given fraction of samples lies, in milliseconds.
+double percentile(std::array<uint64_t, VisionMLTimings::bucketCount> const &buckets, uint64_t count, double p)
+{
+    uint64_t const target = uint64_t(p * count);
+    uint64_t sum = 0;
+    for (int i = 0; i < VisionMLTimings::bucketCount; ++i) {
+        sum += buckets[i];
+        if (sum > target || sum == count) {
+            return double(uint64_t(1) << i) / 1000.0;
+        }
+    }
+    return 0.0;
+}
+
+// Stage names are identifiers chosen by the code, only quotes and backslashes need escaping.
+void writeString(std::ostream &out, std::string_view s)
+{
+    out << '"';
+    for (char c : s) {
+        if (c == '"' || c == '\\') {
+            out << '\\';
+        }
+        out << c;
+    }
+    out << '"';
+}
+
+} // namespace
+
+VisionMLTimings::VisionMLTimings(size_t traceCapacity)
+    : m_origin(Clock::now())
+    , m_traceCapacity(traceCapacity)
+{
+}
+
+void VisionMLTimings::record(char const *stage, Clock::time_point start, Clock::time_point end)
+{
+    int64_t const duration = microseconds(end - start);
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto it = m_stages.find(std::string_view(stage));
+    if (it == m_stages.end()) {
+        it = m_stages.emplace(stage, Stage{}).first;
+    }
+    Stage &s = it->second;
+    s.min = s.count == 0 ? duration : std::min(s.min, duration);
+    s.max = std::max(s.max, duration);
+    s.total += duration;
+    s.count += 1;
+    s.buckets[bucketIndex(duration)] += 1;
+
+    if (m_traceCapacity > 0) {
+        Event event{stage, microseconds(start - m_origin), duration, threadIndex(std::this_thread::get_id())};
+        if (m_trace.size() < m_traceCapacity) {
+            m_trace.push_back(event);
+        } else {
+            m_trace[m_traceNext] = event;
+        }
+        m_traceNext = (m_traceNext + 1) % m_traceCapacity;
+    }
+}
+
+void VisionMLTimings::clear()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stages.clear();
+    m_trace.clear();
+    m_traceNext = 0;
+}
+
+int VisionMLTimings::threadIndex(std::thread::id id)
+{
+    auto it = m_threads.find(id);
+    if (it == m_threads.end()) {
+        it = m_threads.emplace(id, int(m_threads.size()) + 1).first;
+    }
+    return it->second;
+}
+
+void VisionMLTimings::writeJson(std::ostream &out) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    out << "{\n  \"stages\": {";
+    bool first = true;
+    for (auto const &[name, s] : m_stages) {
+        out << (first ? "\n    " : ",\n    ");
+        first = false;
+        writeString(out, name);
+        out << ": {\"count\": " << s.count << ", \"total_ms\": " << s.total / 1000.0
+            << ", \"mean_ms\": " << s.total / 1000.0 / s.count << ", \"min_ms\": " << s.min / 1000.0
+            << ", \"max_ms\": " << s.max / 1000.0 << ", \"p50_ms\": " << percentile(s.buckets, s.count, 0.5)
+            << ", \"p90_ms\": " << percentile(s.buckets, s.count, 0.9)
+            << ", \"p99_ms\": " << percentile(s.buckets, s.count, 0.99) << ", \"histogram_us\": {";
+        bool firstBucket = true;
+        for (int i = 0; i < bucketCount; ++i) {
+            if (s.buckets[i] > 0) {
+                out << (firstBucket ? "\"<" : ", \"<") << (uint64_t(1) << i) << "\": " << s.buckets[i];
+                firstBucket = false;
+            }
+        }
+        out << "}}";
+    }
+    out << "\n  }\n}\n";
+}
+
+void VisionMLTimings::writeChromeTrace(std::ostream &out) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+    size_t const oldest = m_trace.size() < m_traceCapacity ? 0 : m_traceNext;
+    for (size_t i = 0; i < m_trace.size(); ++i) {
+        Event const &e = m_trace[(oldest + i) % m_trace.size()];
+        out << (i == 0 ? "  {\"name\": " : ",\n  {\"name\": ");
+        writeString(out, e.stage);
+        out << ", \"cat\": \"visionml\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << e.thread << ", \"ts\": " << e.start
+            << ", \"dur\": " << e.duration << "}";
+    }
+    out << "\n]}\n";
+}
@@ -0,0 +1,99 @@
+#ifndef VISION_ML_TIMINGS_H_
+#define VISION_ML_TIMINGS_H_
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+// Durations of processing stages (reading layers, inference, writing the selection, ...). Each stage is aggregated
+// into a histogram with power-of-two microsecond buckets. Optionally the most recent events are kept individually,
+// so that they can be viewed as a timeline. Thread-safe.
+class VisionMLTimings
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // Histogram bucket i counts durations in [2^(i-1), 2^i) microseconds, bucket 0 is below 1 us.
+    static constexpr int bucketCount = 32;
+
+    // traceCapacity is the number of individual events kept for writeChromeTrace, 0 disables the trace.
+    explicit VisionMLTimings(size_t traceCapacity = 0);
+
+    // Stage names must be string literals (or otherwise outlive this object).
+    void record(char const *stage, Clock::time_point start, Clock::time_point end);
+    void clear();
+
+    // Per-stage statistics: count, total, mean, min, max, approximate percentiles (upper bucket bound) and the
+    // histogram, as JSON object {"stages": {"<stage>": {...}}}.
+    void writeJson(std::ostream &out) const;
+
+    // Recorded events in Chrome's trace event format, which can be opened in chrome://tracing or Perfetto.
+    // Nested stages on the same thread show up stacked.
+    void writeChromeTrace(std::ostream &out) const;
+
+private:
+    struct Stage {
+        uint64_t count = 0;
+        int64_t total = 0; // microseconds
+        int64_t min = 0;
+        int64_t max = 0;
+        std::array<uint64_t, bucketCount> buckets{};
+    };
+
+    struct Event {
+        char const *stage;
+        int64_t start; // microseconds since m_origin
+        int64_t duration;
+        int thread;
+    };
+
+    int threadIndex(std::thread::id id); // must be called with m_mutex locked
+
+    mutable std::mutex m_mutex;
+    Clock::time_point m_origin;
+    std::map<std::string, Stage, std::less<>> m_stages;
+    std::map<std::thread::id, int> m_threads;
+    std::vector<Event> m_trace; // ring buffer
+    size_t m_traceCapacity;
+    size_t m_traceNext = 0;
+};
+
+// Records the time from construction to destruction as one stage. Does nothing if timings is null, which is the
+// case when timing is not enabled.
+class VisionMLScopedTimer
+{
+public:
+    VisionMLScopedTimer(VisionMLTimings *timings, char const *stage)
+        : m_timings(timings)
+        , m_stage(stage)
+    {
+        if (m_timings) {
+            m_start = VisionMLTimings::Clock::now();
+        }
+    }
+
+    ~VisionMLScopedTimer()
+    {
+        if (m_timings) {
+            m_timings->record(m_stage, m_start, VisionMLTimings::Clock::now());
+        }
+    }
+
+    VisionMLScopedTimer(VisionMLScopedTimer const &) = delete;
+    VisionMLScopedTimer &operator=(VisionMLScopedTimer const &) = delete;
+
+private:
+    VisionMLTimings *m_timings;
+    char const *m_stage;
+    VisionMLTimings::Clock::time_point m_start;
+};
+
+#endif // VISION_ML_TIMINGS_H_
@@ -0,0 +1,307 @@
+#include "VisionMLWorkerClient.h"
+
+#include <QCoreApplication>
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QLocalSocket>
+#include <QProcess>
+#include <QRandomGenerator>
+#include <QThread>
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
+using namespace VisionMLWorkerProtocol;
+
+namespace
+{
+
+// Time to wait for a freshly launched worker to accept connections.
+int const launchTimeout = 10000;
+
+size_t imageBytes(int width, int height, visp::image_format format)
+{
+    return size_t(width) * height * n_bytes(format);
+}
+
+} // namespace
+
+VisionMLWorkerClient::VisionMLWorkerClient(QString executable, QString modelsDirectory, QString libDirectory)
+    : m_executable(std::move(executable))
+    , m_modelsDirectory(std::move(modelsDirectory))
+    , m_libDirectory(std::move(libDirectory))
+    , m_memoryKeyPrefix(QString("krita-visionml-%1-%2")
+                            .arg(QCoreApplication::applicationPid())
+                            .arg(QRandomGenerator::global()->generate(), 8, 16, QChar('0')))
+{
+}
+
+VisionMLWorkerClient::~VisionMLWorkerClient() = default;
+
+void VisionMLWorkerClient::connect()
+{
+    Request request = makeRequest(Op::info, VisionMLTask::segmentation);
+    try {
+        m_deviceDescription = QString::fromUtf8(send(request, 200).message);
+        return;
+    } catch (Unavailable const &) {
+        // not running yet
+    }
+
+    QStringList args = {"--models", m_modelsDirectory, "--lib", m_libDirectory};
+    args << "--idle-timeout" << QString::number(m_idleTimeout);
+    if (!QProcess::startDetached(m_executable, args)) {
+        throw Unavailable("Failed to launch inference worker " + m_executable.toStdString());
+    }
+    qDebug() << "[VisionML] Launched inference worker" << m_executable;
+
+    QElapsedTimer timer;
+    timer.start();
+    while (timer.elapsed() < launchTimeout) {
+        try {
+            m_deviceDescription = QString::fromUtf8(send(request, 200).message);
+            return;
+        } catch (Unavailable const &) {
+            QThread::msleep(100);
+        }
+    }
+    throw Unavailable("Timed out waiting for the inference worker to start");
+}
+
+void VisionMLWorkerClient::setIdleTimeout(int minutes)
+{
+    m_idleTimeout = std::max(0, minutes);
+}
+
+void VisionMLWorkerClient::setBackend(visp::backend_type backend)
+{
+    m_backend = backend;
+    m_hasSegmentationImage = false;
+    m_deviceDescription.clear();
+}
+
+void VisionMLWorkerClient::setModelName(VisionMLTask task, QString const &name)
+{
+    m_modelName[(int)task] = name.toUtf8();
+    if (task == VisionMLTask::segmentation) {
+        m_hasSegmentationImage = false;
+    }
+}
+
+void VisionMLWorkerClient::setThreadCount(VisionMLTask task, int threads)
+{
+    m_threadCount[(int)task] = threads;
+}
+
+void VisionMLWorkerClient::setThreadPinning(bool enabled)
+{
+    m_pinThreads = enabled;
+}
+
+void VisionMLWorkerClient::setGraphProfile(QString const &file)
+{
+    m_profileFile = file.toUtf8();
+}
+
+QString const &VisionMLWorkerClient::backendDeviceDescription() const
+{
+    return m_deviceDescription;
+}
+
+void VisionMLWorkerClient::encodeSegmentationImage(visp::image_view const &image)
+{
+    m_hasSegmentationImage = false;
+    reserve(imageBytes(image.extent[0], image.extent[1], image.format));
+    Request request = makeRequest(Op::encodeSegmentation, VisionMLTask::segmentation);
+    request.image = put(image, 0);
+    send(request);
+    m_hasSegmentationImage = true;
+    m_segmentationExtent = image.extent;
+}
+
+bool VisionMLWorkerClient::hasSegmentationImage() const
+{
+    return m_hasSegmentationImage;
+}
+
+visp::image_data VisionMLWorkerClient::predictSegmentationMask(visp::i32x2 point)
+{
+    Request request = makeRequest(Op::predictSegmentationPoint, VisionMLTask::segmentation);
+    request.args[0] = point[0];
+    request.args[1] = point[1];
+    return predict(request);
+}
+
+visp::image_data VisionMLWorkerClient::predictSegmentationMask(visp::box_2d box)
+{
+    Request request = makeRequest(Op::predictSegmentationBox, VisionMLTask::segmentation);
+    request.args[0] = box.top_left[0];
+    request.args[1] = box.top_left[1];
+    request.args[2] = box.bottom_right[0];
+    request.args[3] = box.bottom_right[1];
+    return predict(request);
+}
+
+// The worker keeps the encoded image. The mask has the size of the encoded image.
+visp::image_data VisionMLWorkerClient::predict(Request &request)
+{
+    reserve(imageBytes(m_segmentationExtent[0], m_segmentationExtent[1], visp::image_format::alpha_u8));
+    request.result.offset = 0;
+    return take(send(request).result);
+}
+
+visp::image_data VisionMLWorkerClient::removeBackground(visp::image_view const &image)
+{
+    size_t const inputBytes = imageBytes(image.extent[0], image.extent[1], image.format);
+    reserve(inputBytes + imageBytes(image.extent[0], image.extent[1], visp::image_format::alpha_u8));
+    Request request = makeRequest(Op::removeBackground, VisionMLTask::background_removal);
+    request.image = put(image, 0);
+    request.result.offset = inputBytes;
+    return take(send(request).result);
+}
+
+int VisionMLWorkerClient::inpaintResolution(int width, int height)
+{
+    Request request = makeRequest(Op::inpaintResolution, VisionMLTask::inpainting);
+    request.args[0] = width;
+    request.args[1] = height;
+    return send(request).value;
+}
+
+visp::image_data
+VisionMLWorkerClient::inpaint(visp::image_view const &image, visp::image_view const &mask, int resolution)
+{
+    size_t const imageSize = imageBytes(image.extent[0], image.extent[1], image.format);
+    size_t const maskSize = imageBytes(mask.extent[0], mask.extent[1], mask.format);
+    reserve(imageSize + maskSize + imageBytes(image.extent[0], image.extent[1], visp::image_format::rgba_u8));
+    Request request = makeRequest(Op::inpaint, VisionMLTask::inpainting);
+    request.args[0] = resolution;
+    request.image = put(image, 0);
+    request.mask = put(mask, imageSize);
+    request.result.offset = imageSize + maskSize;
+    return take(send(request).result);
+}
+
+void VisionMLWorkerClient::unload(VisionMLTask task)
+{
+    send(makeRequest(Op::unload, task));
+    if (task == VisionMLTask::segmentation) {
+        m_hasSegmentationImage = false;
+    }
+}
+
+VisionMLPipeline::MemoryUsage VisionMLWorkerClient::memoryUsage(VisionMLTask task)
+{
+    Response response = send(makeRequest(Op::memoryUsage, task));
+    return {response.memory[0], response.memory[1], response.memory[2]};
+}
+
+void VisionMLWorkerClient::releaseMemory(VisionMLTask task)
+{
+    send(makeRequest(Op::releaseMemory, task));
+    if (task == VisionMLTask::segmentation) {
+        m_hasSegmentationImage = false;
+    }
+}
+
+VisionMLWorkerClient::Request VisionMLWorkerClient::makeRequest(Op op, VisionMLTask task) const
+{
+    Request request;
+    request.op = op;
+    request.backend = int32_t(m_backend);
+    request.task = int32_t(task);
+    request.threads = m_threadCount[(int)task];
+    request.pinThreads = m_pinThreads ? 1 : 0;
+    setString(request.session, m_memoryKeyPrefix.toUtf8());
+    setString(request.modelName, m_modelName[(int)task]);
+    setString(request.profileFile, m_profileFile);
+    return request;
+}
+
+VisionMLWorkerClient::Response VisionMLWorkerClient::send(Request request, int connectTimeout)
+{
+    if (m_memory) {
+        setString(request.sharedMemoryKey, m_memory->key().toUtf8());
+    }
+    QLocalSocket socket;
+    socket.connectToServer(serverName());
+    if (!socket.waitForConnected(connectTimeout)) {
+        throw Unavailable("Failed to connect to inference worker: " + socket.errorString().toStdString());
+    }
+    socket.write(reinterpret_cast<char const *>(&request), sizeof(Request));
+    if (!socket.waitForBytesWritten()) {
+        throw Unavailable("Failed to send request to inference worker: " + socket.errorString().toStdString());
+    }
+    // Inference may take a long time, wait until the worker responds or the connection drops.
+    while (socket.bytesAvailable() < qint64(sizeof(Response))) {
+        if (!socket.waitForReadyRead(-1)) {
+            throw Unavailable("Lost connection to inference worker: " + socket.errorString().toStdString());
+        }
+    }
+    Response response;
+    socket.read(reinterpret_cast<char *>(&response), sizeof(Response));
+    if (response.magic != magic) {
+        throw Unavailable("Inference worker uses a different protocol version");
+    }
+    if (response.status == noSegmentationImage) {
+        m_hasSegmentationImage = false; // encoded again on the next request from the tool
+    }
+    if (response.status != ok) {
+        throw std::runtime_error(response.message);
+    }
+    return response;
+}
+
+void VisionMLWorkerClient::reserve(size_t bytes)
+{
+    if (m_memory && size_t(m_memory->size()) >= bytes) {
+        return;
+    }
+    size_t const granularity = 4 << 20;
+    size_t const size = (bytes + bytes / 2 + granularity - 1) / granularity * granularity;
+
+    // Segment sizes are int in Qt 5, larger images run in-process.
+    using SegmentSize = decltype(m_memory->size());
+    if (size > size_t(std::numeric_limits<SegmentSize>::max())) {
+        throw Unavailable("Image is too large for shared memory");
+    }
+
+    m_memory.reset();
+    // Qt derives the platform key from this, on Unix it places the files needed for SysV IPC in the temp directory.
+    auto memory = std::make_unique<QSharedMemory>();
+    memory->setKey(m_memoryKeyPrefix + QString("-%1").arg(m_memoryGeneration++));
+    if (!memory->create(SegmentSize(size))) {
+        throw Unavailable("Failed to allocate shared memory: " + memory->errorString().toStdString());
+    }
+    m_memory = std::move(memory);
+}
+
+VisionMLWorkerClient::ImageDesc VisionMLWorkerClient::put(visp::image_view const &image, size_t offset)
+{
+    ImageDesc desc;
+    desc.width = image.extent[0];
+    desc.height = image.extent[1];
+    desc.format = int32_t(image.format);
+    desc.stride = image.extent[0] * n_bytes(image.format);
+    desc.offset = offset;
+
+    auto src = static_cast<uint8_t const *>(image.data);
+    auto dst = static_cast<uint8_t *>(m_memory->data()) + offset;
+    for (int y = 0; y < desc.height; ++y) {
+        memcpy(dst + size_t(y) * desc.stride, src + size_t(y) * image.stride, desc.stride);
+    }
+    return desc;
+}
+
+visp::image_data VisionMLWorkerClient::take(ImageDesc const &desc) const
+{
+    auto format = visp::image_format(desc.format);
+    size_t const size = imageBytes(desc.width, desc.height, format);
+    if (desc.offset + size > size_t(m_memory->size())) {
+        throw std::runtime_error("Inference worker result exceeds shared memory");
+    }
+    visp::image_data result = visp::image_alloc({desc.width, desc.height}, format);
+    memcpy(result.data.get(), static_cast<uint8_t const *>(m_memory->constData()) + desc.offset, size);
+    return result;
+}
@@ -0,0 +1,94 @@
+#ifndef VISION_ML_WORKER_CLIENT_H_
+#define VISION_ML_WORKER_CLIENT_H_
+
+#include "VisionMLPipeline.h"
+#include "worker/VisionMLWorkerProtocol.h"
+
+#include <visp/vision.h>
+
+#include <QSharedMemory>
+#include <QString>
+
+#include <array>
+#include <memory>
+#include <stdexcept>
+
+// Client for the out-of-process inference worker (visionml-worker). Mirrors the VisionMLPipeline interface, starts
+// the worker if it isn't running yet. Calls block until the worker responds. Not thread-safe, VisionModels serializes
+// access. Timings of the pipeline stages are not sent back, the worker doesn't record them.
+class VisionMLWorkerClient
+{
+public:
+    // Thrown when the worker can't be reached or the connection is lost. Callers fall back to in-process inference.
+    class Unavailable : public std::runtime_error
+    {
+    public:
+        using std::runtime_error::runtime_error;
+    };
+
+    VisionMLWorkerClient(QString executable, QString modelsDirectory, QString libDirectory);
+    ~VisionMLWorkerClient();
+
+    // Connects to a running worker, or launches a new one and waits for it. Throws Unavailable on failure.
+    void connect();
+
+    // Minutes without requests after which a worker launched by this client exits, 0 = never. The worker outlives
+    // Krita to keep models loaded for the next session, the timeout makes sure it doesn't stay around forever.
+    void setIdleTimeout(int minutes);
+
+    void setBackend(visp::backend_type backend);
+    void setModelName(VisionMLTask task, QString const &name);
+
+    // Pipeline settings, sent to the worker with every request. See VisionMLPipeline.
+    void setThreadCount(VisionMLTask task, int threads);
+    void setThreadPinning(bool enabled);
+    void setGraphProfile(QString const &file);
+    QString const &backendDeviceDescription() const; // queried when connecting
+
+    void encodeSegmentationImage(visp::image_view const &image);
+    bool hasSegmentationImage() const;
+    visp::image_data predictSegmentationMask(visp::i32x2 point);
+    visp::image_data predictSegmentationMask(visp::box_2d box);
+    visp::image_data removeBackground(visp::image_view const &image);
+    int inpaintResolution(int width, int height);
+    visp::image_data inpaint(visp::image_view const &image, visp::image_view const &mask, int resolution);
+    void unload(VisionMLTask task);
+    VisionMLPipeline::MemoryUsage memoryUsage(VisionMLTask task);
+    void releaseMemory(VisionMLTask task);
+
+private:
+    using Request = VisionMLWorkerProtocol::Request;
+    using Response = VisionMLWorkerProtocol::Response;
+    using ImageDesc = VisionMLWorkerProtocol::ImageDesc;
+
+    Request makeRequest(VisionMLWorkerProtocol::Op op, VisionMLTask task) const;
+    Response send(Request request, int connectTimeout = 1000);
+
+    // Makes sure the shared memory segment holds at least `bytes`. Recreated with a new key when it has to grow.
+    // Keys are unique per client instance, so that they don't collide with segments which the worker still holds
+    // for an earlier Krita process that had the same PID.
+    void reserve(size_t bytes);
+    ImageDesc put(visp::image_view const &image, size_t offset);
+    visp::image_data take(ImageDesc const &desc) const;
+    visp::image_data predict(Request &request);
+
+    QString m_executable;
+    QString m_modelsDirectory;
+    QString m_libDirectory;
+    int m_idleTimeout = 0;
+    visp::backend_type m_backend = visp::backend_type::cpu;
+    std::array<QByteArray, (int)VisionMLTask::_count> m_modelName;
+    std::array<int, (int)VisionMLTask::_count> m_threadCount{};
+    bool m_pinThreads = false;
+    QByteArray m_profileFile;
+
+    std::unique_ptr<QSharedMemory> m_memory;
+    QString m_memoryKeyPrefix; // also identifies the session in the worker
+    int m_memoryGeneration = 0;
+
+    QString m_deviceDescription;
+    bool m_hasSegmentationImage = false;
+    visp::i32x2 m_segmentationExtent{};
+};
+
+#endif // VISION_ML_WORKER_CLIENT_H_
@@ -0,0 +1,910 @@
+// Benchmarks for inference and image processing on synthetic images, using the CPU backend. Results are written as
+// JSON, so that runs of different plugin builds can be compared by scripts before rolling out a new build.
+//
+//   visionml-bench [--models <dir>] [--lib <dir>] [--sizes 1024x1024,...] [--formats u8,u16,f32]
+//                  [--iterations <n>] [--warmup <n>] [--threads <n>] [--filter <text>] [--output <file>]
+//
+// Image processing (paint device conversion, post-processing) runs for every size and color format. Models run once
+// per size on the 8-bit image, their speed doesn't depend on the format of the paint device.
+//
+//   visionml-bench --golden <dir> [--update-golden] [--time-tolerance <factor>] [--min-iou <iou>] [--min-psnr <dB>]
+//
+// Regression check for plugin updates: runs conversions, image processing and all models on fixed inputs (synthetic,
+// plus PNG images in <dir>/inputs) and compares masks (IoU) and inpaint results (PSNR) to references stored by an
+// earlier run with --update-golden. Run times are compared relative to a calibration workload, so that references
+// can be reused on machines of different speed, --time-tolerance 0 skips that comparison. Checks without a reference
+// are skipped, but a model which fails to run (eg. isn't installed) fails its check if there is one. Exits with status
+// 1 if any check fails, and with 77 if there are no references, or no reference times when comparing run times (CTest
+// reports the test as skipped, see CMakeLists.txt).
+//
+// The references in bench/golden cover image processing on the synthetic image and on inputs/scene.png. Models and
+// run times have no stored references, as they depend on the installed models and the reference machine.
+//
+//   visionml-bench --replay <session>/events.jsonl [--models <dir>] [--lib <dir>] [--threads <n>] [--output <file>]
+//
+// Replays a session recorded by the plugin (see VisionMLRecorder) and reports the latency of each step next to the
+// time it took in Krita. Only the inference and post-processing parts of a step are replayed, reading layers and
+// writing selections need a Krita document.
+
+#include "VisionMLBackendLoader.h"
+#include "VisionMLImage.h"
+#include "VisionMLImageOps.h"
+#include "VisionMLPipeline.h"
+
+#include "KoColorModelStandardIds.h"
+#include "KoColorSpaceRegistry.h"
+#include "kis_paint_device.h"
+
+#include <ggml-backend.h>
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QSize>
+#include <QStringList>
+#include <QVector>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <numeric>
+#include <stdexcept>
+
+namespace
+{
+
+using Clock = std::chrono::steady_clock;
+
+// Exit status of --golden without references, CTest's SKIP_RETURN_CODE.
+int const noReferencesStatus = 77;
+
+struct Settings {
+    int iterations = 5;
+    int warmup = 1;
+    QString filter;
+};
+
+struct Result {
+    QString name;
+    QSize size;
+    QString format; // color format of the paint device, empty for models
+    QString model;
+    QVector<double> samples; // milliseconds
+};
+
+// Gradient with a disc in the center, so that models and edge-aware filters have some structure to work on.
+QImage syntheticImage(QSize size)
+{
+    QImage image(size, QImage::Format_ARGB32);
+    int const cx = size.width() / 2, cy = size.height() / 2;
+    int const radius = std::min(size.width(), size.height()) / 4;
+    for (int y = 0; y < size.height(); ++y) {
+        QRgb *line = reinterpret_cast<QRgb *>(image.scanLine(y));
+        for (int x = 0; x < size.width(); ++x) {
+            bool inside = (x - cx) * (x - cx) + (y - cy) * (y - cy) < radius * radius;
+            int r = 255 * x / size.width();
+            int g = 255 * y / size.height();
+            line[x] = inside ? qRgba(230, 60, 40, 255) : qRgba(r, g, 128, 255);
+        }
+    }
+    return image;
+}
+
+// Alpha mask of the disc in syntheticImage. With `feather` > 0 the edge is a linear ramp of that width.
+visp::image_data discMask(QSize size, int feather)
+{
+    visp::image_data mask = visp::image_alloc({size.width(), size.height()}, visp::image_format::alpha_u8);
+    float const cx = size.width() / 2, cy = size.height() / 2;
+    float const radius = std::min(size.width(), size.height()) / 4;
+    for (int y = 0; y < size.height(); ++y) {
+        for (int x = 0; x < size.width(); ++x) {
+            float d = radius - std::sqrt((x - cx) * (x - cx) + (y - cy) * (y - cy));
+            float a = feather > 0 ? std::clamp(d / feather + 0.5f, 0.f, 1.f) : (d > 0 ? 1.f : 0.f);
+            mask.data[size_t(y) * size.width() + x] = uint8_t(a * 255.f + 0.5f);
+        }
+    }
+    return mask;
+}
+
+KoColorSpace const *colorSpace(QString const &format)
+{
+    KoID depth = Integer8BitsColorDepthID;
+    if (format == "u16") {
+        depth = Integer16BitsColorDepthID;
+    } else if (format == "f32") {
+        depth = Float32BitsColorDepthID;
+    } else if (format != "u8") {
+        throw std::runtime_error("Unknown color format: " + format.toStdString());
+    }
+    return KoColorSpaceRegistry::instance()->colorSpace(RGBAColorModelID.id(), depth.id(), nullptr);
+}
+
+double median(QVector<double> samples)
+{
+    std::sort(samples.begin(), samples.end());
+    size_t n = samples.size();
+    return n == 0 ? 0.0 : (n % 2 ? samples[n / 2] : 0.5 * (samples[n / 2 - 1] + samples[n / 2]));
+}
+
+class Benchmark
+{
+public:
+    explicit Benchmark(Settings settings)
+        : m_settings(std::move(settings))
+    {
+    }
+
+    // Runs fn for warmup + iterations and records the iterations. Skipped if the name doesn't match the filter.
+    void run(Result result, std::function<void(int)> const &fn)
+    {
+        if (!m_settings.filter.isEmpty() && !result.name.contains(m_settings.filter)) {
+            return;
+        }
+        try {
+            for (int i = 0; i < m_settings.warmup + m_settings.iterations; ++i) {
+                auto start = Clock::now();
+                fn(i);
+                double ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+                if (i >= m_settings.warmup) {
+                    result.samples.append(ms);
+                }
+            }
+        } catch (std::exception const &e) {
+            std::fprintf(stderr, "%-28s skipped: %s\n", qPrintable(result.name), e.what());
+            return;
+        }
+        std::fprintf(stderr,
+                     "%-28s %5dx%-5d %-4s %10.2f ms\n",
+                     qPrintable(result.name),
+                     result.size.width(),
+                     result.size.height(),
+                     qPrintable(result.format),
+                     median(result.samples));
+        m_results.append(std::move(result));
+    }
+
+    QJsonArray toJson() const
+    {
+        QJsonArray results;
+        for (Result const &r : m_results) {
+            QJsonArray samples;
+            for (double ms : r.samples) {
+                samples.append(ms);
+            }
+            double const med = median(r.samples);
+            QJsonObject entry{
+                {"name", r.name},
+                {"width", r.size.width()},
+                {"height", r.size.height()},
+                {"median_ms", med},
+                {"min_ms", *std::min_element(r.samples.begin(), r.samples.end())},
+                {"max_ms", *std::max_element(r.samples.begin(), r.samples.end())},
+                {"mean_ms", std::accumulate(r.samples.begin(), r.samples.end(), 0.0) / r.samples.size()},
+                {"megapixels_per_second", med > 0 ? r.size.width() * r.size.height() / (med * 1000.0) : 0.0},
+                {"samples_ms", samples},
+            };
+            if (!r.format.isEmpty()) {
+                entry["format"] = r.format;
+            }
+            if (!r.model.isEmpty()) {
+                entry["model"] = r.model;
+            }
+            results.append(entry);
+        }
+        return results;
+    }
+
+private:
+    Settings m_settings;
+    QVector<Result> m_results;
+};
+
+void benchmarkImageProcessing(Benchmark &bench, QSize size, QString const &format)
+{
+    KisPaintDeviceSP device = new KisPaintDevice(KoColorSpaceRegistry::instance()->rgb8());
+    device->convertFromQImage(syntheticImage(size), nullptr);
+    device->convertTo(colorSpace(format));
+
+    bench.run({"prepare", size, format}, [&](int) { VisionMLImage::prepare(*device); });
+
+    VisionMLImage image = VisionMLImage::prepare(*device);
+    visp::image_data rgba = VisionMLImageOps::extractForeground(image.view, discMask(size, 0), false, false);
+    visp::image_data mask = discMask(size, 0);
+    visp::image_data softMask = discMask(size, 16);
+
+    bench.run({"convert_to_qimage", size, format}, [&](int) { VisionMLImage::convertToQImage(rgba); });
+    bench.run({"hash_image", size, format}, [&](int) { VisionMLImageOps::hashImage(image.view); });
+    bench.run({"mask_bounds", size, format}, [&](int) { VisionMLImageOps::maskBounds(mask); });
+    bench.run({"adjust_mask", size, format}, [&](int) {
+        visp::image_data adjusted = VisionMLImageOps::cropMask(mask, {0, 0, size.width(), size.height()});
+        VisionMLImageOps::adjustMask(adjusted, 20, 10);
+    });
+    bench.run({"adjust_mask_soft", size, format}, [&](int) {
+        visp::image_data adjusted = VisionMLImageOps::cropMask(softMask, {0, 0, size.width(), size.height()});
+        VisionMLImageOps::adjustMask(adjusted, 20, 10);
+    });
+    bench.run({"anti_alias_mask", size, format}, [&](int) {
+        visp::image_data adjusted = VisionMLImageOps::cropMask(mask, {0, 0, size.width(), size.height()});
+        VisionMLImageOps::antiAliasMask(adjusted);
+    });
+    bench.run({"trace_contours", size, format}, [&](int) { VisionMLImageOps::traceContours(softMask); });
+    bench.run({"refine_matte", size, format}, [&](int) { VisionMLImageOps::refineMatte(image.view, softMask); });
+    bench.run({"estimate_foreground", size, format},
+              [&](int) { VisionMLImageOps::extractForeground(image.view, softMask, false, true); });
+    bench.run({"inpaint_mask_postprocess", size, format},
+              [&](int) { VisionMLImageOps::erodeBlurMaskToAlpha(mask, rgba); });
+}
+
+void benchmarkModels(Benchmark &bench, VisionMLPipeline &pipeline, QSize size)
+{
+    KisPaintDeviceSP device = new KisPaintDevice(KoColorSpaceRegistry::instance()->rgb8());
+    device->convertFromQImage(syntheticImage(size), nullptr);
+    VisionMLImage image = VisionMLImage::prepare(*device);
+    visp::image_data mask = discMask(size, 0);
+
+    auto model = [&](VisionMLTask task) { return QString::fromStdString(pipeline.modelName(task)); };
+    QString const sam = model(VisionMLTask::segmentation);
+    visp::i32x2 center{size.width() / 2, size.height() / 2};
+    visp::box_2d box{visp::i32x2{size.width() / 4, size.height() / 4},
+                     visp::i32x2{size.width() * 3 / 4, size.height() * 3 / 4}};
+
+    bench.run({"sam_encode", size, {}, sam}, [&](int) { pipeline.encodeSegmentationImage(image.view); });
+    bench.run({"sam_decode_point", size, {}, sam}, [&](int) {
+        if (!pipeline.hasSegmentationImage()) {
+            pipeline.encodeSegmentationImage(image.view);
+        }
+        pipeline.predictSegmentationMask(center);
+    });
+    bench.run({"sam_decode_box", size, {}, sam}, [&](int) {
+        if (!pipeline.hasSegmentationImage()) {
+            pipeline.encodeSegmentationImage(image.view);
+        }
+        pipeline.predictSegmentationMask(box);
+    });
+
+    // Masks are cached by image content, change one pixel for every run to measure inference.
+    uint8_t *first = image.data.bits();
+    bench.run({"birefnet", size, {}, model(VisionMLTask::background_removal)}, [&](int i) {
+        first[0] = uint8_t(i);
+        pipeline.removeBackground(image.view);
+    });
+
+    int resolution = pipeline.inpaintResolution(size.width(), size.height());
+    bench.run({"migan", size, {}, model(VisionMLTask::inpainting)},
+              [&](int) { pipeline.inpaint(image.view, mask, resolution); });
+}
+
+// Input of a replayed step: the recorded snapshot if there is one, otherwise a synthetic image of the recorded size.
+struct ReplayImage {
+    QImage data;
+    visp::image_span view;
+    bool synthetic = false;
+};
+
+ReplayImage loadImage(QDir const &dir, QJsonObject const &desc, bool mask)
+{
+    QSize size(desc["width"].toInt(), desc["height"].toInt());
+    if (size.width() <= 0 || size.height() <= 0) {
+        throw std::runtime_error("Recorded event has no image size");
+    }
+    ReplayImage result;
+    QString snapshot = desc["snapshot"].toString();
+    if (!snapshot.isEmpty()) {
+        result.data = QImage(dir.filePath(snapshot));
+    }
+    result.synthetic = result.data.isNull();
+    visp::image_format format = visp::image_format::argb_u8;
+    if (mask) {
+        if (result.synthetic) {
+            visp::image_data disc = discMask(size, 0);
+            result.data = QImage(size, QImage::Format_Grayscale8);
+            for (int y = 0; y < size.height(); ++y) {
+                memcpy(result.data.scanLine(y), disc.data.get() + size_t(y) * size.width(), size.width());
+            }
+        }
+        result.data = result.data.convertToFormat(QImage::Format_Grayscale8);
+        format = visp::image_format::alpha_u8;
+    } else {
+        if (result.synthetic) {
+            result.data = syntheticImage(size);
+        }
+        result.data = result.data.convertToFormat(QImage::Format_ARGB32);
+        if (desc["format"].toString() == "bgra_u8") {
+            format = visp::image_format::bgra_u8;
+        }
+    }
+    result.view = visp::image_span({result.data.width(), result.data.height()}, format, result.data.bits());
+    result.view.stride = result.data.bytesPerLine();
+    return result;
+}
+
+VisionMLTask parseTask(QString const &name)
+{
+    for (int i = 0; i < (int)VisionMLTask::_count; ++i) {
+        if (name == toString(VisionMLTask(i))) {
+            return VisionMLTask(i);
+        }
+    }
+    throw std::runtime_error("Unknown task: " + name.toStdString());
+}
+
+void setRecordedModel(VisionMLPipeline &pipeline, VisionMLTask task, QJsonObject const &event)
+{
+    std::string model = event["model"].toString().toStdString();
+    if (!model.empty() && model != pipeline.modelName(task)) {
+        pipeline.setModelName(task, model);
+    }
+}
+
+// Runs one recorded step, returns whether its input was synthetic.
+bool replayStep(VisionMLPipeline &pipeline, QDir const &dir, QString const &type, QJsonObject const &event)
+{
+    if (type == "segmentation.encode") {
+        setRecordedModel(pipeline, VisionMLTask::segmentation, event);
+        ReplayImage image = loadImage(dir, event["image"].toObject(), false);
+        pipeline.encodeSegmentationImage(image.view);
+        return image.synthetic;
+    } else if (type == "segmentation.predict") {
+        if (!pipeline.hasSegmentationImage()) {
+            throw std::runtime_error("No encoded image, the session was recorded without its encode step");
+        }
+        QJsonArray p = event.contains("point") ? event["point"].toArray() : event["box"].toArray();
+        if (event.contains("point")) {
+            pipeline.predictSegmentationMask(visp::i32x2{p[0].toInt(), p[1].toInt()});
+        } else {
+            pipeline.predictSegmentationMask(
+                visp::box_2d{visp::i32x2{p[0].toInt(), p[1].toInt()}, visp::i32x2{p[2].toInt(), p[3].toInt()}});
+        }
+    } else if (type == "segmentation.precise") {
+        setRecordedModel(pipeline, VisionMLTask::background_removal, event);
+        ReplayImage image = loadImage(dir, event["image"].toObject(), false);
+        visp::image_data mask = pipeline.removeBackground(image.view);
+        if (event["refine_edges"].toBool(true)) { // always on in sessions recorded before the option existed
+            VisionMLImageOps::refineMatte(image.view, mask);
+        }
+        return image.synthetic;
+    } else if (type == "inpainting") {
+        setRecordedModel(pipeline, VisionMLTask::inpainting, event);
+        ReplayImage image = loadImage(dir, event["image"].toObject(), false);
+        ReplayImage mask = loadImage(dir, event["mask"].toObject(), true);
+        if (mask.data.size() != image.data.size()) {
+            throw std::runtime_error("Recorded mask and image sizes differ");
+        }
+        visp::image_data result = pipeline.inpaint(image.view, mask.view, event["resolution"].toInt());
+        VisionMLImageOps::erodeBlurMaskToAlpha(mask.view, result);
+        return image.synthetic || mask.synthetic;
+    } else if (type == "unload") {
+        pipeline.unload(parseTask(event["task"].toString()));
+    }
+    return false;
+}
+
+// Replays all steps of a recorded session in order, and returns them with recorded and replayed latency.
+QJsonArray replay(VisionMLPipeline &pipeline, QString const &file)
+{
+    QFile events(file);
+    if (!events.open(QIODevice::ReadOnly)) {
+        throw std::runtime_error("Failed to open " + file.toStdString());
+    }
+    QDir const dir = QFileInfo(file).absoluteDir();
+    QJsonArray steps;
+    std::fprintf(stderr, "%5s %-22s %12s %12s %12s\n", "step", "type", "krita ms", "model ms", "replay ms");
+    for (int index = 0; !events.atEnd(); ++index) {
+        QByteArray line = events.readLine().trimmed();
+        QJsonObject event = QJsonDocument::fromJson(line).object();
+        QString const type = event["type"].toString();
+        if (type.isEmpty() || type == "backend") {
+            if (type == "backend") {
+                std::fprintf(stderr, "      recorded on %s backend\n", qPrintable(event["backend"].toString()));
+            }
+            continue;
+        }
+        QJsonObject step{
+            {"index", index},
+            {"type", type},
+            {"t_ms", event["t_ms"]},
+            {"recorded_ms", event["duration_ms"]},
+            {"recorded_inference_ms", event["inference_ms"]},
+        };
+        try {
+            auto start = Clock::now();
+            step["synthetic"] = replayStep(pipeline, dir, type, event);
+            step["replay_ms"] = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+        } catch (std::exception const &e) {
+            step["error"] = e.what();
+        }
+        std::fprintf(stderr,
+                     "%5d %-22s %12.2f %12.2f %12.2f%s%s\n",
+                     index,
+                     qPrintable(type),
+                     event["duration_ms"].toDouble(),
+                     event["inference_ms"].toDouble(),
+                     step["replay_ms"].toDouble(),
+                     step["synthetic"].toBool() ? " (synthetic input)" : "",
+                     step.contains("error") ? qPrintable(" error: " + step["error"].toString()) : "");
+        steps.append(step);
+    }
+    return steps;
+}
+
+struct GoldenSettings {
+    QDir dir;
+    bool update = false;
+    int iterations = 5;
+    double timeTolerance = 1.5;
+    double minIoU = 0.97;
+    double minPSNR = 30.0;
+};
+
+QImage toQImage(visp::image_data const &image)
+{
+    if (image.format == visp::image_format::rgba_u8) {
+        return VisionMLImage::convertToQImage(image);
+    }
+    if (image.format != visp::image_format::alpha_u8) {
+        throw std::runtime_error("Unsupported output format");
+    }
+    QImage result(image.extent[0], image.extent[1], QImage::Format_Grayscale8);
+    for (int y = 0; y < result.height(); ++y) {
+        memcpy(result.scanLine(y), image.data.get() + size_t(y) * result.width(), result.width());
+    }
+    return result;
+}
+
+// Intersection over union of the two masks at threshold 128.
+double maskIoU(QImage const &a, QImage const &b)
+{
+    int64_t intersection = 0, both = 0;
+    for (int y = 0; y < a.height(); ++y) {
+        uint8_t const *lineA = a.constScanLine(y);
+        uint8_t const *lineB = b.constScanLine(y);
+        for (int x = 0; x < a.width(); ++x) {
+            bool inA = lineA[x] >= 128, inB = lineB[x] >= 128;
+            intersection += inA && inB;
+            both += inA || inB;
+        }
+    }
+    return both == 0 ? 1.0 : double(intersection) / both;
+}
+
+// Peak signal-to-noise ratio of the color channels of two RGBA8888 images, in dB.
+double colorPSNR(QImage const &a, QImage const &b)
+{
+    double squared = 0;
+    for (int y = 0; y < a.height(); ++y) {
+        uint8_t const *lineA = a.constScanLine(y);
+        uint8_t const *lineB = b.constScanLine(y);
+        for (int x = 0; x < a.width() * 4; ++x) {
+            if (x % 4 != 3) {
+                double d = double(lineA[x]) - lineB[x];
+                squared += d * d;
+            }
+        }
+    }
+    double mse = squared / (double(a.width()) * a.height() * 3);
+    return mse == 0 ? 99.0 : 10.0 * std::log10(255.0 * 255.0 / mse);
+}
+
+class Golden
+{
+public:
+    explicit Golden(GoldenSettings settings)
+        : m_settings(std::move(settings))
+    {
+        // When updating, references of checks which can't run here (missing models) are kept.
+        QFile file(m_settings.dir.filePath("golden.json"));
+        if (file.open(QIODevice::ReadOnly)) {
+            m_references = QJsonDocument::fromJson(file.readAll()).object()["checks"].toObject();
+        } else if (!m_settings.update) {
+            throw std::runtime_error("No references found in " + file.fileName().toStdString()
+                                     + ", create them with --update-golden");
+        }
+        if (m_settings.update && !m_settings.dir.mkpath(".")) {
+            throw std::runtime_error("Failed to create " + m_settings.dir.path().toStdString());
+        }
+        m_calibrationMs = calibrate();
+        std::fprintf(stderr, "Calibration: %.2f ms\n", m_calibrationMs);
+    }
+
+    // Result of a check without stored reference, eg. conversions which must be exact.
+    void expect(QString const &name, bool passed, QString const &detail = {})
+    {
+        m_failures += passed ? 0 : 1;
+        std::fprintf(stderr, "%s  %-36s %s\n", passed ? "PASS" : "FAIL", qPrintable(name), qPrintable(detail));
+    }
+
+    // Runs once to load models, then measures `iterations` runs. The output of the last run is compared to the
+    // reference, and its median time relative to the calibration to the reference time. Skipped without reference,
+    // fails if the run fails (eg. because the model isn't installed) although there is one.
+    void compare(QString const &name, std::function<visp::image_data()> const &run)
+    {
+        QJsonObject const reference = m_references[name].toObject();
+        if (!m_settings.update && reference.isEmpty()) {
+            std::fprintf(stderr, "SKIP  %-36s no reference, run with --update-golden\n", qPrintable(name));
+            return;
+        }
+        visp::image_data output;
+        QVector<double> samples;
+        try {
+            output = run();
+            for (int i = 0; i < m_settings.iterations; ++i) {
+                auto start = Clock::now();
+                output = run();
+                samples.append(std::chrono::duration<double, std::milli>(Clock::now() - start).count());
+            }
+        } catch (std::exception const &e) {
+            if (m_settings.update && !reference.isEmpty()) {
+                m_updated[name] = reference;
+                std::fprintf(stderr, "SKIP  %-36s %s, kept reference\n", qPrintable(name), e.what());
+            } else if (m_settings.update) {
+                std::fprintf(stderr, "SKIP  %-36s %s\n", qPrintable(name), e.what());
+            } else {
+                expect(name, false, e.what());
+            }
+            return;
+        }
+        double const ms = median(samples);
+        double const relative = ms / m_calibrationMs;
+        QImage image = toQImage(output);
+        bool const isMask = output.format == visp::image_format::alpha_u8;
+
+        if (m_settings.update) {
+            QString file = name + ".png";
+            bool saved = image.save(m_settings.dir.filePath(file));
+            m_updated[name] = QJsonObject{{"image", file}, {"ms", ms}, {"relative_time", relative}};
+            expect(name, saved, saved ? QString("stored, %1 ms").arg(ms, 0, 'f', 2) : "failed to write " + file);
+            return;
+        }
+        QImage expected(m_settings.dir.filePath(reference["image"].toString()));
+        if (expected.isNull()) {
+            expect(name, false, "failed to read " + reference["image"].toString());
+            return;
+        }
+        if (expected.size() != image.size()) {
+            expect(name, false, "size differs from reference");
+            return;
+        }
+        QString detail;
+        bool passed = true;
+        if (isMask) {
+            double iou = maskIoU(image, expected.convertToFormat(QImage::Format_Grayscale8));
+            passed = iou >= m_settings.minIoU;
+            detail = QString("IoU %1").arg(iou, 0, 'f', 4);
+        } else {
+            double psnr = colorPSNR(image, expected.convertToFormat(QImage::Format_RGBA8888));
+            passed = psnr >= m_settings.minPSNR;
+            detail = QString("PSNR %1 dB").arg(psnr, 0, 'f', 1);
+        }
+        if (m_settings.timeTolerance > 0 && reference.contains("relative_time")) {
+            ++m_timedChecks;
+            double const limit = reference["relative_time"].toDouble() * m_settings.timeTolerance;
+            passed = passed && relative <= limit;
+            detail += QString(", %1 ms (%2x calibration, limit %3x)")
+                          .arg(ms, 0, 'f', 2)
+                          .arg(relative, 0, 'f', 2)
+                          .arg(limit, 0, 'f', 2);
+        } else if (m_settings.timeTolerance > 0) {
+            detail += ", no reference time";
+        }
+        expect(name, passed, detail);
+    }
+
+    // Writes references when updating. Returns the exit status: 0 if all checks passed, 1 if any failed, and
+    // noReferencesStatus if run times were to be compared but none of the checks has a reference time.
+    int finish()
+    {
+        if (m_settings.update) {
+            QJsonObject root{{"version", 1}, {"calibration_ms", m_calibrationMs}, {"checks", m_updated}};
+            QFile file(m_settings.dir.filePath("golden.json"));
+            QByteArray json = QJsonDocument(root).toJson();
+            if (!file.open(QIODevice::WriteOnly) || file.write(json) != json.size()) {
+                expect("golden.json", false, "failed to write " + file.fileName());
+            }
+        }
+        std::fprintf(stderr, "%d check(s) failed\n", m_failures);
+        if (m_failures > 0) {
+            return 1;
+        }
+        if (!m_settings.update && m_settings.timeTolerance > 0 && m_timedChecks == 0) {
+            std::fprintf(stderr, "No reference times, store them with --update-golden on the reference machine\n");
+            return noReferencesStatus;
+        }
+        return 0;
+    }
+
+private:
+    // Fixed CPU workload with a similar mix of memory access and arithmetic as inference.
+    double calibrate()
+    {
+        QSize const size(1024, 1024);
+        KisPaintDeviceSP device = new KisPaintDevice(KoColorSpaceRegistry::instance()->rgb8());
+        device->convertFromQImage(syntheticImage(size), nullptr);
+        VisionMLImage image = VisionMLImage::prepare(*device);
+        visp::image_data mask = discMask(size, 16);
+        QVector<double> samples;
+        for (int i = 0; i < 6; ++i) {
+            auto start = Clock::now();
+            VisionMLImageOps::refineMatte(image.view, mask);
+            VisionMLImageOps::extractForeground(image.view, mask, false, true);
+            samples.append(std::chrono::duration<double, std::milli>(Clock::now() - start).count());
+        }
+        samples.removeFirst();
+        return median(samples);
+    }
+
+    GoldenSettings m_settings;
+    QJsonObject m_references;
+    QJsonObject m_updated;
+    double m_calibrationMs = 1;
+    int m_failures = 0;
+    int m_timedChecks = 0;
+};
+
+// Largest difference of any channel between the prepared image and the 8-bit source.
+int maxDifference(VisionMLImage const &prepared, QImage const &source, QPoint offset)
+{
+    QImage converted = prepared.data.convertToFormat(QImage::Format_ARGB32);
+    int result = 0;
+    for (int y = 0; y < converted.height(); ++y) {
+        uint8_t const *a = converted.constScanLine(y);
+        uint8_t const *b = source.constScanLine(y + offset.y()) + offset.x() * 4;
+        for (int x = 0; x < converted.width() * 4; ++x) {
+            result = std::max(result, std::abs(int(a[x]) - int(b[x])));
+        }
+    }
+    return result;
+}
+
+void checkConversions(Golden &golden)
+{
+    QSize const size(256, 192);
+    QImage const source = syntheticImage(size);
+    QRect const crop(37, 21, 100, 80);
+    for (QString format : {"u8", "u16", "f32"}) {
+        KisPaintDeviceSP device = new KisPaintDevice(KoColorSpaceRegistry::instance()->rgb8());
+        device->convertFromQImage(source, nullptr);
+        device->convertTo(colorSpace(format));
+        int const tolerance = format == "u8" ? 0 : 1;
+
+        VisionMLImage full = VisionMLImage::prepare(*device);
+        int diff = maxDifference(full, source, {});
+        golden.expect("prepare." + format,
+                      full.data.size() == size && diff <= tolerance,
+                      QString("max difference %1").arg(diff));
+
+        VisionMLImage cropped = VisionMLImage::prepare(*device, crop);
+        diff = maxDifference(cropped, source, crop.topLeft());
+        golden.expect("prepare_crop." + format,
+                      cropped.data.size() == crop.size() && diff <= tolerance,
+                      QString("max difference %1").arg(diff));
+    }
+
+    QImage const rgba = source.convertToFormat(QImage::Format_RGBA8888);
+    visp::image_data data = visp::image_alloc({size.width(), size.height()}, visp::image_format::rgba_u8);
+    for (int y = 0; y < size.height(); ++y) {
+        memcpy(data.data.get() + size_t(y) * size.width() * 4, rgba.constScanLine(y), size.width() * 4);
+    }
+    golden.expect("convert_to_qimage", VisionMLImage::convertToQImage(data) == rgba);
+    golden.expect("convert_to_qimage_crop", VisionMLImage::convertToQImage(data, crop) == rgba.copy(crop));
+}
+
+void checkPadBounds(Golden &golden)
+{
+    struct Case {
+        char const *name;
+        QRect bounds;
+        QRect image;
+        QRect expected;
+    };
+    QRect const image(0, 0, 2000, 1500);
+    int const pad = 64, target = 512;
+    Case const cases[] = {
+        {"center", {900, 700, 20, 20}, image, {654, 454, 512, 512}},
+        {"top_left", {10, 10, 20, 20}, image, {0, 0, 512, 512}},
+        {"bottom_right", {1970, 1470, 20, 20}, image, {1488, 988, 512, 512}},
+        {"right_edge", {990, 10, 20, 20}, {0, 0, 1000, 1500}, {488, 0, 512, 512}},
+        {"image_offset", {0, 700, 20, 20}, {-100, 0, 2000, 1500}, {-100, 454, 512, 512}},
+        {"image_smaller", {100, 50, 50, 50}, {0, 0, 300, 200}, {0, 0, 300, 200}},
+        {"larger_than_target", {100, 100, 1000, 800}, image, {36, 36, 1128, 928}},
+        {"larger_at_edge", {0, 0, 1000, 800}, image, {0, 0, 1064, 864}},
+    };
+    auto str = [](QRect r) { return QString("%1,%2 %3x%4").arg(r.x()).arg(r.y()).arg(r.width()).arg(r.height()); };
+    for (Case const &c : cases) {
+        QRect result = VisionMLImage::padBounds(c.bounds, pad, target, c.image);
+        golden.expect(QString("pad_bounds.") + c.name,
+                      result == c.expected,
+                      result == c.expected ? str(result) : str(result) + ", expected " + str(c.expected));
+    }
+}
+
+void checkModels(Golden &golden, VisionMLPipeline &pipeline, QString const &name, QImage const &input)
+{
+    KisPaintDeviceSP device = new KisPaintDevice(KoColorSpaceRegistry::instance()->rgb8());
+    device->convertFromQImage(input, nullptr);
+    VisionMLImage image = VisionMLImage::prepare(*device);
+    QSize const size = input.size();
+    visp::i32x2 center{size.width() / 2, size.height() / 2};
+    visp::box_2d box{visp::i32x2{size.width() / 4, size.height() / 4},
+                     visp::i32x2{size.width() * 3 / 4, size.height() * 3 / 4}};
+
+    visp::image_data softMask = discMask(size, 16);
+    golden.compare(name + ".refine_matte", [&] { return VisionMLImageOps::refineMatte(image.view, softMask); });
+    golden.compare(name + ".sam_point", [&] {
+        pipeline.encodeSegmentationImage(image.view);
+        return pipeline.predictSegmentationMask(center);
+    });
+    golden.compare(name + ".sam_box", [&] {
+        if (!pipeline.hasSegmentationImage()) {
+            pipeline.encodeSegmentationImage(image.view);
+        }
+        return pipeline.predictSegmentationMask(box);
+    });
+
+    // Masks are cached by image content. Changing alpha of one pixel (which the model ignores) forces inference.
+    uint8_t *alpha = image.data.bits() + 3;
+    golden.compare(name + ".birefnet", [&] {
+        *alpha = *alpha == 0 ? 255 : *alpha - 1;
+        return pipeline.removeBackground(image.view);
+    });
+
+    visp::image_data mask = discMask(size, 0);
+    golden.compare(name + ".migan", [&] {
+        return pipeline.inpaint(image.view, mask, pipeline.inpaintResolution(size.width(), size.height()));
+    });
+}
+
+// Returns the exit status, see Golden::finish().
+int runGolden(VisionMLPipeline &pipeline, GoldenSettings const &settings)
+{
+    Golden golden(settings);
+    checkConversions(golden);
+    checkPadBounds(golden);
+    checkModels(golden, pipeline, "synthetic", syntheticImage(QSize(512, 512)));
+
+    QDir inputs(settings.dir.filePath("inputs"));
+    for (QString const &file : inputs.entryList({"*.png"}, QDir::Files, QDir::Name)) {
+        QImage input(inputs.filePath(file));
+        if (input.isNull()) {
+            golden.expect(file, false, "failed to read input");
+            continue;
+        }
+        checkModels(golden, pipeline, QFileInfo(file).baseName(), input.convertToFormat(QImage::Format_ARGB32));
+    }
+    return golden.finish();
+}
+
+QVector<QSize> parseSizes(QString const &text)
+{
+    QVector<QSize> sizes;
+    for (QString const &item : text.split(',', Qt::SkipEmptyParts)) {
+        QStringList parts = item.split('x');
+        int w = parts.value(0).toInt(), h = parts.value(1).toInt();
+        if (parts.size() != 2 || w < 64 || h < 64) {
+            throw std::runtime_error("Invalid size, expected WxH (at least 64x64): " + item.toStdString());
+        }
+        sizes.append(QSize(w, h));
+    }
+    return sizes;
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName("visionml-bench");
+
+    QCommandLineParser parser;
+    parser.addHelpOption();
+    QCommandLineOption modelsOption("models", "Models directory.", "dir", "models");
+    QCommandLineOption libOption("lib", "Directory containing GGML backend libraries.", "dir");
+    QCommandLineOption sizesOption("sizes", "Image sizes, comma separated.", "WxH,...", "512x512,1024x1024,2048x1536");
+    QCommandLineOption formatsOption("formats", "Paint device color formats: u8, u16, f32.", "list", "u8,u16,f32");
+    QCommandLineOption iterationsOption("iterations", "Measured runs per benchmark.", "n", "5");
+    QCommandLineOption warmupOption("warmup", "Runs before measuring, includes model loading.", "n", "1");
+    QCommandLineOption threadsOption("threads", "CPU threads for inference (0 = physical cores).", "n", "0");
+    QCommandLineOption filterOption("filter", "Only run benchmarks whose name contains this text.", "text");
+    QCommandLineOption outputOption("output", "Write JSON results to this file instead of stdout.", "file");
+    QCommandLineOption replayOption("replay", "Replay a session recorded by the plugin.", "events.jsonl");
+    QCommandLineOption goldenOption("golden", "Compare outputs and run times to references in this directory.", "dir");
+    QCommandLineOption updateGoldenOption("update-golden", "Store references for --golden instead of comparing.");
+    QCommandLineOption timeToleranceOption("time-tolerance", "Allowed slowdown for --golden (0 = don't compare).",
+                                           "factor", "1.5");
+    QCommandLineOption minIoUOption("min-iou", "Minimum IoU of masks for --golden.", "iou", "0.97");
+    QCommandLineOption minPSNROption("min-psnr", "Minimum PSNR of inpaint results for --golden.", "dB", "30");
+    parser.addOptions({modelsOption, libOption, sizesOption, formatsOption, iterationsOption, warmupOption,
+                       threadsOption, filterOption, outputOption, replayOption, goldenOption, updateGoldenOption,
+                       timeToleranceOption, minIoUOption, minPSNROption});
+    parser.process(app);
+
+    Settings settings;
+    settings.iterations = std::max(1, parser.value(iterationsOption).toInt());
+    settings.warmup = std::max(0, parser.value(warmupOption).toInt());
+    settings.filter = parser.value(filterOption);
+    int const threads = parser.value(threadsOption).toInt();
+
+    QString cpuBackend;
+    if (parser.isSet(libOption)) {
+        cpuBackend = VisionMLBackendLoader::loadBackends(parser.value(libOption));
+    } else {
+        ggml_backend_load_all();
+    }
+
+    Benchmark bench(settings);
+    QJsonObject root;
+    try {
+        QVector<QSize> sizes = parseSizes(parser.value(sizesOption));
+        QStringList formats = parser.value(formatsOption).split(',', Qt::SkipEmptyParts);
+
+        VisionMLPipeline pipeline(visp::backend_type::cpu, parser.value(modelsOption).toStdString());
+        pipeline.setModelName(VisionMLTask::segmentation, "sam/MobileSAM-F16.gguf");
+        pipeline.setModelName(VisionMLTask::inpainting, "migan/MIGAN-512-places2-F16.gguf");
+        pipeline.setModelName(VisionMLTask::background_removal, "birefnet/BiRefNet-lite-F16.gguf");
+        for (int i = 0; i < (int)VisionMLTask::_count; ++i) {
+            pipeline.setThreadCount(VisionMLTask(i), threads);
+        }
+        VisionMLImageOps::setThreadCount(threads > 0 ? threads : VisionMLImageOps::physicalCoreCount());
+
+        if (parser.isSet(goldenOption)) {
+            GoldenSettings golden;
+            golden.dir = QDir(parser.value(goldenOption));
+            golden.update = parser.isSet(updateGoldenOption);
+            golden.iterations = settings.iterations;
+            golden.timeTolerance = parser.value(timeToleranceOption).toDouble();
+            golden.minIoU = parser.value(minIoUOption).toDouble();
+            golden.minPSNR = parser.value(minPSNROption).toDouble();
+            if (!golden.update && !golden.dir.exists("golden.json")) {
+                std::fprintf(stderr, "No references in %s, create them with --update-golden\n",
+                             qPrintable(golden.dir.path()));
+                return noReferencesStatus;
+            }
+            return runGolden(pipeline, golden);
+        } else if (parser.isSet(replayOption)) {
+            root["replay"] = parser.value(replayOption);
+            root["steps"] = replay(pipeline, parser.value(replayOption));
+        } else {
+            for (QSize size : sizes) {
+                for (QString const &format : formats) {
+                    benchmarkImageProcessing(bench, size, format);
+                }
+                benchmarkModels(bench, pipeline, size);
+            }
+        }
+
+        ggml_backend_dev_t dev = ggml_backend_get_device(pipeline.backend());
+        root["device"] = QString(ggml_backend_dev_description(dev)).trimmed();
+        root["cpu_backend"] = cpuBackend;
+    } catch (std::exception const &e) {
+        std::fprintf(stderr, "Error: %s\n", e.what());
+        return 1;
+    }
+
+    root["version"] = 1;
+    root["threads"] = threads > 0 ? threads : VisionMLImageOps::physicalCoreCount();
+    if (!parser.isSet(replayOption)) {
+        root["iterations"] = settings.iterations;
+        root["warmup"] = settings.warmup;
+        root["results"] = bench.toJson();
+    }
+    QByteArray json = QJsonDocument(root).toJson();
+
+    if (parser.isSet(outputOption)) {
+        QFile file(parser.value(outputOption));
+        if (!file.open(QIODevice::WriteOnly) || file.write(json) != json.size()) {
+            std::fprintf(stderr, "Failed to write %s\n", qPrintable(file.fileName()));
+            return 1;
+        }
+    } else {
+        std::fwrite(json.constData(), 1, json.size(), stdout);
+    }
+    return 0;
+}
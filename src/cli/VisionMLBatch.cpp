@@ -0,0 +1,407 @@
+// Command line tool which streams a directory of images through background removal or segmentation.
+// Uses the same models and processing as the Krita plugin, but doesn't depend on Krita.
+//
+//   visionml-batch --input <dir> --output <dir> [--task background_removal|segmentation] [--models <dir>]
+//                  [--model <name>] [--backend cpu|gpu] [--workers <n>] [--box x0,y0,x1,y1]
+//                  [--no-refine] [--no-foreground] [--compare]
+
+#include "VisionMLImageOps.h"
+#include "VisionMLModelVariants.h"
+#include "VisionMLPipeline.h"
+
+#include <ggml-backend.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace fs = std::filesystem;
+using Clock = std::chrono::steady_clock;
+
+namespace
+{
+
+struct Options {
+    fs::path input;
+    fs::path output;
+    fs::path models = "models";
+    VisionMLTask task = VisionMLTask::background_removal;
+    std::string model;
+    visp::backend_type backend = visp::backend_type::cpu;
+    int workers = 0;
+    bool hasBox = false;
+    visp::box_2d box{};
+    bool refineEdges = true;
+    bool estimateForeground = true;
+    bool compare = false;
+};
+
+void printUsage()
+{
+    std::puts(
+        "Usage: visionml-batch --input <dir> --output <dir> [options]\n"
+        "  --task <name>       background_removal (default) or segmentation\n"
+        "  --models <dir>      models directory (default: ./models)\n"
+        "  --model <name>      model file relative to models directory\n"
+        "  --backend <type>    cpu (default) or gpu\n"
+        "  --workers <n>       threads for loading and post-processing (default: hardware threads)\n"
+        "  --box x0,y0,x1,y1   box prompt for segmentation (default: whole image)\n"
+        "  --no-refine         don't refine mask edges (background removal)\n"
+        "  --no-foreground     don't estimate foreground colors (background removal)\n"
+        "  --compare           compare all weight variants (F16, Q8_0, ...) of the model instead of writing\n"
+        "                      outputs, results are stored next to the model for latency-based selection");
+}
+
+bool parseArgs(int argc, char **argv, Options &o)
+{
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        auto next = [&]() -> char const * {
+            if (i + 1 >= argc) {
+                throw std::runtime_error("Missing value for " + arg);
+            }
+            return argv[++i];
+        };
+        if (arg == "--input") {
+            o.input = next();
+        } else if (arg == "--output") {
+            o.output = next();
+        } else if (arg == "--models") {
+            o.models = next();
+        } else if (arg == "--model") {
+            o.model = next();
+        } else if (arg == "--task") {
+            std::string task = next();
+            if (task == "segmentation") {
+                o.task = VisionMLTask::segmentation;
+            } else if (task != "background_removal") {
+                throw std::runtime_error("Unknown task: " + task);
+            }
+        } else if (arg == "--backend") {
+            o.backend = std::string(next()) == "gpu" ? visp::backend_type::gpu : visp::backend_type::cpu;
+        } else if (arg == "--workers") {
+            o.workers = std::atoi(next());
+        } else if (arg == "--box") {
+            int x0, y0, x1, y1;
+            if (std::sscanf(next(), "%d,%d,%d,%d", &x0, &y0, &x1, &y1) != 4) {
+                throw std::runtime_error("Invalid box, expected x0,y0,x1,y1");
+            }
+            o.box = visp::box_2d{visp::i32x2{x0, y0}, visp::i32x2{x1, y1}};
+            o.hasBox = true;
+        } else if (arg == "--no-refine") {
+            o.refineEdges = false;
+        } else if (arg == "--no-foreground") {
+            o.estimateForeground = false;
+        } else if (arg == "--compare") {
+            o.compare = true;
+        } else if (arg == "--help" || arg == "-h") {
+            return false;
+        } else {
+            throw std::runtime_error("Unknown argument: " + arg);
+        }
+    }
+    return !o.input.empty() && (!o.output.empty() || o.compare);
+}
+
+std::string defaultModel(VisionMLTask task)
+{
+    return task == VisionMLTask::segmentation ? "sam/MobileSAM-F16.gguf" : "birefnet/BiRefNet-lite-F16.gguf";
+}
+
+// Models expect 4-channel input. Loaded images may have 1, 3 or 4 channels.
+visp::image_data toRGBA(visp::image_data &&image)
+{
+    if (image.format == visp::image_format::rgba_u8) {
+        return std::move(image);
+    }
+    int const channels = visp::n_bytes(image.format);
+    size_t const count = size_t(image.extent[0]) * image.extent[1];
+    visp::image_data result = visp::image_alloc(image.extent, visp::image_format::rgba_u8);
+    uint8_t const *src = image.data.get();
+    uint8_t *dst = result.data.get();
+    for (size_t i = 0; i < count; ++i) {
+        for (int c = 0; c < 3; ++c) {
+            dst[4 * i + c] = src[i * channels + std::min(c, channels - 1)];
+        }
+        dst[4 * i + 3] = 255;
+    }
+    return result;
+}
+
+bool isImageFile(fs::path const &path)
+{
+    std::string ext = path.extension().string();
+    std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return std::tolower(c); });
+    return ext == ".png" || ext == ".jpg" || ext == ".jpeg" || ext == ".bmp" || ext == ".tga";
+}
+
+// Model names are file names, which may contain any character. Non-ASCII UTF-8 is written as is.
+std::string jsonString(std::string const &s)
+{
+    std::string result = "\"";
+    for (char c : s) {
+        if (c == '"' || c == '\\') {
+            result += '\\';
+            result += c;
+        } else if ((unsigned char)c < 0x20) {
+            char escaped[8];
+            std::snprintf(escaped, sizeof(escaped), "\\u%04x", (unsigned)c);
+            result += escaped;
+        } else {
+            result += c;
+        }
+    }
+    return result + "\"";
+}
+
+double seconds(Clock::duration d)
+{
+    return std::chrono::duration<double>(d).count();
+}
+
+visp::image_data runModel(VisionMLPipeline &pipeline, Options const &options, visp::image_view const &image)
+{
+    if (options.task == VisionMLTask::segmentation) {
+        pipeline.encodeSegmentationImage(image);
+        visp::box_2d box = options.box;
+        if (!options.hasBox) {
+            box = visp::box_2d{visp::i32x2{0, 0}, visp::i32x2{image.extent[0] - 1, image.extent[1] - 1}};
+        }
+        return pipeline.predictSegmentationMask(box);
+    }
+    return pipeline.removeBackground(image);
+}
+
+struct VariantResult {
+    std::string name;
+    double latency = 0;      // median ms per image, without model loading
+    double meanAbsError = 0; // compared to reference masks, 0..1
+    double iou = 1;          // of binarized masks, compared to reference
+};
+
+// Runs every weight variant of the model on all images and compares masks with the most precise variant. Results are
+// printed and written to "<model>.variants.json", which the plugin uses to pick a variant by latency budget.
+int runCompare(VisionMLPipeline &pipeline, Options const &options, std::vector<fs::path> const &files)
+{
+    std::string const model = options.model.empty() ? defaultModel(options.task) : options.model;
+    std::string const base = VisionMLModelVariants::baseName(model);
+    fs::path const dir = (options.models / model).parent_path();
+    std::string const prefix = fs::path(model).parent_path().generic_string() + "/";
+
+    std::vector<std::string> variants;
+    for (fs::directory_entry const &entry : fs::directory_iterator(dir)) {
+        std::string name = prefix + entry.path().filename().string();
+        if (entry.is_regular_file() && entry.path().extension() == ".gguf"
+            && VisionMLModelVariants::baseName(name) == base) {
+            variants.push_back(name);
+        }
+    }
+    auto rank = [](std::string const &name) {
+        return VisionMLModelVariants::precisionRank(VisionMLModelVariants::weightType(name));
+    };
+    std::sort(variants.begin(), variants.end(), [&](auto const &a, auto const &b) { return rank(a) > rank(b); });
+    if (variants.empty()) {
+        std::fprintf(stderr, "No variants of %s found in %s\n", model.c_str(), dir.string().c_str());
+        return 1;
+    }
+
+    std::vector<visp::image_data> images;
+    for (fs::path const &file : files) {
+        images.push_back(toRGBA(visp::image_load(file.string().c_str())));
+    }
+
+    std::vector<visp::image_data> reference;
+    std::vector<VariantResult> results;
+    for (std::string const &variant : variants) {
+        pipeline.setModelName(options.task, variant);
+        VariantResult result{variant};
+        std::vector<double> times;
+        double errorSum = 0, iouSum = 0;
+        for (size_t i = 0; i < images.size(); ++i) {
+            auto t0 = Clock::now();
+            visp::image_data mask = runModel(pipeline, options, images[i]);
+            times.push_back(seconds(Clock::now() - t0) * 1000.0);
+
+            if (variant == variants.front()) {
+                reference.push_back(std::move(mask));
+                continue;
+            }
+            uint8_t const *a = reference[i].data.get();
+            uint8_t const *b = mask.data.get();
+            size_t const count = size_t(mask.extent[0]) * mask.extent[1];
+            int64_t diff = 0, intersection = 0, both = 0;
+            for (size_t p = 0; p < count; ++p) {
+                diff += std::abs(int(a[p]) - int(b[p]));
+                intersection += (a[p] >= 128) && (b[p] >= 128);
+                both += (a[p] >= 128) || (b[p] >= 128);
+            }
+            errorSum += double(diff) / (255.0 * count);
+            iouSum += both > 0 ? double(intersection) / both : 1.0;
+        }
+        // The first image includes loading the model, leave it out unless it's the only one.
+        if (times.size() > 1) {
+            times.erase(times.begin());
+        }
+        std::sort(times.begin(), times.end());
+        result.latency = times[times.size() / 2];
+        if (variant != variants.front()) {
+            result.meanAbsError = errorSum / images.size();
+            result.iou = iouSum / images.size();
+        }
+        results.push_back(result);
+    }
+
+    std::printf("%-48s %12s %12s %8s\n", "Variant", "Latency (ms)", "Mean error", "IoU");
+    for (VariantResult const &r : results) {
+        std::printf("%-48s %12.1f %12.5f %8.4f\n", r.name.c_str(), r.latency, r.meanAbsError, r.iou);
+    }
+
+    fs::path target = options.models / (base + ".variants.json");
+    std::ofstream out(target);
+    out << "{\n  \"reference\": " << jsonString(variants.front()) << ",\n  \"images\": " << images.size()
+        << ",\n  \"models\": {\n";
+    for (size_t i = 0; i < results.size(); ++i) {
+        VariantResult const &r = results[i];
+        out << "    " << jsonString(r.name) << ": {\"latency_ms\": " << r.latency
+            << ", \"mean_abs_error\": " << r.meanAbsError << ", \"iou\": " << r.iou << "}"
+            << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    out << "  }\n}\n";
+    if (!out) {
+        std::fprintf(stderr, "Failed to write %s\n", target.string().c_str());
+        return 1;
+    }
+    std::printf("Results written to %s\n", target.string().c_str());
+    return 0;
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    Options options;
+    try {
+        if (!parseArgs(argc, argv, options)) {
+            printUsage();
+            return 1;
+        }
+    } catch (std::exception const &e) {
+        std::fprintf(stderr, "%s\n", e.what());
+        printUsage();
+        return 1;
+    }
+
+    std::vector<fs::path> files;
+    for (fs::directory_entry const &entry : fs::directory_iterator(options.input)) {
+        if (entry.is_regular_file() && isImageFile(entry.path())) {
+            files.push_back(entry.path());
+        }
+    }
+    std::sort(files.begin(), files.end());
+    if (files.empty()) {
+        std::fprintf(stderr, "No images found in %s\n", options.input.string().c_str());
+        return 1;
+    }
+    if (!options.compare) {
+        fs::create_directories(options.output);
+    }
+
+    ggml_backend_load_all();
+    std::unique_ptr<VisionMLPipeline> pipeline;
+    try {
+        pipeline = std::make_unique<VisionMLPipeline>(options.backend, options.models.string());
+        pipeline->setModelName(options.task, options.model.empty() ? defaultModel(options.task) : options.model);
+    } catch (std::exception const &e) {
+        std::fprintf(stderr, "Failed to initialize backend: %s\n", e.what());
+        return 1;
+    }
+    if (options.compare) {
+        try {
+            return runCompare(*pipeline, options, files);
+        } catch (std::exception const &e) {
+            std::fprintf(stderr, "%s\n", e.what());
+            return 1;
+        }
+    }
+
+    int workerCount = options.workers > 0 ? options.workers : int(std::thread::hardware_concurrency());
+    workerCount = std::clamp(workerCount, 1, int(files.size()));
+    // Workers run their own loading and post-processing, leave intra-image parallelism to the inference backend.
+    VisionMLImageOps::setThreadCount(1);
+
+    std::mutex inferenceMutex;
+    std::atomic<size_t> nextFile{0};
+    std::atomic<int> failed{0};
+    std::atomic<int64_t> pixels{0};
+    std::atomic<int64_t> loadTime{0}, inferenceTime{0}, postTime{0};
+    auto micros = [](Clock::duration d) {
+        return std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+    };
+
+    auto work = [&]() {
+        for (size_t i = nextFile++; i < files.size(); i = nextFile++) {
+            fs::path const &file = files[i];
+            try {
+                auto t0 = Clock::now();
+                visp::image_data image = toRGBA(visp::image_load(file.string().c_str()));
+                auto t1 = Clock::now();
+
+                visp::image_data mask;
+                {
+                    std::lock_guard<std::mutex> lock(inferenceMutex);
+                    mask = runModel(*pipeline, options, image);
+                }
+                auto t2 = Clock::now();
+
+                fs::path target = options.output / file.filename().replace_extension(".png");
+                if (options.task == VisionMLTask::segmentation) {
+                    visp::image_save(mask, target.string().c_str());
+                } else {
+                    visp::image_data result = VisionMLImageOps::extractForeground(
+                        image, mask, options.refineEdges, options.estimateForeground);
+                    visp::image_save(result, target.string().c_str());
+                }
+                auto t3 = Clock::now();
+
+                loadTime += micros(t1 - t0);
+                inferenceTime += micros(t2 - t1);
+                postTime += micros(t3 - t2);
+                pixels += int64_t(image.extent[0]) * image.extent[1];
+            } catch (std::exception const &e) {
+                std::fprintf(stderr, "%s: %s\n", file.string().c_str(), e.what());
+                ++failed;
+            }
+        }
+    };
+
+    auto start = Clock::now();
+    std::vector<std::thread> workers;
+    for (int i = 0; i < workerCount; ++i) {
+        workers.emplace_back(work);
+    }
+    for (std::thread &t : workers) {
+        t.join();
+    }
+    double total = seconds(Clock::now() - start);
+
+    int processed = int(files.size()) - failed;
+    double perImage = processed > 0 ? 1.0 / processed / 1000.0 : 0.0;
+    std::printf("Processed %d images (%d failed) in %.2f s with %d workers\n", processed, failed.load(), total,
+                workerCount);
+    std::printf("Throughput: %.2f images/s, %.2f MPix/s\n", processed / total, pixels / total / 1e6);
+    std::printf("Average per image: load %.1f ms, inference %.1f ms, post-processing %.1f ms\n",
+                loadTime * perImage,
+                inferenceTime * perImage,
+                postTime * perImage);
+    return failed > 0 ? 2 : 0;
+}
@@ -0,0 +1,296 @@
+#include "BackgroundRemovalBatch.h"
+#include "VisionMLImageOps.h"
+
+#include "KisMainWindow.h"
+#include "KisPart.h"
+#include "KisViewManager.h"
+#include "KoUpdater.h"
+#include "filter/kis_filter_registry.h"
+#include "kis_bookmarked_configuration_manager.h"
+#include "kis_command_utils.h"
+#include "kis_node.h"
+#include "kis_node_manager.h"
+#include "kis_paint_device.h"
+#include "kis_paint_device_frames_interface.h"
+#include "kis_processing_applicator.h"
+#include "kis_transaction.h"
+#include "kundo2command.h"
+#include <klocalizedstring.h>
+
+#include <QDebug>
+#include <QSet>
+
+#include <deque>
+#include <future>
+#include <memory>
+#include <optional>
+#include <vector>
+
+namespace
+{
+
+// Replaces the content of one raster keyframe. The batch uploads the frame while processing, so the first redo
+// does nothing.
+class UploadFrameCommand : public KUndo2Command
+{
+public:
+    UploadFrameCommand(KisPaintDeviceSP device, int frameId, KisPaintDeviceSP before, KisPaintDeviceSP after)
+        : m_device(device)
+        , m_frameId(frameId)
+        , m_before(before)
+        , m_after(after)
+    {
+    }
+
+    void redo() override
+    {
+        if (m_firstRedo) {
+            m_firstRedo = false;
+            return;
+        }
+        m_device->framesInterface()->uploadFrame(m_frameId, m_after);
+    }
+
+    void undo() override
+    {
+        m_device->framesInterface()->uploadFrame(m_frameId, m_before);
+    }
+
+private:
+    KisPaintDeviceSP m_device;
+    int m_frameId;
+    KisPaintDeviceSP m_before;
+    KisPaintDeviceSP m_after;
+    bool m_firstRedo = true;
+};
+
+struct PreparedItem {
+    int index = -1;
+    KisPaintDeviceSP target; // receives the result: the layer device, or a copy of the keyframe
+    KisPaintDeviceSP original; // keyframe content before processing, for undo
+    QRect bounds;
+    VisionMLImage image;
+};
+
+// Reads the input of an item. Runs on the batch thread: the frames interface of a device is not thread-safe, and
+// the batch uploads results of earlier keyframes while later ones are read.
+PreparedItem readItem(BackgroundRemovalBatch::Item const &item, int index)
+{
+    PreparedItem result;
+    result.index = index;
+    if (item.frameId >= 0) {
+        result.target = new KisPaintDevice(item.device->colorSpace());
+        item.device->framesInterface()->writeFrameToDevice(item.frameId, result.target);
+        result.original = new KisPaintDevice(*result.target);
+    } else {
+        result.target = item.device;
+    }
+    return result;
+}
+
+PreparedItem prepareItem(PreparedItem item, int threads, VisionMLTimings *timings)
+{
+    VisionMLImageOps::ScopedThreadLimit limit(threads);
+    VisionMLScopedTimer timer(timings, "background_removal.prepare_image");
+    item.bounds = item.target->exactBounds();
+    if (item.bounds.width() >= 64 && item.bounds.height() >= 64) {
+        item.image = VisionMLImage::prepare(*item.target, item.bounds);
+    }
+    return item;
+}
+
+// Options of the last background removal filter run, or the defaults if the filter was never used.
+BackgroundRemovalFilter::Options lastUsedOptions()
+{
+    KisFilterSP filter = KisFilterRegistry::instance()->value(BackgroundRemovalFilter::id().id());
+    if (filter && filter->bookmarkManager()) {
+        KisSerializableConfigurationSP config =
+            filter->bookmarkManager()->load(KisBookmarkedConfigurationManager::ConfigLastUsed);
+        if (auto *properties = dynamic_cast<KisPropertiesConfiguration *>(config.data())) {
+            return BackgroundRemovalFilter::Options::fromConfig(*properties);
+        }
+    }
+    return {};
+}
+
+} // namespace
+
+BackgroundRemovalBatch::BackgroundRemovalBatch(QSharedPointer<VisionModels> vision,
+                                               BackgroundRemovalFilter::Options options)
+    : m_vision(std::move(vision))
+    , m_options(options)
+{
+}
+
+void BackgroundRemovalBatch::setInFlightLimit(int limit)
+{
+    m_inFlightLimit = std::max(1, limit);
+}
+
+QVector<BackgroundRemovalBatch::Item> BackgroundRemovalBatch::collectItems(KisNodeList const &nodes)
+{
+    QVector<Item> items;
+    for (KisNodeSP const &node : nodes) {
+        KisPaintDeviceSP device = node->paintDevice();
+        if (!node->inherits("KisPaintLayer") || !device) {
+            continue;
+        }
+        if (KisPaintDeviceFramesInterface *frames = device->framesInterface()) {
+            for (int frameId : frames->frames()) {
+                items.append({node, device, frameId});
+            }
+        } else {
+            items.append({node, device, -1});
+        }
+    }
+    return items;
+}
+
+KUndo2Command *BackgroundRemovalBatch::run(QVector<Item> const &items, KoUpdater *progress)
+{
+    KisCommandUtils::CompositeCommand *undo = new KisCommandUtils::CompositeCommand;
+
+    // Devices which are modified in place need their transaction open before any stage writes to them.
+    std::vector<std::unique_ptr<KisTransaction>> transactions;
+    for (Item const &item : items) {
+        if (item.frameId < 0) {
+            transactions.emplace_back(new KisTransaction(item.device));
+        }
+    }
+
+    auto reportError = [this](std::exception const &e) {
+        Q_EMIT m_report.errorOccurred(QString(e.what()));
+    };
+
+    std::deque<std::future<PreparedItem>> preparing;
+    std::deque<std::future<PreparedItem>> finishing;
+    int next = 0;
+    int processed = 0;
+
+    // Preparing and post-processing run while inference is using its threads. They share what is left of Krita's
+    // thread budget, so that the stages together don't oversubscribe the CPU.
+    int const inferenceThreads = m_vision->inferenceThreadCount(VisionMLTask::background_removal);
+    int const stageThreads = std::max(1, (VisionMLImageOps::threadCount() - inferenceThreads) / (2 * m_inFlightLimit));
+
+    auto cancelled = [progress]() {
+        return progress && progress->interrupted();
+    };
+
+    auto startPreparing = [&]() {
+        while (next < items.size() && int(preparing.size()) < m_inFlightLimit && !cancelled()) {
+            try {
+                preparing.push_back(VisionMLImageOps::runAsync(
+                    [item = readItem(items[next], next), stageThreads, timings = m_vision->timings()]() mutable {
+                        return prepareItem(std::move(item), stageThreads, timings);
+                    }));
+            } catch (const std::exception &e) {
+                reportError(e);
+            }
+            ++next;
+        }
+    };
+
+    auto commitOne = [&]() {
+        try {
+            PreparedItem done = finishing.front().get();
+            Item const &item = items[done.index];
+            if (item.frameId >= 0) {
+                item.device->framesInterface()->uploadFrame(item.frameId, done.target);
+                undo->addCommand(new UploadFrameCommand(item.device, item.frameId, done.original, done.target));
+            }
+        } catch (const std::exception &e) {
+            reportError(e);
+        }
+        finishing.pop_front();
+    };
+
+    startPreparing();
+    while (!preparing.empty()) {
+        std::optional<PreparedItem> current;
+        try {
+            current = preparing.front().get();
+        } catch (const std::exception &e) {
+            reportError(e);
+        }
+        preparing.pop_front();
+        if (progress) {
+            progress->setProgress(100 * processed++ / items.size());
+        }
+        if (cancelled()) {
+            continue; // only wait for items which are already being prepared
+        }
+        startPreparing(); // read the next items while this one is in the network
+
+        if (!current || !current->image) {
+            continue;
+        }
+        visp::image_data mask;
+        try {
+            mask = m_vision->removeBackground(current->image.view);
+        } catch (const std::exception &e) {
+            reportError(e);
+            continue;
+        }
+
+        while (int(finishing.size()) >= m_inFlightLimit) {
+            commitOne();
+        }
+        finishing.push_back(VisionMLImageOps::runAsync([options = m_options,
+                                                        timings = m_vision->timings(),
+                                                        stageThreads,
+                                                        item = std::move(*current),
+                                                        mask = std::move(mask)]() mutable {
+            VisionMLImageOps::ScopedThreadLimit limit(stageThreads);
+            VisionMLScopedTimer timer(timings, "background_removal.apply_mask");
+            BackgroundRemovalFilter::applyMask(*item.target, item.bounds, item.image, std::move(mask), options);
+            return std::move(item);
+        }));
+    }
+    while (!finishing.empty()) {
+        commitOne();
+    }
+    if (progress) {
+        progress->setProgress(100);
+    }
+
+    for (std::unique_ptr<KisTransaction> &transaction : transactions) {
+        undo->addCommand(transaction->endAndTake());
+    }
+    QSet<KisNode *> updated;
+    for (Item const &item : items) {
+        if (!updated.contains(item.node.data())) {
+            updated.insert(item.node.data());
+            item.node->setDirty();
+        }
+    }
+    return undo;
+}
+
+void BackgroundRemovalBatch::runOnSelectedLayers(QSharedPointer<VisionModels> vision)
+{
+    KisMainWindow *window = KisPart::instance()->currentMainwindow();
+    KisViewManager *view = window ? window->viewManager() : nullptr;
+    if (!view || !view->image()) {
+        return;
+    }
+    QVector<Item> items = collectItems(view->nodeManager()->selectedNodes());
+    if (items.isEmpty()) {
+        view->showFloatingMessage(i18n("Select paint layers to remove the background from"), QIcon());
+        return;
+    }
+    qDebug() << "[VisionMLPlugin] Background removal batch with" << items.size() << "items";
+
+    QSharedPointer<BackgroundRemovalBatch> batch(new BackgroundRemovalBatch(std::move(vision), lastUsedOptions()));
+    KoUpdaterPtr progress = view->createThreadedUpdater(i18n("Background Removal"));
+    KisProcessingApplicator applicator(view->image(),
+                                       nullptr,
+                                       KisProcessingApplicator::NONE,
+                                       KisImageSignalVector(),
+                                       kundo2_i18n("Background Removal"));
+    applicator.applyCommand(new KisCommandUtils::LambdaCommand([batch, items, progress]() -> KUndo2Command * {
+                                return batch->run(items, progress.data());
+                            }),
+                            KisStrokeJobData::BARRIER,
+                            KisStrokeJobData::EXCLUSIVE);
+    applicator.end();
+}
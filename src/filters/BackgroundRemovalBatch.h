@@ -0,0 +1,50 @@
+#ifndef BACKGROUND_REMOVAL_BATCH_H
+#define BACKGROUND_REMOVAL_BATCH_H
+
+#include "BackgroundRemovalFilter.h"
+#include "VisionML.h"
+
+#include "kis_types.h"
+
+#include <QRect>
+#include <QSharedPointer>
+#include <QVector>
+
+class KUndo2Command;
+class KoUpdater;
+
+// Runs background removal on many layers and animation frames. Reading the input of the next item and
+// post-processing of the previous item overlap with inference of the current one.
+class BackgroundRemovalBatch
+{
+public:
+    struct Item {
+        KisNodeSP node;
+        KisPaintDeviceSP device;
+        int frameId = -1; // raster keyframe of an animated device, or -1 for the device itself
+    };
+
+    BackgroundRemovalBatch(QSharedPointer<VisionModels> vision, BackgroundRemovalFilter::Options options);
+
+    // Maximum number of items which are being prepared or post-processed while one item is in inference.
+    void setInFlightLimit(int limit);
+
+    // Collects items for all paint layers among the given nodes. Animated layers contribute one item per keyframe.
+    static QVector<Item> collectItems(KisNodeList const &nodes);
+
+    // Processes all items and returns a command which undoes the changes. Reports progress per item, and stops
+    // before the next item when the user cancels. Items which are done by then keep their result.
+    KUndo2Command *run(QVector<Item> const &items, KoUpdater *progress = nullptr);
+
+    // Runs the batch on the layers selected in the active view, as a single undoable stroke. Uses the options of the
+    // last background removal filter run.
+    static void runOnSelectedLayers(QSharedPointer<VisionModels> vision);
+
+private:
+    QSharedPointer<VisionModels> m_vision;
+    BackgroundRemovalFilter::Options m_options;
+    int m_inFlightLimit = 2;
+    VisionMLErrorReporter m_report;
+};
+
+#endif // BACKGROUND_REMOVAL_BATCH_H
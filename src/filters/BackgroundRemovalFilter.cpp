@@ -1,4 +1,6 @@
 #include "BackgroundRemovalFilter.h"
+#include "VisionMLImageOps.h"
+#include "VisionMLTimings.h"
 
 #include "KisGlobalResourcesInterface.h"
 #include "KoUpdater.h"
@@ -10,6 +12,51 @@
 #include <QLabel>
 #include <QVBoxLayout>
 #include <QCheckBox>
+#include <QVector>
+
+#include <algorithm>
+#include <optional>
+#include <vector>
+
+namespace
+{
+
+// Paint devices store pixels in tiles of 64x64. Stripes are aligned to whole tile rows, so that post-processing
+// of different stripes never touches the same tile. The tile grid starts at the device offset (originY).
+int const tileSize = 64;
+
+QVector<QRect> tileStripes(QRect const &rect, int originY)
+{
+    QVector<QRect> stripes;
+    for (int y = rect.top(); y <= rect.bottom();) {
+        int tileTop = originY + ((y - originY) & ~(tileSize - 1));
+        int next = std::min(tileTop + tileSize, rect.bottom() + 1);
+        stripes.append(QRect(rect.left(), y, rect.width(), next - y));
+        y = next;
+    }
+    return stripes;
+}
+
+// Sets mask as alpha of the prepared BGRA image within the stripe, and writes it to the device.
+// Stripes always span the full image width, so their rows are contiguous in memory.
+void writeMaskedStripe(KisPaintDevice &device,
+                       visp::image_span const &image,
+                       visp::image_view const &mask,
+                       QRect const &stripe,
+                       QPoint const &offset)
+{
+    uint8_t *first = (uint8_t *)image.data + size_t(stripe.top()) * image.stride;
+    for (int y = 0; y < stripe.height(); ++y) {
+        uint8_t *pixels = first + size_t(y) * image.stride;
+        uint8_t const *alpha = (uint8_t const *)mask.data + size_t(y + stripe.top()) * mask.extent[0];
+        for (int x = 0; x < stripe.width(); ++x) {
+            pixels[4 * x + 3] = alpha[x];
+        }
+    }
+    device.writeBytes(first, stripe.translated(offset));
+}
+
+} // namespace
 
 //
 // Configuration widget
@@ -30,12 +77,16 @@ public:
         m_modelSelectWidget = new VisionMLModelSelect(m_vision, VisionMLTask::background_removal, true);
         layout->addWidget(m_modelSelectWidget);
 
-        VisionMLBackendWidget *backendSelect = new VisionMLBackendWidget(m_vision, true);
+        VisionMLBackendWidget *backendSelect =
+            new VisionMLBackendWidget(m_vision, VisionMLTask::background_removal, true);
         layout->addWidget(backendSelect);
 
         m_foregroundEstimationCheckBox = new QCheckBox(i18n("Estimate pixel foreground contribution"), this);
         layout->addWidget(m_foregroundEstimationCheckBox);
 
+        m_edgeRefinementCheckBox = new QCheckBox(i18n("Refine edges using full resolution image"), this);
+        layout->addWidget(m_edgeRefinementCheckBox);
+
         layout->addStretch();
 
         connect(m_vision.get(), &VisionModels::modelNameChanged, this, &BackgroundRemovalWidget::handleModelChange);
@@ -44,6 +95,10 @@ public:
                 &QCheckBox::stateChanged,
                 this,
                 &KisConfigWidget::sigConfigurationItemChanged);
+        connect(m_edgeRefinementCheckBox,
+                &QCheckBox::stateChanged,
+                this,
+                &KisConfigWidget::sigConfigurationItemChanged);
     }
 
     void setConfiguration(const KisPropertiesConfigurationSP config) override
@@ -59,6 +114,8 @@ public:
         if (config->getProperty("foreground_estimation", value)) {
             m_foregroundEstimationCheckBox->setChecked(value.toBool());
         }
+        // Off for configurations without the key, see Options.
+        m_edgeRefinementCheckBox->setChecked(config->getProperty("edge_refinement", value) && value.toBool());
     }
 
     KisPropertiesConfigurationSP configuration() const override
@@ -68,6 +125,7 @@ public:
         config->setProperty("model", m_vision->modelName(VisionMLTask::background_removal));
         config->setProperty("backend", m_vision->backend() == visp::backend_type::gpu ? "gpu" : "cpu");
         config->setProperty("foreground_estimation", m_foregroundEstimationCheckBox->isChecked());
+        config->setProperty("edge_refinement", m_edgeRefinementCheckBox->isChecked());
         return config;
     }
 
@@ -87,6 +145,7 @@ private:
     QSharedPointer<VisionModels> m_vision;
     VisionMLModelSelect *m_modelSelectWidget = nullptr;
     QCheckBox *m_foregroundEstimationCheckBox = nullptr;
+    QCheckBox *m_edgeRefinementCheckBox = nullptr;
 };
 
 //
@@ -98,6 +157,8 @@ BackgroundRemovalFilter::BackgroundRemovalFilter(QSharedPointer<VisionModels> vi
 {
     setSupportsPainting(false);
     setSupportsAdjustmentLayers(false);
+    // Inference needs the whole image at once, Krita's per-tile threading would run it for every tile.
+    // Post-processing after inference is parallelized internally instead.
     setSupportsThreading(false);
     setSupportsLevelOfDetail(false);
     setColorSpaceIndependence(TO_RGBA8);
@@ -114,9 +175,70 @@ KisFilterConfigurationSP BackgroundRemovalFilter::defaultConfiguration(KisResour
     config->setProperty("model", m_vision->modelName(VisionMLTask::background_removal));
     config->setProperty("backend", m_vision->backend() == visp::backend_type::gpu ? "gpu" : "cpu");
     config->setProperty("foreground_estimation", true);
+    config->setProperty("edge_refinement", true);
     return config;
 }
 
+BackgroundRemovalFilter::Options BackgroundRemovalFilter::Options::fromConfig(KisPropertiesConfiguration const &config)
+{
+    Options options;
+    if (QVariant configValue; config.getProperty("foreground_estimation", configValue)) {
+        options.estimateForeground = configValue.toBool();
+    }
+    if (QVariant configValue; config.getProperty("edge_refinement", configValue)) {
+        options.refineEdges = configValue.toBool();
+    }
+    return options;
+}
+
+void BackgroundRemovalFilter::applyMask(KisPaintDevice &device,
+                                        QRect const &rect,
+                                        VisionMLImage &image,
+                                        visp::image_data mask,
+                                        Options const &options)
+{
+    if (options.refineEdges) {
+        mask = VisionMLImageOps::refineMatte(image.view, mask);
+    }
+    if (image.view.format == visp::image_format::bgra_u8) {
+        // Post-processing and write-back run per stripe of tiles in parallel.
+        QRect bounds(rect.topLeft(), image.data.size());
+        QVector<QRect> stripes = tileStripes(bounds, device.y());
+        VisionMLImageOps::parallelFor(stripes.size(), 1, [&](int begin, int end) {
+            std::optional<VisionMLImageOps::ForegroundEstimator> estimator;
+            std::vector<uint8_t> buffer;
+            for (int i = begin; i < end; ++i) {
+                QRect stripe = stripes[i].translated(-bounds.topLeft());
+                if (options.estimateForeground) {
+                    if (!estimator) {
+                        estimator.emplace(image.view, mask);
+                    }
+                    size_t rowSize = size_t(stripe.width()) * 4;
+                    buffer.resize(rowSize * stripe.height());
+                    estimator->estimateRows(stripe.top(), stripe.bottom() + 1, buffer.data(), rowSize);
+                    device.writeBytes(buffer.data(), stripes[i]);
+                } else {
+                    writeMaskedStripe(device, image.view, mask, stripe, bounds.topLeft());
+                }
+            }
+        });
+    } else {
+        QImage resultImage = image.data;
+        if (options.estimateForeground) {
+            resultImage = QImage(image.data.size(), QImage::Format_ARGB32);
+            uint8_t *resultBits = resultImage.bits();
+            size_t resultStride = resultImage.bytesPerLine();
+            VisionMLImageOps::parallelFor(resultImage.height(), 64, [&](int begin, int end) {
+                VisionMLImageOps::ForegroundEstimator estimator(image.view, mask);
+                estimator.estimateRows(begin, end, resultBits + begin * resultStride, resultStride);
+            });
+        } else {
+            visp::image_set_alpha(image.view, mask);
+        }
+        device.convertFromQImage(resultImage, nullptr, rect.x(), rect.y());
+    }
+}
+
 void BackgroundRemovalFilter::processImpl(KisPaintDeviceSP device,
                                           const QRect &applyRect,
                                           const KisFilterConfigurationSP config,
@@ -126,7 +248,13 @@ void BackgroundRemovalFilter::processImpl(KisPaintDeviceSP device,
         progressUpdater->setAutoNestedName(i18n("Background Removal"));
     }
 
-    VisionMLImage image = VisionMLImage::prepare(*device, applyRect);
+    VisionMLTimings *timings = m_vision->timings();
+    VisionMLScopedTimer jobTimer(timings, "background_removal.filter");
+    VisionMLImage image;
+    {
+        VisionMLScopedTimer timer(timings, "background_removal.prepare_image");
+        image = VisionMLImage::prepare(*device, applyRect);
+    }
     if (!image) {
         qWarning() << "Background Removal: No image data available in the specified rectangle.";
         return;
@@ -139,33 +267,22 @@ void BackgroundRemovalFilter::processImpl(KisPaintDeviceSP device,
     if (progressUpdater)
         progressUpdater->setProgress(9);
 
-    bool estimateForeground = true;
-    if (QVariant configValue; config->getProperty("foreground_estimation", configValue)) {
-        estimateForeground = configValue.toBool();
-    }
+    Options options = Options::fromConfig(*config);
 
     try {
         visp::image_data mask = m_vision->removeBackground(image.view);
 
         if (progressUpdater)
-            progressUpdater->setProgress(90);
-
-        QImage resultImage;
-        if (estimateForeground) {
-            visp::image_data maskF32 = visp::image_u8_to_f32(mask, visp::image_format::alpha_f32);
-            visp::image_data imageF32 = visp::image_u8_to_f32(image.view, visp::image_format::rgba_f32);
-            visp::image_data fgF32 = visp::image_estimate_foreground(imageF32, maskF32);
-            visp::image_data fg = visp::image_f32_to_u8(fgF32, visp::image_format::rgba_u8);
-            resultImage = VisionMLImage::convertToQImage(fg);
-        } else {
-            visp::image_set_alpha(image.view, mask);
-            resultImage = image.data;
+            progressUpdater->setProgress(85);
+
+        {
+            VisionMLScopedTimer timer(timings, "background_removal.apply_mask");
+            applyMask(*device, applyRect, image, std::move(mask), options);
         }
+
         if (progressUpdater)
             progressUpdater->setProgress(99);
 
-        device->convertFromQImage(resultImage, nullptr, applyRect.x(), applyRect.y());
-
     } catch (const std::exception &e) {
         Q_EMIT m_report.errorOccurred(QString(e.what()));
     }
@@ -26,6 +26,18 @@ public:
     QRect changedRect(const QRect &, const KisFilterConfigurationSP, int lod) const override;
     QRect neededRect(const QRect &, const KisFilterConfigurationSP, int lod) const override;
 
+    struct Options {
+        bool estimateForeground = true;
+        bool refineEdges = false; // off for configurations saved before it existed, they keep their look
+
+        static Options fromConfig(KisPropertiesConfiguration const &);
+    };
+
+    // Post-processing after inference: refines the mask if enabled, and writes the image with mask as alpha (or the
+    // estimated foreground) to the device at rect. Runs in parallel over stripes of tiles.
+    static void
+    applyMask(KisPaintDevice &device, QRect const &rect, VisionMLImage &image, visp::image_data mask, Options const &);
+
 private:
     QSharedPointer<VisionModels> m_vision;
     VisionMLErrorReporter m_report;
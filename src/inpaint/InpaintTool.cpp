@@ -1,7 +1,10 @@
 #include "InpaintTool.h"
 #include "VisionML.h"
+#include "VisionMLRecorder.h"
+#include "VisionMLTimings.h"
 
 #include "QApplication"
+#include "QJsonArray"
 #include "QPainterPath"
 #include "QVBoxLayout"
 
@@ -28,47 +31,6 @@
 #include "kis_paint_layer.h"
 #include "kis_resources_snapshot.h"
 
-namespace
-{
-
-QRect padBounds(const QRect &bounds, int pad, int targetSize, const QRect &imageBounds)
-{
-    QRect padded = bounds.adjusted(pad, pad, pad, pad);
-
-    if (padded.width() < targetSize) {
-        int diff = targetSize - padded.width();
-        int leftPadding = diff / 2;
-        int rightPadding = diff - leftPadding;
-
-        if (padded.left() - leftPadding < imageBounds.left()) {
-            leftPadding = padded.left() - imageBounds.left();
-            rightPadding = diff - leftPadding;
-        } else if (padded.right() + rightPadding > imageBounds.right()) {
-            rightPadding = imageBounds.right() - padded.right();
-            leftPadding = diff - rightPadding;
-        }
-        padded.adjust(-leftPadding, 0, rightPadding, 0);
-    }
-
-    if (padded.height() < targetSize) {
-        int diff = targetSize - padded.height();
-        int topPadding = diff / 2;
-        int bottomPadding = diff - topPadding;
-
-        if (padded.top() - topPadding < imageBounds.top()) {
-            topPadding = padded.top() - imageBounds.top();
-            bottomPadding = diff - topPadding;
-        } else if (padded.bottom() + bottomPadding > imageBounds.bottom()) {
-            bottomPadding = imageBounds.bottom() - padded.bottom();
-            topPadding = diff - bottomPadding;
-        }
-        padded.adjust(0, -topPadding, 0, bottomPadding);
-    }
-    return padded.intersected(imageBounds);
-}
-
-}
-
 class VisionMLInpaintCommand : public KisTransactionBasedCommand
 {
 public:
@@ -85,22 +47,28 @@ public:
     {
     }
 
-    static const int pad = 64;
-    static const int minSize = 512;
-
     KUndo2Command *paint() override
     {
         KisTransaction transaction(m_imageDev);
+        VisionMLTimings *timings = m_vision->timings();
+        VisionMLScopedTimer jobTimer(timings, "inpainting.job");
+        auto start = VisionMLRecorder::Clock::now();
 
         try {
-            QRect fullBounds = m_maskDev->nonDefaultPixelArea();
-            QRect bounds = padBounds(fullBounds, pad, minSize, m_imageDev->exactBounds());
+            VisionModels::InpaintRegion region =
+                m_vision->inpaintRegion(m_maskDev->nonDefaultPixelArea(), m_imageDev->exactBounds());
+            QRect const bounds = region.bounds;
+            int const resolution = region.resolution;
             if (bounds.isEmpty()) {
                 qWarning() << "Inpaint bounds are empty, nothing to do.";
                 return transaction.endAndTake();
             }
 
-            VisionMLImage image = VisionMLImage::prepare(*m_imageDev, bounds);
+            VisionMLImage image;
+            {
+                VisionMLScopedTimer timer(timings, "inpainting.prepare_image");
+                image = VisionMLImage::prepare(*m_imageDev, bounds);
+            }
 
             KoColorSpace const *maskCS = m_maskDev->colorSpace();
             if (maskCS->pixelSize() != 1 || maskCS->id() != "ALPHA") {
@@ -108,17 +76,18 @@ public:
             }
 
             QImage maskData = QImage(bounds.width(), bounds.height(), QImage::Format_Alpha8);
-            m_maskDev->readBytes(maskData.bits(), bounds.x(), bounds.y(), bounds.width(), bounds.height());
+            {
+                VisionMLScopedTimer timer(timings, "inpainting.read_mask");
+                m_maskDev->readBytes(maskData.bits(), bounds.x(), bounds.y(), bounds.width(), bounds.height());
+            }
             visp::image_span maskView({bounds.width(), bounds.height()}, visp::image_format::alpha_u8, maskData.bits());
             maskView.stride = maskData.bytesPerLine();
 
-            visp::image_data result = m_vision->inpaint(image.view, maskView);
-            visp::image_data maskF32 = visp::image_u8_to_f32(maskView, visp::image_format::alpha_f32);
-            visp::image_data maskTmp = visp::image_alloc(maskF32.extent, visp::image_format::alpha_f32);
-            visp::image_erosion(maskF32, maskTmp, 1);
-            visp::image_blur(maskTmp, maskF32, 1);
-            visp::image_f32_to_u8(maskF32, maskView);
-            visp::image_set_alpha(result, maskView);
+            auto inferenceStart = VisionMLRecorder::Clock::now();
+            visp::image_data result = m_vision->inpaintBlended(image.view, maskView, resolution);
+            auto inferenceEnd = VisionMLRecorder::Clock::now();
+
+            VisionMLScopedTimer timer(timings, "inpainting.composite");
 
             QImage resultImage(result.extent[0], result.extent[1], QImage::Format_RGBA8888);
             // copy scanlines, row stride might be different
@@ -134,6 +103,19 @@ public:
             p.setCompositeOpId(COMPOSITE_OVER);
             p.setSelection(m_selection);
             p.bitBlt(bounds.topLeft(), comp, bounds);
+
+            if (VisionMLRecorder *recorder = m_vision->recorder()) {
+                auto end = VisionMLRecorder::Clock::now();
+                QJsonObject event{
+                    {"model", m_vision->activeModelName(VisionMLTask::inpainting)},
+                    {"bounds", QJsonArray{bounds.x(), bounds.y(), bounds.width(), bounds.height()}},
+                    {"resolution", resolution},
+                    {"image", recorder->describeImage(image.data, image.view)},
+                    {"mask", recorder->describeImage(maskData, maskView)},
+                    {"inference_ms", VisionMLRecorder::milliseconds(inferenceStart, inferenceEnd)},
+                };
+                recorder->record("inpainting", event, start, end);
+            }
         } catch (const std::exception &e) {
             Q_EMIT m_report.errorOccurred(QString(e.what()));
         }
@@ -189,6 +171,9 @@ void InpaintTool::activate(const QSet<KoShape *> &shapes)
 
 void InpaintTool::deactivate()
 {
+    if (VisionMLRecorder *recorder = m_d->vision->recorder()) {
+        recorder->record("unload", {{"task", toString(VisionMLTask::inpainting)}});
+    }
     m_d->vision->unload(VisionMLTask::inpainting);
     KisToolPaint::deactivate();
 }
@@ -371,7 +356,7 @@ QWidget *InpaintTool::createOptionWidget()
     m_d->modelSelectWidget = new VisionMLModelSelect(m_d->vision, VisionMLTask::inpainting);
     layout->addWidget(m_d->modelSelectWidget);
 
-    VisionMLBackendWidget *backendSelect = new VisionMLBackendWidget(m_d->vision);
+    VisionMLBackendWidget *backendSelect = new VisionMLBackendWidget(m_d->vision, VisionMLTask::inpainting);
     layout->addWidget(backendSelect);
 
     return m_d->optionsWidget;
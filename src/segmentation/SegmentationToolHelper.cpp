@@ -1,4 +1,7 @@
 #include "SegmentationToolHelper.h"
+#include "VisionMLImageOps.h"
+#include "VisionMLRecorder.h"
+#include "VisionMLTimings.h"
 
 #include "KisCursorOverrideLock.h"
 #include "KisOptionButtonStrip.h"
@@ -9,16 +12,21 @@
 #include "kis_image_animation_interface.h"
 #include "kis_paint_device.h"
 #include "kis_selection.h"
-#include "kis_selection_filters.h"
 #include "kis_selection_tool_helper.h"
 
 #include <QApplication>
+#include <QCheckBox>
 #include <QDebug>
 #include <QImage>
+#include <QJsonArray>
 #include <QLibrary>
 #include <QMessageBox>
+#include <QPainterPath>
+#include <QPolygonF>
 #include <QRect>
 
+#include <algorithm>
+
 namespace
 {
 
@@ -32,27 +40,71 @@ visp::box_2d convert(QRect const &rect)
     return visp::box_2d{convert(rect.topLeft()), convert(rect.bottomRight())};
 }
 
-QRect imageBounds(QPoint offset, visp::i32x2 extent)
+QJsonObject toJson(SegmentationToolHelper::SelectionOptions const &o)
 {
-    return QRect(offset.x(), offset.y(), extent[0], extent[1]);
+    return {{"action", int(o.action)}, {"grow", o.grow}, {"feather", o.feather}, {"anti_alias", o.antiAlias}};
 }
 
-void adjustSelection(KisPixelSelectionSP const &selection, SegmentationToolHelper::SelectionOptions const &o)
+// Anti-aliasing only applies to hard edges, feathered selections are already smooth.
+bool antiAliases(SegmentationToolHelper::SelectionOptions const &o)
 {
-    if (o.grow > 0) {
-        KisGrowSelectionFilter biggy(o.grow, o.grow);
-        biggy.process(selection, selection->selectedRect().adjusted(-o.grow, -o.grow, o.grow, o.grow));
-    } else if (o.grow < 0) {
-        KisShrinkSelectionFilter tiny(-o.grow, -o.grow, false);
-        tiny.process(selection, selection->selectedRect());
+    return o.antiAlias && o.feather <= 0;
+}
+
+// Grows/shrinks, feathers and anti-aliases the mask according to the options, then writes it to the selection. Only the
+// bounding box of the result is written, the rest of the selection keeps default tiles. Masks usually cover a small
+// part of the image, so this is much less work than running Krita's selection filters on the written selection.
+//
+// Also traces the outline around every selected pixel of the final mask (after anti-aliasing), like Krita does, so that
+// Krita doesn't have to compute it from the selection on the UI thread. Returns false if there is no outline.
+bool writeMask(KisPixelSelectionSP const &selection,
+               visp::image_data const &mask,
+               QPoint offset,
+               SegmentationToolHelper::SelectionOptions const &o,
+               VisionMLTimings *timings,
+               QPainterPath &outline)
+{
+    VisionMLImageOps::MaskBounds content = VisionMLImageOps::maskBounds(mask);
+    if (content.empty()) {
+        return true;
+    }
+    int const margin = std::max(o.grow, 0) + std::max(o.feather, 0) + (antiAliases(o) ? 1 : 0);
+    VisionMLImageOps::MaskBounds region = content;
+    region.x -= margin;
+    region.y -= margin;
+    region.width += 2 * margin;
+    region.height += 2 * margin;
+    visp::image_data adjusted = VisionMLImageOps::cropMask(mask, region);
+    {
+        VisionMLScopedTimer timer(timings, "segmentation.adjust_selection");
+        VisionMLImageOps::adjustMask(adjusted, o.grow, o.feather);
+    }
+    if (antiAliases(o)) {
+        VisionMLScopedTimer timer(timings, "segmentation.anti_alias");
+        VisionMLImageOps::antiAliasMask(adjusted);
     }
-    if (o.feather > 0) {
-        KisFeatherSelectionFilter feathery(o.feather);
-        feathery.process(selection, selection->selectedRect().adjusted(-o.feather, -o.feather, o.feather, o.feather));
-    } else if (o.antiAlias) {
-        KisAntiAliasSelectionFilter antiAliasFilter;
-        antiAliasFilter.process(selection, selection->selectedRect());
+    {
+        VisionMLScopedTimer timer(timings, "segmentation.write_selection");
+        selection->writeBytes(adjusted.data.get(),
+                              QRect(offset.x() + region.x, offset.y() + region.y, region.width, region.height));
     }
+    VisionMLScopedTimer timer(timings, "segmentation.trace_outline");
+    // Any coverage counts as selected. With 0 or 255 only, contours at 50% run along the edges of the pixels.
+    uint8_t *pixels = adjusted.data.get();
+    std::transform(pixels, pixels + size_t(region.width) * region.height, pixels, [](uint8_t v) {
+        return uint8_t(v > 0 ? 255 : 0);
+    });
+    QPointF const origin(offset.x() + region.x, offset.y() + region.y);
+    for (VisionMLImageOps::Contour const &contour : VisionMLImageOps::traceContours(adjusted)) {
+        QPolygonF polygon;
+        polygon.reserve(int(contour.size()));
+        for (VisionMLImageOps::ContourPoint const &p : contour) {
+            polygon.append(origin + QPointF(p.x, p.y));
+        }
+        outline.addPolygon(polygon);
+        outline.closeSubpath();
+    }
+    return !outline.isEmpty();
 }
 
 } // namespace
@@ -78,7 +130,11 @@ SegmentationToolHelper::SegmentationToolHelper(QSharedPointer<VisionModels> shar
 
 void SegmentationToolHelper::processImage(ImageInput const &input, KisProcessingApplicator &applicator)
 {
-    KisPaintDeviceSP inputImage = selectPaintDevice(input, applicator);
+    KisPaintDeviceSP inputImage;
+    {
+        VisionMLScopedTimer timer(m_shared->timings(), "segmentation.select_paint_device");
+        inputImage = selectPaintDevice(input, applicator);
+    }
     if (!inputImage) {
         return;
     }
@@ -90,10 +146,30 @@ void SegmentationToolHelper::processImage(ImageInput const &input, KisProcessing
     }
 
     KUndo2Command *cmd = new KisCommandUtils::LambdaCommand(
-        [report = &m_errorReporter, inputImage, shared = m_shared.get()]() mutable -> KUndo2Command * {
+        [report = &m_errorReporter,
+         inputImage,
+         shared = m_shared.get(),
+         sampleLayers = input.sampleLayersMode]() mutable -> KUndo2Command * {
             try {
-                if (VisionMLImage image = VisionMLImage::prepare(*inputImage)) {
+                auto start = VisionMLRecorder::Clock::now();
+                VisionMLImage image;
+                {
+                    VisionMLScopedTimer timer(shared->timings(), "segmentation.prepare_image");
+                    image = VisionMLImage::prepare(*inputImage);
+                }
+                if (image) {
+                    auto encodeStart = VisionMLRecorder::Clock::now();
                     shared->encodeSegmentationImage(image.view);
+                    if (VisionMLRecorder *recorder = shared->recorder()) {
+                        auto end = VisionMLRecorder::Clock::now();
+                        QJsonObject event{
+                            {"model", shared->activeModelName(VisionMLTask::segmentation)},
+                            {"sample_layers", sampleLayers},
+                            {"image", recorder->describeImage(image.data, image.view)},
+                            {"inference_ms", VisionMLRecorder::milliseconds(encodeStart, end)},
+                        };
+                        recorder->record("segmentation.encode", event, start, end);
+                    }
                 }
             } catch (const std::exception &e) {
                 Q_EMIT report->errorOccurred(QString(e.what()));
@@ -134,7 +210,11 @@ void SegmentationToolHelper::applySelectionMask(ImageInput const &input,
                                        KisImageSignalVector(),
                                        kundo2_i18n("Select Segment"));
 
-    KisPaintDeviceSP inputImage = selectPaintDevice(input, applicator);
+    KisPaintDeviceSP inputImage;
+    {
+        VisionMLScopedTimer timer(m_shared->timings(), "segmentation.select_paint_device");
+        inputImage = selectPaintDevice(input, applicator);
+    }
 
     if (m_mode == SegmentationMode::fast) {
         if (m_requiresUpdate || !m_shared->hasSegmentationImage() || input != m_lastInput) {
@@ -165,6 +245,7 @@ void SegmentationToolHelper::applySelectionMask(ImageInput const &input,
     KisPixelSelectionSP selection = new KisPixelSelection(new KisSelectionDefaultBounds(inputImage));
 
     KUndo2Command *cmd = new KisCommandUtils::LambdaCommand([mode = m_mode,
+                                                             refineEdges = m_refineEdges,
                                                              shared = m_shared.get(),
                                                              report = &m_errorReporter,
                                                              inputImage,
@@ -172,31 +253,67 @@ void SegmentationToolHelper::applySelectionMask(ImageInput const &input,
                                                              prompt,
                                                              selection,
                                                              options]() mutable -> KUndo2Command * {
+        VisionMLTimings *timings = shared->timings();
+        VisionMLScopedTimer jobTimer(timings, "segmentation.selection_job");
+        VisionMLRecorder *recorder = shared->recorder();
+        auto start = VisionMLRecorder::Clock::now();
+        QJsonObject event;
         try {
             visp::image_data mask;
+            VisionMLImage image; // input of precise mode, described for the recorder after the job is timed
+            QPainterPath outline;
+            bool outlineValid = false;
             if (mode == SegmentationMode::fast) {
                 if (!shared->hasSegmentationImage()) {
                     return nullptr; // Early out when there was no input image to process.
                 }
+                auto predictStart = VisionMLRecorder::Clock::now();
                 if (prompt.canConvert<QPoint>()) {
                     QPoint point = prompt.toPoint() - bounds.topLeft();
                     mask = shared->predictSegmentationMask(convert(point));
+                    event["point"] = QJsonArray{point.x(), point.y()};
                 } else  {
                     QRect rect = prompt.toRect().intersected(bounds).translated(-bounds.topLeft());
                     mask = shared->predictSegmentationMask(convert(rect));
+                    event["box"] = QJsonArray{rect.left(), rect.top(), rect.right(), rect.bottom()};
                 }
-                selection->writeBytes(mask.data.get(), imageBounds(bounds.topLeft(), mask.extent));
+                event["inference_ms"] = VisionMLRecorder::milliseconds(predictStart, VisionMLRecorder::Clock::now());
+                outlineValid = writeMask(selection, mask, bounds.topLeft(), options, timings, outline);
             } else {
                 QRect rect = prompt.toRect().intersected(bounds);
-                VisionMLImage image = VisionMLImage::prepare(*inputImage, rect);
+                {
+                    VisionMLScopedTimer timer(timings, "segmentation.prepare_image");
+                    image = VisionMLImage::prepare(*inputImage, rect);
+                }
                 if (!image) {
                     return nullptr;
                 }
+                auto inferenceStart = VisionMLRecorder::Clock::now();
                 mask = shared->removeBackground(image.view);
-                selection->writeBytes(mask.data.get(), rect);
+                event["inference_ms"] = VisionMLRecorder::milliseconds(inferenceStart, VisionMLRecorder::Clock::now());
+                if (refineEdges) {
+                    VisionMLScopedTimer timer(timings, "segmentation.refine_matte");
+                    mask = VisionMLImageOps::refineMatte(image.view, mask);
+                }
+                event["refine_edges"] = refineEdges;
+                outlineValid = writeMask(selection, mask, rect.topLeft(), options, timings, outline);
+            }
+            if (outlineValid) {
+                selection->setOutlineCache(outline);
+            } else {
+                selection->invalidateOutlineCache();
+            }
+            if (recorder) {
+                auto end = VisionMLRecorder::Clock::now();
+                bool const fast = mode == SegmentationMode::fast;
+                VisionMLTask task = fast ? VisionMLTask::segmentation : VisionMLTask::background_removal;
+                event["model"] = shared->activeModelName(task);
+                event["options"] = toJson(options);
+                if (image) {
+                    event["image"] = recorder->describeImage(image.data, image.view);
+                }
+                recorder->record(fast ? "segmentation.predict" : "segmentation.precise", event, start, end);
             }
-            adjustSelection(selection, options);
-            selection->invalidateOutlineCache();
         } catch (const std::exception &e) {
             Q_EMIT report->errorOccurred(QString(e.what()));
         }
@@ -244,6 +361,18 @@ KisPaintDeviceSP SegmentationToolHelper::mergeColorLayers(KisImageSP const &imag
     KisMergeLabeledLayersCommand::ReferenceNodeInfoListSP newReferenceNodeList(
         new KisMergeLabeledLayersCommand::ReferenceNodeInfoList);
     const int currentTime = image->animationInterface()->currentTime();
+
+    // Merging runs as a stroke job, record its duration with commands before and after it.
+    VisionMLTimings *timings = m_shared->timings();
+    auto start = std::make_shared<VisionMLTimings::Clock::time_point>();
+    if (timings) {
+        applicator.applyCommand(new KisCommandUtils::LambdaCommand([start]() -> KUndo2Command * {
+                                    *start = VisionMLTimings::Clock::now();
+                                    return nullptr;
+                                }),
+                                KisStrokeJobData::SEQUENTIAL,
+                                KisStrokeJobData::EXCLUSIVE);
+    }
     applicator.applyCommand(
         new KisMergeLabeledLayersCommand(image,
                                          m_referenceNodeList,
@@ -255,6 +384,16 @@ KisPaintDeviceSP SegmentationToolHelper::mergeColorLayers(KisImageSP const &imag
                                          m_previousTime != currentTime),
         KisStrokeJobData::SEQUENTIAL,
         KisStrokeJobData::EXCLUSIVE);
+    if (timings) {
+        applicator.applyCommand(new KisCommandUtils::LambdaCommand([timings, start]() -> KUndo2Command * {
+                                    timings->record("segmentation.merge_color_layers",
+                                                    *start,
+                                                    VisionMLTimings::Clock::now());
+                                    return nullptr;
+                                }),
+                                KisStrokeJobData::SEQUENTIAL,
+                                KisStrokeJobData::EXCLUSIVE);
+    }
     m_referencePaintDevice = newReferencePaintDevice;
     m_referenceNodeList = newReferenceNodeList;
     m_previousTime = currentTime;
@@ -265,6 +404,9 @@ void SegmentationToolHelper::deactivate()
 {
     m_referencePaintDevice = nullptr;
     m_referenceNodeList = nullptr;
+    if (VisionMLRecorder *recorder = m_shared->recorder()) {
+        recorder->record("unload", {{"task", toString(VisionMLTask::segmentation)}});
+    }
     m_shared->unload(VisionMLTask::segmentation);
 }
 
@@ -280,6 +422,15 @@ void SegmentationToolHelper::addOptions(KisSelectionOptions *selectionWidget, bo
         KisOptionCollectionWidgetWithHeader *segmentationModeSection =
             new KisOptionCollectionWidgetWithHeader(i18n("Mode"));
         segmentationModeSection->setPrimaryWidget(modeSelect);
+
+        // Only precise mode produces soft mattes which benefit from edge refinement.
+        m_refineEdgesCheckBox = new QCheckBox(i18n("Refine edges"));
+        m_refineEdgesCheckBox->setToolTip(i18n("Align soft edges of the selection with edges in the image"));
+        m_refineEdgesCheckBox->setChecked(m_refineEdges);
+        m_refineEdgesCheckBox->setEnabled(m_mode == SegmentationMode::precise);
+        segmentationModeSection->appendWidget("refineEdges", m_refineEdgesCheckBox);
+        connect(m_refineEdgesCheckBox, &QCheckBox::toggled, this, [this](bool checked) { m_refineEdges = checked; });
+
         selectionWidget->insertWidget(2, "segmentationModeSection", segmentationModeSection);
 
         connect(modeSelect,
@@ -288,7 +439,7 @@ void SegmentationToolHelper::addOptions(KisSelectionOptions *selectionWidget, bo
                 SLOT(switchMode(KoGroupButton *, bool)));
     }
 
-    VisionMLBackendWidget *backendSelect = new VisionMLBackendWidget(m_shared);
+    VisionMLBackendWidget *backendSelect = new VisionMLBackendWidget(m_shared, VisionMLTask::segmentation);
     selectionWidget->insertWidget(3, "segmentationBackendSection", backendSelect);
 }
 
@@ -297,5 +448,8 @@ void SegmentationToolHelper::switchMode(KoGroupButton *button, bool checked)
     if (checked) {
         m_mode = button == m_modeFastButton ? SegmentationMode::fast : SegmentationMode::precise;
         m_requiresUpdate = true;
+        if (m_refineEdgesCheckBox) {
+            m_refineEdgesCheckBox->setEnabled(m_mode == SegmentationMode::precise);
+        }
     }
 }
@@ -17,6 +17,7 @@
 #include <QSharedPointer>
 
 class KisProcessingApplicator;
+class QCheckBox;
 class KoGroupButton;
 
 // Class which implements the shared functionality for segmentation tools. Each tool has its own instance.
@@ -73,6 +74,8 @@ private:
     SegmentationMode m_mode = SegmentationMode::fast;
     KoGroupButton *m_modeFastButton = nullptr;
     KoGroupButton *m_modePreciseButton = nullptr;
+    bool m_refineEdges = true;
+    QCheckBox *m_refineEdgesCheckBox = nullptr;
 
     // Stroke thread
     VisionMLErrorReporter m_errorReporter;
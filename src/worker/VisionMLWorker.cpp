@@ -0,0 +1,303 @@
+// Out-of-process inference worker. Owns backends and models on behalf of the Krita plugin and keeps them loaded across
+// Krita sessions, so model load time is paid once rather than every time Krita starts. A crash in the backend only
+// takes down the worker, the plugin falls back to in-process inference. See VisionMLWorkerProtocol.h for messages.
+//
+//   visionml-worker --models <dir> [--lib <dir>] [--idle-timeout <minutes>]
+
+#include "VisionMLBackendLoader.h"
+#include "VisionMLPipeline.h"
+#include "VisionMLWorkerProtocol.h"
+
+#include <ggml-backend.h>
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QDebug>
+#include <QLocalServer>
+#include <QLocalSocket>
+#include <QSharedMemory>
+#include <QTimer>
+
+#include <deque>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+using namespace VisionMLWorkerProtocol;
+
+namespace
+{
+
+// Shared memory segments of recent requests stay attached, clients only switch to a new one when they need more.
+size_t const attachedSegmentsLimit = 4;
+
+// Thrown for predicts of a session which has no encoded segmentation image in the worker.
+class NoSegmentationImage : public std::runtime_error
+{
+public:
+    NoSegmentationImage()
+        : std::runtime_error("No image was encoded for segmentation in this session")
+    {
+    }
+};
+
+class Worker
+{
+public:
+    explicit Worker(QString modelsDirectory)
+        : m_modelsDirectory(std::move(modelsDirectory))
+    {
+    }
+
+    Response handle(Request const &request)
+    {
+        Response response;
+        if (request.magic != magic) {
+            response.status = failed;
+            setString(response.message, "Protocol version mismatch");
+            return response;
+        }
+        try {
+            process(request, response);
+        } catch (NoSegmentationImage const &e) {
+            response.status = noSegmentationImage;
+            setString(response.message, QByteArray(e.what()));
+        } catch (std::exception const &e) {
+            qWarning() << "[VisionML Worker] Request failed:" << e.what();
+            response.status = failed;
+            setString(response.message, QByteArray(e.what()));
+        }
+        return response;
+    }
+
+private:
+    void process(Request const &request, Response &response)
+    {
+        if (request.task < 0 || request.task >= int(VisionMLTask::_count)) {
+            throw std::runtime_error("Invalid task");
+        }
+        VisionMLTask task = VisionMLTask(request.task);
+        Backend &b = backend(visp::backend_type(request.backend));
+        VisionMLPipeline &p = *b.pipeline;
+        if (request.modelName[0] != 0) {
+            p.setModelName(task, request.modelName);
+        }
+        applySettings(b, task, request);
+        QByteArray const session(request.session, qstrnlen(request.session, sizeof(request.session)));
+
+        switch (request.op) {
+        case Op::info: {
+            ggml_backend_dev_t dev = ggml_backend_get_device(p.backend());
+            QString desc = QString("%1 [%2]").arg(QString(ggml_backend_dev_description(dev)).trimmed(),
+                                                  ggml_backend_dev_name(dev));
+            setString(response.message, desc.toUtf8());
+            break;
+        }
+        case Op::encodeSegmentation:
+            b.segmentationSession.clear();
+            p.encodeSegmentationImage(view(request, request.image));
+            b.segmentationSession = session;
+            break;
+        case Op::predictSegmentationPoint:
+            requireSegmentationImage(b, session);
+            writeResult(request, p.predictSegmentationMask(visp::i32x2{request.args[0], request.args[1]}), response);
+            break;
+        case Op::predictSegmentationBox: {
+            requireSegmentationImage(b, session);
+            visp::box_2d box{visp::i32x2{request.args[0], request.args[1]},
+                             visp::i32x2{request.args[2], request.args[3]}};
+            writeResult(request, p.predictSegmentationMask(box), response);
+            break;
+        }
+        case Op::removeBackground:
+            writeResult(request, p.removeBackground(view(request, request.image)), response);
+            break;
+        case Op::inpaintResolution:
+            response.value = p.inpaintResolution(request.args[0], request.args[1]);
+            break;
+        case Op::inpaint: {
+            visp::image_data result =
+                p.inpaint(view(request, request.image), view(request, request.mask), request.args[0]);
+            writeResult(request, result, response);
+            break;
+        }
+        case Op::unload:
+            p.unload(task);
+            break;
+        case Op::memoryUsage: {
+            VisionMLPipeline::MemoryUsage usage = p.memoryUsage(task);
+            response.memory[0] = usage.weights;
+            response.memory[1] = usage.compute;
+            response.memory[2] = usage.cache;
+            break;
+        }
+        case Op::releaseMemory:
+            p.releaseMemory(task);
+            break;
+        default:
+            throw std::runtime_error("Unknown request");
+        }
+    }
+
+    // Pipeline of a backend type, shared by all sessions. The SAM image embedding in it belongs to the session which
+    // encoded it last. Other sessions must encode their own image first, otherwise they'd get masks for the wrong
+    // image. Changing the segmentation model also drops the embedding.
+    struct Backend {
+        std::unique_ptr<VisionMLPipeline> pipeline;
+        QByteArray segmentationSession;
+        std::string profileFile;
+    };
+
+    Backend &backend(visp::backend_type type)
+    {
+        Backend &b = m_backends[int(type)];
+        if (!b.pipeline) {
+            b.pipeline = std::make_unique<VisionMLPipeline>(type, m_modelsDirectory.toStdString());
+        }
+        return b;
+    }
+
+    void requireSegmentationImage(Backend const &b, QByteArray const &session)
+    {
+        if (session.isEmpty() || b.segmentationSession != session || !b.pipeline->hasSegmentationImage()) {
+            throw NoSegmentationImage();
+        }
+    }
+
+    // Settings come with every request, clients may be configured differently.
+    void applySettings(Backend &b, VisionMLTask task, Request const &request)
+    {
+        b.pipeline->setThreadCount(task, request.threads);
+        b.pipeline->setThreadPinning(request.pinThreads != 0);
+        std::string profileFile(request.profileFile, qstrnlen(request.profileFile, sizeof(request.profileFile)));
+        if (profileFile != b.profileFile) {
+            b.pipeline->setGraphProfile(profileFile);
+            b.profileFile = std::move(profileFile);
+        }
+    }
+
+    QSharedMemory &segment(Request const &request)
+    {
+        QString key = QString::fromUtf8(request.sharedMemoryKey);
+        for (auto &memory : m_segments) {
+            if (memory->key() == key) {
+                return *memory;
+            }
+        }
+        auto memory = std::make_unique<QSharedMemory>();
+        memory->setKey(key);
+        if (key.isEmpty() || !memory->attach()) {
+            throw std::runtime_error("Failed to attach shared memory: " + memory->errorString().toStdString());
+        }
+        m_segments.push_front(std::move(memory));
+        if (m_segments.size() > attachedSegmentsLimit) {
+            m_segments.pop_back();
+        }
+        return *m_segments.front();
+    }
+
+    visp::image_view view(Request const &request, ImageDesc const &desc)
+    {
+        QSharedMemory &memory = segment(request);
+        auto format = visp::image_format(desc.format);
+        if (desc.width <= 0 || desc.height <= 0 || desc.stride < desc.width * n_bytes(format)
+            || desc.offset + uint64_t(desc.stride) * desc.height > uint64_t(memory.size())) {
+            throw std::runtime_error("Invalid image location in shared memory");
+        }
+        visp::image_view result({desc.width, desc.height}, format, static_cast<uint8_t *>(memory.data()) + desc.offset);
+        result.stride = desc.stride;
+        return result;
+    }
+
+    void writeResult(Request const &request, visp::image_data const &image, Response &response)
+    {
+        QSharedMemory &memory = segment(request);
+        size_t const size = size_t(image.extent[0]) * image.extent[1] * n_bytes(image.format);
+        if (request.result.offset + size > uint64_t(memory.size())) {
+            throw std::runtime_error("Result doesn't fit into shared memory");
+        }
+        memcpy(static_cast<uint8_t *>(memory.data()) + request.result.offset, image.data.get(), size);
+        response.result.width = image.extent[0];
+        response.result.height = image.extent[1];
+        response.result.stride = image.extent[0] * n_bytes(image.format);
+        response.result.format = int32_t(image.format);
+        response.result.offset = request.result.offset;
+    }
+
+    QString m_modelsDirectory;
+    std::map<int, Backend> m_backends;                     // by backend type
+    std::deque<std::unique_ptr<QSharedMemory>> m_segments; // most recent first
+};
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName("visionml-worker");
+
+    QCommandLineParser parser;
+    parser.addHelpOption();
+    QCommandLineOption modelsOption("models", "Models directory.", "dir");
+    QCommandLineOption libOption("lib", "Directory containing GGML backend libraries.", "dir");
+    QCommandLineOption idleOption("idle-timeout", "Exit after being idle for this long (0 = never).", "minutes", "0");
+    parser.addOptions({modelsOption, libOption, idleOption});
+    parser.process(app);
+    if (!parser.isSet(modelsOption)) {
+        parser.showHelp(1);
+    }
+
+    // Only one worker per user. Exit if another one is already running.
+    QLocalSocket probe;
+    probe.connectToServer(serverName());
+    if (probe.waitForConnected(200)) {
+        qDebug() << "[VisionML Worker] Already running.";
+        return 0;
+    }
+    QLocalServer::removeServer(serverName()); // stale socket after a crash
+
+    if (parser.isSet(libOption)) {
+        VisionMLBackendLoader::loadBackends(parser.value(libOption));
+    } else {
+        ggml_backend_load_all();
+    }
+
+    Worker worker(parser.value(modelsOption));
+    QLocalServer server;
+    server.setSocketOptions(QLocalServer::UserAccessOption);
+    if (!server.listen(serverName())) {
+        qCritical() << "[VisionML Worker] Failed to listen on" << serverName() << ":" << server.errorString();
+        return 1;
+    }
+
+    QTimer idleTimer;
+    int idleMinutes = parser.value(idleOption).toInt();
+    idleTimer.setSingleShot(true);
+    idleTimer.setInterval(idleMinutes * 60 * 1000);
+    QObject::connect(&idleTimer, &QTimer::timeout, &app, &QCoreApplication::quit);
+    if (idleMinutes > 0) {
+        idleTimer.start();
+    }
+
+    QObject::connect(&server, &QLocalServer::newConnection, [&]() {
+        while (QLocalSocket *socket = server.nextPendingConnection()) {
+            QObject::connect(socket, &QLocalSocket::disconnected, socket, &QObject::deleteLater);
+            QObject::connect(socket, &QLocalSocket::readyRead, socket, [&, socket]() {
+                while (socket->bytesAvailable() >= qint64(sizeof(Request))) {
+                    Request request;
+                    socket->read(reinterpret_cast<char *>(&request), sizeof(Request));
+                    Response response = worker.handle(request);
+                    socket->write(reinterpret_cast<char const *>(&response), sizeof(Response));
+                    socket->flush();
+                }
+                if (idleMinutes > 0) {
+                    idleTimer.start();
+                }
+            });
+        }
+    });
+
+    qDebug() << "[VisionML Worker] Listening on" << server.fullServerName();
+    return app.exec();
+}
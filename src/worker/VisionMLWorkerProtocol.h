@@ -0,0 +1,95 @@
+#ifndef VISION_ML_WORKER_PROTOCOL_H_
+#define VISION_ML_WORKER_PROTOCOL_H_
+
+// Messages exchanged between the plugin and the out-of-process inference worker (visionml-worker). Each request is a
+// fixed-size Request sent over a local socket, answered by a fixed-size Response. Image data is not sent over the
+// socket: the client places inputs in a shared memory segment it owns, and the worker writes results to the same
+// segment at the offset given in the request.
+//
+// The worker is shared by all Krita instances of a user (see serverName). Models are shared, settings are sent with
+// every request, and the encoded segmentation image belongs to the session which encoded it.
+
+#include <QString>
+#include <QtGlobal>
+
+#include <cstdint>
+#include <cstring>
+
+namespace VisionMLWorkerProtocol
+{
+
+constexpr uint32_t magic = 0x564d4c35; // "VML5", bump when changing the layout or meaning of messages
+
+enum class Op : int32_t {
+    info,
+    encodeSegmentation,
+    predictSegmentationPoint,
+    predictSegmentationBox,
+    removeBackground,
+    inpaintResolution,
+    inpaint,
+    unload,
+    memoryUsage,
+    releaseMemory,
+};
+
+// Location of an image in the shared memory segment. Format is a visp::image_format value.
+struct ImageDesc {
+    int32_t width = 0;
+    int32_t height = 0;
+    int32_t stride = 0;
+    int32_t format = 0;
+    uint64_t offset = 0;
+};
+
+struct Request {
+    uint32_t magic = VisionMLWorkerProtocol::magic;
+    Op op = Op::info;
+    int32_t backend = 0; // visp::backend_type
+    int32_t task = 0;    // VisionMLTask
+    int32_t args[4] = {}; // point, box or inpaint resolution
+    ImageDesc image;
+    ImageDesc mask;
+    ImageDesc result; // only offset and stride are used, the worker fills in the rest in the response
+    int32_t threads = 0;      // CPU inference threads for the task, 0 = number of physical cores
+    int32_t pinThreads = 0;   // see VisionMLPipeline::setThreadPinning
+    char session[64] = {};    // unique per client instance
+    char sharedMemoryKey[64] = {}; // QSharedMemory::key, not the native key
+    char modelName[256] = {};
+    char profileFile[512] = {}; // see VisionMLPipeline::setGraphProfile, empty = off
+};
+
+enum Status : int32_t {
+    ok = 0,
+    failed = 1,
+    noSegmentationImage = 2, // the session has no encoded image, eg. another session encoded one since
+};
+
+struct Response {
+    uint32_t magic = VisionMLWorkerProtocol::magic;
+    int32_t status = ok;     // Status, message contains the error
+    int32_t value = 0;       // result of queries like inpaintResolution
+    uint64_t memory[3] = {}; // result of memoryUsage: weights, compute, cache
+    ImageDesc result;
+    char message[512] = {};
+};
+
+// Copies a string into a fixed-size field, truncating if needed.
+template<size_t N>
+void setString(char (&field)[N], QByteArray const &value)
+{
+    size_t len = qMin(size_t(value.size()), N - 1);
+    memcpy(field, value.constData(), len);
+    field[len] = 0;
+}
+
+// Local socket name. The worker is shared by all Krita instances of the same user.
+inline QString serverName()
+{
+    QString user = qEnvironmentVariable("USER", qEnvironmentVariable("USERNAME"));
+    return QStringLiteral("krita-visionml-worker-") + user;
+}
+
+} // namespace VisionMLWorkerProtocol
+
+#endif // VISION_ML_WORKER_PROTOCOL_H_